@@ -0,0 +1,235 @@
+
+/*
+ * bus.h
+ * lucas@pamorana.net (2024)
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BUS_H
+#define _BUS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include <modbus/modbus-rtu.h>
+
+#include "influx.h"
+#include "regmap.h"
+#include "rtt.h"
+#include "sched.h"
+#include "stats.h"
+#include "ticker.h"
+#include "upload.h"
+
+/*
+ * a meter on a bus. "name" is the value of its "meter" tag.
+ */
+struct bus_meter
+{
+	int         slave;
+	const char *name;
+};
+
+/*
+ * the serial line and the meters of one RS-485 bus.
+ * all meters on a bus are of the same type, "table", which is
+ * the map named "map" in the configuration (see config.h).
+ */
+struct bus_config
+{
+	const char             *device;
+	int                     baud;
+	char                    parity;    /* 'N', 'E', 'O'               */
+	int                     data_bits;
+	int                     stop_bits;
+	uint32_t                turnaround_us; /* slave processing time   */
+	uint32_t                rts_delay_us;  /* from RTS to Tx          */
+	const struct bus_meter *meters;
+	size_t                  nmeters;
+	const char             *map;
+	const struct reg_table *table;
+};
+
+/*
+ * the modbus transactions of one read of one meter, since the last report.
+ * every request is counted in "rtt", answered or not. "bytes" counts both
+ * directions: the request, and the response if any. a "retry" is a request
+ * to a meter that was taken for gone (see rtt.h).
+ */
+struct bus_xfer
+{
+	struct hist rtt;        /* [us] request to response, or timeout */
+	uint64_t    crc;
+	uint64_t    timeouts;
+	uint64_t    retries;
+	uint64_t    bytes;
+};
+
+/*
+ * what a bus polls, and how: everything that is built from a bus_config.
+ * the register map is planned for the line speed of the bus.
+ */
+struct bus_plan
+{
+	struct bus_config       config;
+
+	struct reg_map         *map;
+	uint16_t               *image;      /* [map->nimage]              */
+	struct influx_fields    fields;     /* [map->ndefs]               */
+	struct influx_template *templates;  /* [nmeters * map->ngroups]   */
+	struct influx_key      *tagsets;    /* [nmeters]                  */
+	struct influx_key      *groups;     /* [map->ngroups] measurement */
+
+	struct sched            sched;
+	struct rtt             *rtt;        /* [nmeters]                  */
+
+	/* what goes into the next report; a new plan starts from scratch */
+	struct bus_xfer        *xfers;      /* [nmeters * map->nreads]    */
+	struct hist             encode;     /* [ns] decode and render     */
+};
+
+/*
+ * one bus, polled by a thread of its own.
+ *
+ * buses share nothing but the upload thread, where every bus has a
+ * source of its own, so the meters on one bus never wait for another.
+ *
+ * a group that could not be read, in part or at all, is written with an
+ * integer field "stale": the number of its fields that are left out of
+ * the line at that time. a meter that is gone (see rtt.h) is written as
+ * stale on every period, so the gaps in the data are never silent.
+ *
+ * every "stats_period", the transactions and the encoding of the lines
+ * are reported in lines of their own, see STATS_MEASUREMENT in stats.h.
+ *
+ * once started, "plan" belongs to the poll thread. a new plan is handed
+ * over in "next", and taken between two ticks, so a tick never sees half
+ * of either; the serial line and the upload side are kept as they are.
+ */
+struct bus
+{
+	struct bus_plan        *plan;
+	struct bus_plan        *next;       /* to switch to, or NULL      */
+	modbus_t               *mb;
+	enum influx_precision   prec;
+
+	struct ticker           ticker;
+
+	struct uploader        *up;
+	size_t                  source;
+
+	uint64_t                stats_period; /* [ns], 0 if not reported  */
+	uint64_t                stats_next;   /* [ns] wall clock          */
+
+	int                     wake;       /* eventfd, written to stop   */
+	int                     swapped;    /* eventfd, "next" was taken  */
+	int                     epfd;       /* "wake" and the ticker      */
+	pthread_t               thread;
+	int                     running;
+};
+
+
+/*
+ * bus_plan_create:
+ *   plan the polling of the meters in "config". "config" is copied, but
+ *   what it points to is borrowed. names are interned in "names", which
+ *   must outlive the plan. returns NULL and sets errno on errors.
+ */
+struct bus_plan *bus_plan_create (const struct bus_config *config, struct influx_names *names);
+
+
+/*
+ * bus_plan_free:
+ *   deallocate a plan. does nothing if plan is NULL.
+ */
+void bus_plan_free (struct bus_plan *plan);
+
+
+/*
+ * bus_open:
+ *   plan the polling of the meters in "config", and prepare their lines,
+ *   timestamped with precision "prec". "config" is copied, but what it
+ *   points to is borrowed. names are interned in "names", which must
+ *   outlive the bus. the serial line is not opened yet, see "bus_connect".
+ *   returns -1 and sets errno on errors.
+ */
+int bus_open (struct bus *bus, const struct bus_config *config, struct influx_names *names, enum influx_precision prec);
+
+
+/*
+ * bus_connect:
+ *   open the serial line of "bus". returns -1 and sets errno on errors.
+ */
+int bus_connect (struct bus *bus, int debug);
+
+
+/*
+ * bus_start:
+ *   start polling "bus" in a thread of its own, posting the lines through
+ *   "up" as "source", and the statistics every "stats_ms" milliseconds
+ *   (never if 0). returns -1 and sets errno on errors.
+ */
+int bus_start (struct bus *bus, struct uploader *up, size_t source, uint32_t stats_ms);
+
+
+/*
+ * bus_reload:
+ *   switch the started "bus" over to "plan" (from bus_plan_create) before
+ *   its next tick, and take ownership of it. the serial settings of the
+ *   plan are ignored, as the line stays open. returns 1 if the poll thread
+ *   is to switch, and writes "swapped" once it has; until then, the
+ *   configuration of the old plan must stay around. returns 0 if the poll
+ *   thread has exited, and the bus was switched over right away.
+ */
+int bus_reload (struct bus *bus, struct bus_plan *plan);
+
+
+/*
+ * bus_probe:
+ *   try the serial line of "bus" at its configured baud rate, and then at
+ *   every standard rate above it, reading every meter "rounds" times as
+ *   planned, until a rate that worked is followed by one that doesn't. the
+ *   error counts of every meter, and the fastest rate at which nothing went
+ *   wrong with any of them, are written to "fp". the line must not be
+ *   connected (see bus_connect).
+ *   returns that rate, 0 if there is none, or -1 and sets errno on errors.
+ */
+int bus_probe (FILE *fp, const struct bus *bus, unsigned rounds);
+
+
+/*
+ * bus_stop:
+ *   stop polling "bus", after the tick in progress, if any.
+ */
+void bus_stop (struct bus *bus);
+
+
+/*
+ * bus_close:
+ *   close the serial line of "bus" and deallocate everything it holds.
+ */
+void bus_close (struct bus *bus);
+
+
+/*
+ * bus_print_plan:
+ *   write the serial settings and the planned reads of "bus" to "fp".
+ */
+void bus_print_plan (FILE *fp, const struct bus *bus);
+
+
+#endif /* _BUS_H */
@@ -0,0 +1,144 @@
+
+/*
+ * config.h
+ * lucas@pamorana.net (2024)
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CONFIG_H
+#define _CONFIG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bus.h"
+#include "influx.h"
+#include "regmap.h"
+#include "spool.h"
+#include "upload.h"
+
+/*
+ * a register map, as referred to by name from a bus.
+ */
+struct config_map
+{
+	const char      *name;
+	struct reg_table table;
+};
+
+/*
+ * everything that can be tuned per site.
+ *
+ * a configuration file is read into one contiguous array per kind of
+ * table (definitions, groups, readable ranges, meters), and the maps and
+ * buses point into those, so the result is as compact as the compiled-in
+ * tables it replaces. a file looks like this:
+ *
+ *   [influx]
+ *   url       = https://8f.nu
+ *   org       = Kandidatarbete
+ *   bucket    = electricity
+ *   precision = ms                     # s, ms, us or ns
+ *   gzip      = 6                      # 0 for none
+ *   batches   = 8                      # waiting for upload, per bus
+ *   inflight  = 4                      # posts at once, 0 for blocking
+ *
+ *   [batch]
+ *   bytes  = 262144
+ *   lines  = 5000
+ *   age_ms = 30000
+ *
+ *   [spool]
+ *   dir     = /var/spool/modbus        # empty for none
+ *   segment = 4194304
+ *   max     = 268435456
+ *   sync    = 65536
+ *
+ *   [stats]
+ *   period_ms = 60000                  # 0 for none, see stats.h
+ *
+ *   [map a43]
+ *   readable = 0x5B00 28               # addr count
+ *   group    = instant 1000            # measurement period_ms
+ *   reg      = 0x5B00 2 10 voltage_l1_n  # addr width scale field [signed] [raw]
+ *
+ *   [bus /dev/ttyAMA4]
+ *   baud          = 9600
+ *   parity        = N
+ *   data_bits     = 8
+ *   stop_bits     = 1
+ *   turnaround_us = 20000
+ *   rts_delay_us  = 1
+ *   map           = a43
+ *   meter         = 1 1                # slave [name]
+ *
+ * "#" starts a comment. anything left out keeps its default. the maps of
+ * the defaults can be referred to without being defined in the file, and
+ * any [bus] section replaces the buses of the defaults. buses refer to
+ * their map by name, so a map redefined in the file is used by every bus
+ * that names it, the buses of the defaults included.
+ *
+ * on SIGHUP, the file is read again, and the meters and maps of every
+ * bus are replaced between two ticks; the rest needs a restart.
+ */
+struct config
+{
+	const char              *url;
+	const char              *org;
+	const char              *bucket;
+	enum influx_precision    precision;
+	int                      gzip;
+	size_t                   batches;
+	size_t                   inflight;
+
+	struct upload_limits     limits;
+
+	const char              *spool_dir;
+	struct spool_config      spool;
+
+	uint32_t                 stats_ms;
+
+	const struct config_map *maps;
+	size_t                   nmaps;
+	const struct bus_config *buses;
+	size_t                   nbuses;
+
+	/* what was read from the file */
+	char                   **strings;
+	size_t                   nstrings;
+	struct reg_def          *defs;
+	struct reg_group        *groups;
+	struct reg_span         *spans;
+	struct bus_meter        *meters;
+};
+
+
+/*
+ * config_load:
+ *   read the configuration file "path" on top of "defaults". errors are
+ *   reported on stderr, with the line they were found on.
+ *   returns NULL and sets errno on errors.
+ */
+struct config *config_load (const char *path, const struct config *defaults);
+
+
+/*
+ * config_free:
+ *   deallocate a configuration from config_load. does nothing if NULL.
+ */
+void config_free (struct config *cfg);
+
+
+#endif /* _CONFIG_H */
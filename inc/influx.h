@@ -22,11 +22,56 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <time.h>
 
+/*
+ * the line protocol field types we can write.
+ *
+ * INFLUX_FIXED is a float field, written as the exact decimal text of the
+ * integer "value.i" divided by 10^decimals. it lets integer registers with
+ * a fixed resolution go out without ever passing through a double.
+ * INFLUX_UFIXED is the same for the unsigned "value.u".
+ */
+enum influx_type
+{
+	INFLUX_FLOAT = 0, /* value.f                          */
+	INFLUX_INTEGER,   /* value.i, suffixed with "i"       */
+	INFLUX_UNSIGNED,  /* value.u, suffixed with "u"       */
+	INFLUX_FIXED,     /* value.i / 10^decimals, as float  */
+	INFLUX_UFIXED,    /* value.u / 10^decimals, as float  */
+	INFLUX_TYPE_END
+};
+
+union influx_value
+{
+	double   f;
+	int64_t  i;
+	uint64_t u;
+};
+
+/*
+ * an interned, already escaped name or tag set (see influx_names_intern).
+ * "str" stays valid until the table it came from is destroyed.
+ */
+struct influx_key
+{
+	const char *str;
+	size_t      len;
+};
+
+/*
+ * the name is borrowed, not owned: it has to outlive every use of the
+ * field. in practice, names are string literals or long-lived tables.
+ * a non-zero "namelen" marks the name as interned, so it's copied as is
+ * instead of being scanned and escaped on every use.
+ */
 struct field
 {
-	char   *name;
-	double  value;
+	const char         *name;
+	size_t              namelen;
+	enum influx_type    type;
+	unsigned            decimals; /* INFLUX_(U)FIXED only */
+	union influx_value  value;
 };
 
 struct tag
@@ -52,17 +97,102 @@ static const char *const influx_precision_str[INFLUX_PRECISION_END] = \
 	"ns"
 };
 
-struct influx_field_elem
+/*
+ * a growable buffer of line protocol lines, newline-terminated.
+ *
+ * the memory is kept between uses (see influx_buffer_reset), so once it
+ * has grown to fit a batch, encoding further batches does not allocate.
+ * zero-initialize before first use.
+ */
+struct influx_buffer
 {
-	struct field f;
-	struct influx_field_elem *next;
+	char   *mem;
+	size_t  len;
+	size_t  cap;
+	size_t  lines;  /* completed lines              */
+
+	/* state of the line being encoded */
+	size_t  start;  /* offset of its first byte     */
+	size_t  fields; /* fields written so far        */
+	int     fail;   /* set if anything went wrong   */
 };
 
-struct influx_field_list
+/*
+ * a contiguous, growable array of fields. like "struct influx_buffer",
+ * it keeps its memory when reset, so refilling it does not allocate.
+ * zero-initialize before first use.
+ */
+struct influx_fields
+{
+	struct field *v;
+	size_t        num;
+	size_t        cap;
+};
+
+/*
+ * a pre-rendered line: the measurement, tag set and field keys of a line
+ * never change between intervals, so they are rendered once, and only
+ * the values and the timestamp are written per line (influx_template_render).
+ */
+struct influx_template
+{
+	char   *text;    /* "measurement,tags", then every "key=" back to back */
+	size_t  prefix;  /* length of "measurement,tags"                       */
+	size_t *keys;    /* [nfields + 1] offsets of every "key=" in "text"    */
+	size_t  nfields;
+};
+
+/*
+ * what an interned name will be used for, which decides how it's escaped.
+ * tag keys, tag values and field keys all share the same rules.
+ */
+enum influx_name
+{
+	INFLUX_NAME_MEASUREMENT = 0,
+	INFLUX_NAME_KEY
+};
+
+/*
+ * a table of interned names. every distinct escaped string is stored
+ * once, in blocks that never move, so keys can be handed out freely.
+ */
+struct influx_names_block
+{
+	struct influx_names_block *next;
+	size_t                     used;
+	size_t                     cap;
+	char                       mem[];
+};
+
+struct influx_names
+{
+	struct influx_names_block *blocks;
+	struct influx_key         *slots;   /* open addressing, str NULL if free */
+	uint32_t                  *hashes;
+	size_t                     nslots;  /* power of two                      */
+	size_t                     used;
+	struct influx_buffer       scratch;
+};
+
+/*
+ * called when an asynchronous write has finished. "buf" is the buffer
+ * that was posted, and "status" is what influx_writer_write_buffer would
+ * have returned for it.
+ */
+typedef void influx_done_fn (void *arg, const struct influx_buffer *buf, int status);
+
+/*
+ * one asynchronous write, see influx_writer_async.
+ * the slot is free if "buf" is NULL.
+ */
+struct influx_transfer
 {
-	size_t num;
-	struct influx_field_elem *next;
-	struct influx_field_elem *last;
+	void                       *curl;
+	const struct influx_buffer *buf;
+	struct influx_buffer        zbuf;  /* compressed body */
+	influx_done_fn             *done;
+	void                       *arg;
+	int                         cancel; /* influx_writer_cancel */
 };
 
 struct influx_writer
@@ -83,13 +213,56 @@ struct influx_writer
 	enum influx_precision precision;
 
 	/*
-	 * Authorization token is fetched from the environment variable
-	 * "INFLUXDB_TOKEN".
+	 * HTTP headers (a curl_slist) and static request options are set
+	 * up once, in influx_writer_create. only the body changes between
+	 * requests. the Authorization token is fetched from the environment
+	 * variable "INFLUXDB_TOKEN", see influx_writer_reload_token.
+	 */
+	void *headers;
+	char *token;
+
+	/* response body, collected by the curl write callback */
+	void *response;
+
+	/*
+	 * request bodies are gzip-compressed if "gzip" is not 0, see
+	 * influx_writer_set_gzip. the deflate state (a z_stream) and the
+	 * output buffer are kept between requests.
+	 */
+	int                   gzip;
+	void                 *zstream;
+	struct influx_buffer  zbuf;
+
+	/*
+	 * asynchronous mode: a curl multi handle, and a handle per transfer
+	 * copied from "curl". curl's sockets and timeout are watched by an
+	 * epoll instance ("epfd", with the timerfd "tfd" in it), which the
+	 * caller can add to its own event loop, see influx_writer_fd.
 	 */
+	void                   *multi;
+	int                     epfd;
+	int                     tfd;
+	struct influx_transfer *transfers;
+	size_t                  ntransfers;
+	size_t                  inflight;
+
+	/* header lists replaced while transfers were using them */
+	void                   *retired;
+
+	/*
+	 * the time the last write took, from the start of the request to the
+	 * end of the response, and the size of its body as sent (compressed,
+	 * if it was). valid in "done", and after a blocking write.
+	 */
+	uint64_t                last_us;
+	uint64_t                last_bytes;
 };
 
 #define INFLUX_API_WRITE_PATH "/api/v2/write"
 
+/* a request that takes longer than this is given up on */
+#define INFLUX_WRITE_TIMEOUT_MS 30000L
+
 
 /*
  * influx_writer_create:
@@ -109,6 +282,25 @@ struct influx_writer *influx_writer_create (const char *hosturl, const char *org
 void influx_writer_destroy (struct influx_writer *ctx);
 
 
+/*
+ * influx_writer_reload_token:
+ *   rebuild the HTTP headers of "ctx" with a new Authorization token.
+ *   if "token" is NULL, it is re-read from the environment variable
+ *   "INFLUXDB_TOKEN", and no Authorization header is sent if it is unset.
+ *   returns -1 on errors, leaving the previous headers in place.
+ */
+int influx_writer_reload_token (struct influx_writer *ctx, const char *token);
+
+
+/*
+ * influx_writer_set_gzip:
+ *   compress request bodies with gzip at deflate level "level" (1-9, or -1
+ *   for the zlib default), and send them with "Content-Encoding: gzip".
+ *   level 0 turns compression off. returns -1 on errors.
+ */
+int influx_writer_set_gzip (struct influx_writer *ctx, int level);
+
+
 /*
  * influx_writer_write:
  *   write a list of line protocol lines to InfluxDB.
@@ -128,50 +320,269 @@ int influx_writer_write (struct influx_writer *ctx, const char *lines[], char **
  *   constructs a line protocol line from a set of tags and fields.
  *     "measurement" is a name for this measurement.
  *     "tags"        is a NULL-terminated list of "struct tags".
- *     "fields"      is a NULL-terminated list of "struct fields".
+ *     "fields"      is a NULL-terminated list of "struct fields", of any type.
  *     "prec"        is the precision for the automatically generated timestamp.
  */
 char *influx_writer_line (const char *measurement, const struct tag *t[], const struct field *f[], enum influx_precision prec);
 
 
 /*
- * influx_field_list_create:
- *   initializes a linked list of fields. heap allocated.
+ * influx_writer_write_buffer:
+ *   same as influx_writer_write, but posts the lines encoded in "buf".
+ */
+int influx_writer_write_buffer (struct influx_writer *ctx, const struct influx_buffer *buf, char **response);
+
+
+/*
+ * influx_writer_async:
+ *   allow up to "max" writes to be in flight at the same time, posted with
+ *   influx_writer_post. returns -1 and sets errno on errors, after which
+ *   the writer can only be destroyed.
+ */
+int influx_writer_async (struct influx_writer *ctx, size_t max);
+
+
+/*
+ * influx_writer_fd:
+ *   a file descriptor that becomes readable when asynchronous writes can
+ *   make progress, for the caller's poll/epoll loop. influx_writer_perform
+ *   should then be called.
+ */
+int influx_writer_fd (const struct influx_writer *ctx);
+
+
+/*
+ * influx_writer_post:
+ *   start posting the lines in "buf" without waiting for the response.
+ *   "buf" must stay intact until "done" is called for it, from within
+ *   influx_writer_perform. returns -1 and sets errno to EAGAIN if "max"
+ *   writes are in flight already, and on other errors.
+ */
+int influx_writer_post (struct influx_writer *ctx, const struct influx_buffer *buf, influx_done_fn *done, void *arg);
+
+
+/*
+ * influx_writer_perform:
+ *   move asynchronous writes along, without blocking, and call "done" for
+ *   those that have finished. returns the number of writes still in flight.
+ */
+size_t influx_writer_perform (struct influx_writer *ctx);
+
+
+/*
+ * influx_writer_cancel:
+ *   abort every asynchronous write in flight, and call "done" for each with
+ *   a status of -1 and errno set to ECANCELED. writes posted from "done"
+ *   are not aborted.
+ */
+void influx_writer_cancel (struct influx_writer *ctx);
+
+
+/*
+ * influx_buffer_reserve:
+ *   make room for at least "extra" more bytes (plus a terminating null-byte)
+ *   in "buf". capacity grows geometrically, and is never given back until
+ *   "influx_buffer_free" is called.
+ *   returns -1 on memory allocation errors, leaving "buf" intact.
+ */
+int influx_buffer_reserve (struct influx_buffer *buf, size_t extra);
+
+
+/*
+ * influx_buffer_reset:
+ *   forget the contents of "buf", but keep its memory for re-use.
+ */
+void influx_buffer_reset (struct influx_buffer *buf);
+
+
+/*
+ * influx_buffer_free:
+ *   deallocate the memory held by "buf", and reset it.
+ */
+void influx_buffer_free (struct influx_buffer *buf);
+
+
+/*
+ * influx_line_begin:
+ *   start a new line with measurement name "measurement" in "buf".
+ *
+ *   a line is built with one call to influx_line_begin, any number of calls
+ *   to influx_line_tag followed by influx_line_field, and influx_line_end.
+ *   errors are sticky until influx_line_end, so intermediate return values
+ *   may be ignored. names and values are escaped as needed.
+ */
+int influx_line_begin (struct influx_buffer *buf, const char *measurement);
+
+
+/*
+ * influx_line_begin_key:
+ *   same as influx_line_begin, but with an interned (pre-escaped) name.
+ */
+int influx_line_begin_key (struct influx_buffer *buf, const struct influx_key *measurement);
+
+
+/*
+ * influx_line_tag:
+ *   add a tag to the line being encoded. must come before any field.
+ *   tags with an empty name or value are skipped, as InfluxDB rejects them.
+ */
+int influx_line_tag (struct influx_buffer *buf, const char *name, const char *value);
+
+
+/*
+ * influx_line_tagset:
+ *   add a complete, pre-rendered tag set (see influx_names_tagset) to
+ *   the line being encoded. must come before any field.
+ */
+int influx_line_tagset (struct influx_buffer *buf, const struct influx_key *tagset);
+
+
+/*
+ * influx_line_field:
+ *   add a float field to the line being encoded, in the shortest decimal
+ *   form that reads back as "value". NaN and infinities are skipped.
+ */
+int influx_line_field (struct influx_buffer *buf, const char *name, double value);
+
+
+/*
+ * influx_line_field_int:
+ *   add a signed integer field to the line being encoded.
+ */
+int influx_line_field_int (struct influx_buffer *buf, const char *name, int64_t value);
+
+
+/*
+ * influx_line_field_uint:
+ *   add an unsigned integer field to the line being encoded.
+ */
+int influx_line_field_uint (struct influx_buffer *buf, const char *name, uint64_t value);
+
+
+/*
+ * influx_line_field_fixed:
+ *   add a float field with the exact value "mant / 10^decimals" to the
+ *   line being encoded. trailing zeros in the fraction are left out.
+ */
+int influx_line_field_fixed (struct influx_buffer *buf, const char *name, int64_t mant, unsigned decimals);
+
+
+/*
+ * influx_line_field_typed:
+ *   add the field "f" to the line being encoded, according to its type.
+ *   if "f->namelen" is set, the name is taken as already escaped.
+ */
+int influx_line_field_typed (struct influx_buffer *buf, const struct field *f);
+
+
+/*
+ * influx_line_fields:
+ *   add "num" consecutive fields from "f" to the line being encoded.
+ */
+int influx_line_fields (struct influx_buffer *buf, const struct field *f, size_t num);
+
+
+/*
+ * influx_line_end:
+ *   terminate the line being encoded with a timestamp and a newline.
+ *   "ts" is a CLOCK_REALTIME timestamp, or NULL to use the current time.
+ *   if anything went wrong while encoding the line, or if it doesn't have
+ *   a single field, the whole line is removed from "buf" and -1 returned.
+ */
+int influx_line_end (struct influx_buffer *buf, const struct timespec *ts, enum influx_precision prec);
+
+
+/*
+ * influx_template_init:
+ *   render the constant parts of a line into "tpl": the measurement, the
+ *   tag set (either may come from influx_names) and the keys of "num"
+ *   fields. values in "fields" are ignored. free with influx_template_free.
+ *   returns -1 on invalid arguments or memory allocation errors.
+ */
+int influx_template_init (struct influx_template *tpl, const struct influx_key *measurement, const struct influx_key *tagset, const struct field *fields, size_t num);
+
+
+/*
+ * influx_template_free:
+ *   deallocate the memory held by "tpl".
+ */
+void influx_template_free (struct influx_template *tpl);
+
+
+/*
+ * influx_template_render:
+ *   append a complete line to "buf", using the text of "tpl" and the
+ *   values of "fields", which must be laid out as when "tpl" was made.
+ *   "ts" and "prec" are as for influx_line_end. fields of type
+ *   INFLUX_TYPE_END are left out, key and all.
+ *   returns -1 if the line could not be written, leaving "buf" as it was.
+ */
+int influx_template_render (struct influx_buffer *buf, const struct influx_template *tpl, const struct field *fields, const struct timespec *ts, enum influx_precision prec);
+
+
+/*
+ * influx_fields_reserve:
+ *   make room for at least "extra" more fields in "fields".
+ *   returns -1 on memory allocation errors, leaving "fields" intact.
+ */
+int influx_fields_reserve (struct influx_fields *fields, size_t extra);
+
+
+/*
+ * influx_fields_append:
+ *   append a copy of "f" to "fields". the name is borrowed, not copied.
+ *   returns -1 on memory allocation errors.
+ */
+int influx_fields_append (struct influx_fields *fields, const struct field *f);
+
+
+/*
+ * influx_fields_reset:
+ *   remove all fields, but keep the memory for re-use.
+ */
+void influx_fields_reset (struct influx_fields *fields);
+
+
+/*
+ * influx_fields_free:
+ *   deallocate the memory held by "fields", and reset it.
  */
-struct influx_field_list *influx_field_list_create (void);
+void influx_fields_free (struct influx_fields *fields);
 
 
 /*
- * influx_field_list_append:
- *   append a new measurement to a list of fields.
- *   returns -1 if heap allocation errors, or if lst is NULL or malformed.
+ * influx_names_create:
+ *   create an empty table of interned names. heap allocated.
  */
-int influx_field_list_append (struct influx_field_list *lst, const char *field, const double value);
+struct influx_names *influx_names_create (void);
 
 
 /*
- * influx_field_list_destroy:
- *   free all resources and elements belonging to "lst",
- *   including the list object.
+ * influx_names_destroy:
+ *   deallocate a name table, and every key handed out by it.
+ *   does nothing if names is NULL.
  */
-void influx_field_list_destroy (struct influx_field_list *lst);
+void influx_names_destroy (struct influx_names *names);
 
 
 /*
- * influx_field_compact_free:
- *   free the resources occupied by a compact field list,
- *   including the list itself.
+ * influx_names_intern:
+ *   escape "name" for use as "kind", and store the result in "names",
+ *   unless an identical string is already there. "key" is set to the
+ *   stored string. meant to be called once, at startup, per name.
+ *   returns -1 on memory allocation errors.
  */
-void influx_field_compact_free (struct field *fields[]);
+int influx_names_intern (struct influx_names *names, const char *name, enum influx_name kind, struct influx_key *key);
 
 
 /*
- * influx_field_list_compact:
- *   reduce the flexible linked list structure into a
- *   compact element array. heap allocated.
- *   returns NULL on memory allocation errors.
+ * influx_names_tagset:
+ *   render the NULL-terminated list "tags" as a line protocol tag set,
+ *   i.e. ",key=value,key=value", sorted by key and escaped, and intern it.
+ *   tags with an empty name or value are skipped.
+ *   returns -1 on memory allocation errors.
  */
-struct field **influx_field_list_compact (const struct influx_field_list *lst);
+int influx_names_tagset (struct influx_names *names, const struct tag *tags[], struct influx_key *key);
 
 
 /*
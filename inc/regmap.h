@@ -0,0 +1,239 @@
+
+/*
+ * regmap.h
+ * lucas@pamorana.net (2024)
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _REGMAP_H
+#define _REGMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "influx.h"
+
+/*
+ * a single value exposed by the meter.
+ *
+ * "width" is the number of 16-bit modbus registers the value occupies,
+ * most significant register first. "scale" is the divisor applied to the
+ * raw integer, i.e. 100 for a resolution of 0,01.
+ *
+ * values are written as float fields. if "scale" is a power of ten, the
+ * text is produced from the integer directly, without rounding. with
+ * REG_RAW, the unscaled integer is written as an integer field instead.
+ */
+struct reg_def
+{
+	uint16_t    addr;
+	uint8_t     width;  /* 1, 2 or 4 registers            */
+	uint8_t     flags;  /* REG_SIGNED, REG_RAW            */
+	uint8_t     group;  /* index into the group table     */
+	uint32_t    scale;
+	const char *name;   /* influx field name              */
+};
+
+#define REG_SIGNED  0x1 /* two's complement               */
+#define REG_RAW     0x2 /* write as "i" or "u" integer    */
+
+/*
+ * a group of values that end up on the same line protocol line, and
+ * are read together every "period_ms" milliseconds.
+ */
+struct reg_group
+{
+	const char *measurement;
+	uint32_t    period_ms;
+};
+
+/*
+ * a range of registers [addr, addr + count) that the meter allows to be
+ * read in one request. reads may only span gaps between wanted registers
+ * if the whole read lies within one such range.
+ */
+struct reg_span
+{
+	uint16_t addr;
+	uint16_t count;
+};
+
+/*
+ * everything known about one type of meter.
+ * if "nreadable" is 0, any register may be read.
+ */
+struct reg_table
+{
+	const struct reg_def   *defs;
+	const struct reg_group *groups;
+	const struct reg_span  *readable;
+	size_t                  ndefs;
+	size_t                  ngroups;
+	size_t                  nreadable;
+};
+
+/* frame overhead of a read, as per the modbus rtu spec */
+#define RTU_REQUEST_BYTES   8U  /* slave, function, address, count, crc */
+#define RTU_RESPONSE_BYTES  5U  /* slave, function, byte count, crc     */
+
+/*
+ * the cost model used to plan reads on a modbus rtu line.
+ *
+ * a read of "n" registers costs a request frame (8 bytes), a response
+ * frame (5 + 2n bytes) and two 3,5 character silent intervals on the
+ * wire, plus "turnaround_us" of processing time in the slave.
+ */
+struct reg_cost
+{
+	uint32_t baud;
+	uint32_t char_bits;     /* start + data + parity + stop bits */
+	uint32_t turnaround_us;
+	uint16_t max_read;      /* registers per request             */
+};
+
+/*
+ * a single modbus read transaction, and where
+ * its registers end up in the register image.
+ */
+struct reg_read
+{
+	uint16_t addr;
+	uint16_t count;
+	uint16_t offset;  /* into the register image */
+	uint32_t cost_us; /* estimated bus time      */
+};
+
+/*
+ * everything needed to decode one definition,
+ * packed so the decode pass stays in cache.
+ */
+struct reg_slot
+{
+	uint16_t offset;   /* into the register image  */
+	uint8_t  width;
+	uint8_t  sign;
+	uint8_t  type;     /* enum influx_type         */
+	uint8_t  decimals; /* for INFLUX_(U)FIXED      */
+	uint32_t scale;    /* for INFLUX_FLOAT         */
+};
+
+/*
+ * the compiled form of a register map.
+ *
+ * all reads of one poll are stored back-to-back in a flat register
+ * image of "nimage" registers, and "slots" holds the position and
+ * encoding of every definition, so decoding is one pass over "slots".
+ *
+ * reads are planned per group, so every group can be polled on its own
+ * and never costs a register of another group.
+ */
+struct reg_map
+{
+	const struct reg_def   *defs;
+	const struct reg_group *groups;
+	size_t                  ndefs;
+	size_t                  ngroups;
+
+	struct reg_read        *reads;
+	size_t                  nreads;
+
+	struct reg_slot        *slots;  /* [ndefs] */
+	size_t                  nimage;
+
+	/* definitions are sorted by group; group "g" spans [first[g], first[g+1]) */
+	uint16_t               *first;  /* [ngroups + 1] */
+
+	/* the reads of group "g" span [rfirst[g], rfirst[g+1]) */
+	uint16_t               *rfirst; /* [ngroups + 1] */
+};
+
+
+/*
+ * regmap_read_cost:
+ *   estimated bus time in microseconds for reading "count" registers.
+ */
+uint32_t regmap_read_cost (const struct reg_cost *cost, unsigned count);
+
+
+/*
+ * regmap_compile:
+ *   build the runtime form of a register map from a meter table, and plan
+ *   the cheapest set of read transactions that covers every group.
+ *   "defs" must be sorted by group. the tables are borrowed, not copied.
+ *   returns NULL and sets errno on malformed tables or allocation errors,
+ *   and ERANGE if a definition can not be covered by any allowed read.
+ */
+struct reg_map *regmap_compile (const struct reg_table *table, const struct reg_cost *cost);
+
+
+/*
+ * regmap_free:
+ *   deallocate a compiled register map. does nothing if map is NULL.
+ */
+void regmap_free (struct reg_map *map);
+
+
+/*
+ * regmap_fields:
+ *   fill "fields" with the name and type of every definition, in order.
+ *   only the values change from one poll to the next. if "names" is
+ *   not NULL, the field names are interned (escaped once) in it.
+ *   returns -1 on memory allocation errors.
+ */
+int regmap_fields (const struct reg_map *map, struct influx_names *names, struct influx_fields *fields);
+
+
+/*
+ * regmap_decode:
+ *   decode every definition in "map" from the register image "image"
+ *   into the values of "fields" (map->ndefs elements), as initialized by
+ *   "regmap_fields".
+ */
+void regmap_decode (const struct reg_map *map, const uint16_t *image, struct field *fields);
+
+
+/*
+ * regmap_decode_group:
+ *   like "regmap_decode", for the definitions of group "g" only.
+ */
+void regmap_decode_group (const struct reg_map *map, size_t g, const uint16_t *image, struct field *fields);
+
+
+/*
+ * regmap_leave_out:
+ *   leave the definitions of group "g" that are read by its reads from "r"
+ *   on out of "fields", e.g. because read "r" failed, by setting their type
+ *   to INFLUX_TYPE_END; influx_template_render skips them. the next decode
+ *   of the group puts them back. returns the number of fields left out.
+ */
+size_t regmap_leave_out (const struct reg_map *map, size_t g, size_t r, struct field *fields);
+
+
+/*
+ * regmap_group_cost:
+ *   estimated bus time in microseconds for reading group "g".
+ */
+uint32_t regmap_group_cost (const struct reg_map *map, size_t g);
+
+
+/*
+ * regmap_print_plan:
+ *   write a human readable description of the planned reads to "fp".
+ */
+void regmap_print_plan (FILE *fp, const struct reg_map *map);
+
+
+#endif /* _REGMAP_H */
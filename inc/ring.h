@@ -0,0 +1,88 @@
+
+/*
+ * ring.h
+ * lucas@pamorana.net (2024)
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RING_H
+#define _RING_H
+
+#include <stddef.h>
+
+/*
+ * a bounded, lock-free, single-producer / single-consumer queue of pointers.
+ *
+ * "head" is only written by the producer and "tail" only by the consumer,
+ * each with release semantics, so a slot is never read before it has been
+ * filled or overwritten before it has been read. the indices run freely and
+ * are masked on access; they are kept on separate cache lines, so the two
+ * threads do not bounce one line back and forth on every operation.
+ */
+#define RING_CACHELINE 64
+
+struct ring
+{
+	void   **slot;
+	size_t   mask; /* size - 1, size is a power of two */
+
+	size_t   head;
+	char     pad_head[RING_CACHELINE - sizeof(size_t)];
+
+	size_t   tail;
+	char     pad_tail[RING_CACHELINE - sizeof(size_t)];
+};
+
+
+/*
+ * ring_init:
+ *   allocate room for at least "size" elements, rounded up to a power of two.
+ *   returns -1 on memory allocation errors.
+ */
+int ring_init (struct ring *ring, size_t size);
+
+
+/*
+ * ring_free:
+ *   deallocate the slots of "ring". the elements are not touched.
+ */
+void ring_free (struct ring *ring);
+
+
+/*
+ * ring_push:
+ *   [producer] append "elem" to "ring".
+ *   returns -1 with errno set to EAGAIN if the ring is full.
+ */
+int ring_push (struct ring *ring, void *elem);
+
+
+/*
+ * ring_pop:
+ *   [consumer] remove and return the oldest element of "ring",
+ *   or NULL if it is empty.
+ */
+void *ring_pop (struct ring *ring);
+
+
+/*
+ * ring_count:
+ *   number of elements in "ring". exact when called by either the
+ *   producer or the consumer, a snapshot otherwise.
+ */
+size_t ring_count (const struct ring *ring);
+
+
+#endif /* _RING_H */
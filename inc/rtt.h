@@ -0,0 +1,95 @@
+
+/*
+ * rtt.h
+ * lucas@pamorana.net (2024)
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RTT_H
+#define _RTT_H
+
+#include <stdint.h>
+
+/*
+ * the response time of one slave, as seen from the master.
+ *
+ * what a slave adds to a transaction on top of the time on the wire is
+ * its turnaround, which is tracked as a smoothed mean and mean deviation
+ * (the estimator of TCP, RFC 6298). the response timeout of a request is
+ * its wire time, plus the mean and four deviations, so a slow but steady
+ * slave is waited for, and a missing one costs little more than a slow
+ * one would.
+ *
+ * every failed transaction in a row doubles the deviation, so a slave
+ * that is only slower than it used to be gets there. after RTT_DEAD
+ * failures in a row, the slave is taken to be gone, and is not asked
+ * again before "retry", which backs off exponentially; the timeout of
+ * the retries stays where it was, so they cost no more than the last.
+ */
+struct rtt
+{
+	uint32_t srtt;    /* [us] smoothed turnaround                 */
+	uint32_t rttvar;  /* [us] its mean deviation                  */
+	uint32_t fails;   /* failed transactions in a row             */
+	uint64_t retry;   /* [ns] wall clock, 0 while the slave is up */
+};
+
+#define RTT_DEAD    3U       /* failures in a row for a slave to be gone */
+#define RTT_MIN_US  2000U    /* [us] least turnaround allowed for        */
+#define RTT_MAX_US  1000000U /* [us] most turnaround waited for          */
+#define RTT_BACKOFF 6U       /* at most 2^6 base periods between retries */
+
+
+/*
+ * rtt_init:
+ *   start out from the turnaround "guess_us", i.e. that of the bus config.
+ */
+void rtt_init (struct rtt *r, uint32_t guess_us);
+
+
+/*
+ * rtt_timeout:
+ *   the response timeout in microseconds of a transaction that spends
+ *   "wire_us" on the wire.
+ */
+uint32_t rtt_timeout (const struct rtt *r, uint32_t wire_us);
+
+
+/*
+ * rtt_sample:
+ *   account for a successful transaction of "us" microseconds in all,
+ *   "wire_us" of which were spent on the wire. returns 1 if the slave
+ *   was gone until now, 0 otherwise.
+ */
+int rtt_sample (struct rtt *r, uint32_t us, uint32_t wire_us);
+
+
+/*
+ * rtt_fail:
+ *   account for a failed transaction at "now" [ns]. once the slave is
+ *   gone, it is not asked again for "base" [ns], doubled on every retry
+ *   that fails too. returns 1 if the slave is gone, 0 otherwise.
+ */
+int rtt_fail (struct rtt *r, uint64_t now, uint64_t base);
+
+
+/*
+ * rtt_skip:
+ *   whether the slave is gone, and not to be asked again yet at "now" [ns].
+ */
+int rtt_skip (const struct rtt *r, uint64_t now);
+
+
+#endif /* _RTT_H */
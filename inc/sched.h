@@ -0,0 +1,95 @@
+
+/*
+ * sched.h
+ * lucas@pamorana.net (2024)
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SCHED_H
+#define _SCHED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * one periodic job on the bus: reading one register group of one meter.
+ *
+ * a job is released on every whole multiple of its period on the wall
+ * clock, and its deadline is the next release. a new job has not run
+ * yet, so it is released from the start.
+ */
+struct sched_job
+{
+	uint64_t release;  /* [ns] start of the current period, 0 for a new job */
+	uint64_t period;   /* [ns]                                             */
+	uint32_t cost_us;  /* estimated bus time                               */
+	uint16_t meter;    /* for the caller, i.e. the slave id                */
+	uint8_t  group;    /* for the caller, i.e. the register group          */
+	uint64_t runs;     /* times the job was run                            */
+	uint64_t missed;   /* periods that passed without a run                */
+};
+
+/*
+ * an earliest-deadline-first schedule of periodic jobs sharing one bus.
+ *
+ * the bus is served in ticks of the greatest common divisor of all
+ * periods, and every tick runs the released jobs by earliest deadline
+ * for as long as they fit in the time left until the next tick. what
+ * does not fit waits for the next tick, first in line by then, so the
+ * slow groups fill the gaps the fast ones leave instead of stealing
+ * their slot.
+ */
+struct sched
+{
+	struct sched_job *jobs;
+	size_t            njobs;
+	size_t            capjobs;
+	uint64_t          tick;   /* [ns] gcd of all periods */
+};
+
+
+/*
+ * sched_add:
+ *   add a job running every "period_ns" nanoseconds, estimated to take
+ *   "cost_us" microseconds of bus time. "s" must be zeroed before the
+ *   first call. returns -1 and sets errno on errors.
+ */
+int sched_add (struct sched *s, uint16_t meter, uint8_t group, uint64_t period_ns, uint32_t cost_us);
+
+
+/*
+ * sched_next:
+ *   the job released at "now" [ns] with the earliest deadline, that fits
+ *   in "budget_us" microseconds. returns NULL if there is none.
+ */
+struct sched_job *sched_next (struct sched *s, uint64_t now, uint64_t budget_us);
+
+
+/*
+ * sched_done:
+ *   mark "job" as run at "now" [ns], and release it again at the start of
+ *   its next period. returns the number of periods it missed.
+ */
+uint64_t sched_done (struct sched_job *job, uint64_t now);
+
+
+/*
+ * sched_free:
+ *   deallocate the jobs of "s".
+ */
+void sched_free (struct sched *s);
+
+
+#endif /* _SCHED_H */
@@ -0,0 +1,155 @@
+
+/*
+ * spool.h
+ * lucas@pamorana.net (2024)
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SPOOL_H
+#define _SPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "influx.h"
+
+/*
+ * a write-ahead spool of line protocol that could not be delivered.
+ *
+ * records are appended to segment files in one directory, named after a
+ * running sequence number, so the oldest data is always in the segment
+ * with the lowest number. every segment is memory mapped; an append is a
+ * copy into the map, and the dirty pages are flushed to disk in batches
+ * (see "sync_bytes" and spool_sync) instead of once per record.
+ *
+ * records are read oldest first, and marked as done in place once they
+ * have been delivered. a segment is deleted when all of its records are
+ * done, or evicted, records and all, when the spool would otherwise grow
+ * beyond "max_bytes". delivery is at-least-once: after a crash, records
+ * marked done since the last sync are sent again, which InfluxDB treats
+ * as overwrites of identical points.
+ */
+struct spool_config
+{
+	size_t segment_bytes; /* preallocated size of a segment file        */
+	size_t max_bytes;     /* total size of all records on disk          */
+	size_t sync_bytes;    /* flush to disk after this many dirty bytes  */
+};
+
+/*
+ * the on-disk record header, followed by "len" bytes of line protocol,
+ * padded to SPOOL_ALIGN. "crc" covers "len", "lines" and the payload.
+ * a torn or corrupt record ends the segment when it is read back.
+ */
+struct spool_record
+{
+	uint32_t magic;
+	uint32_t len;
+	uint32_t lines;
+	uint32_t crc;
+};
+
+#define SPOOL_LIVE  0x4c505330U /* "0SPL", not yet delivered */
+#define SPOOL_DONE  0x4c505331U /* "1SPL", delivered         */
+#define SPOOL_ALIGN 8U
+
+struct spool_segment
+{
+	uint64_t  seq;
+	int       fd;
+	char     *map;
+	size_t    size;     /* mapped, and preallocated if "sealed" is 0     */
+	size_t    used;     /* bytes of valid records                        */
+	size_t    head;     /* offset of the first record not yet done       */
+	size_t    live;     /* records not yet done                          */
+	size_t    dirty_lo; /* [dirty_lo, dirty_hi) not yet flushed to disk  */
+	size_t    dirty_hi;
+	int       sealed;   /* no more appends; only ever the newest is not  */
+};
+
+struct spool
+{
+	char                 *dir;
+	int                   dirfd;
+	struct spool_config   config;
+
+	struct spool_segment *segs;   /* oldest first */
+	size_t                nsegs;
+	size_t                capsegs;
+	uint64_t              next_seq;
+
+	size_t                bytes;   /* used, over all segments     */
+	size_t                dirty;   /* not yet flushed             */
+	size_t                records; /* not yet done                */
+	size_t                evicted; /* records lost to "max_bytes" */
+
+	/* end of the records returned by the last spool_peek */
+	uint64_t              peek_seq;
+	size_t                peek_off;
+	size_t                peek_num;
+};
+
+
+/*
+ * spool_open:
+ *   open (and create, if needed) the spool in directory "dir", and recover
+ *   the records left in it. returns NULL and sets errno on errors.
+ */
+struct spool *spool_open (const char *dir, const struct spool_config *config);
+
+
+/*
+ * spool_close:
+ *   flush and close the spool. does nothing if sp is NULL.
+ */
+void spool_close (struct spool *sp);
+
+
+/*
+ * spool_append:
+ *   store "len" bytes of line protocol ("lines" lines), evicting the oldest
+ *   segments if the spool is full. returns -1 and sets errno on errors,
+ *   EFBIG if the record alone is larger than "max_bytes".
+ */
+int spool_append (struct spool *sp, const char *data, size_t len, size_t lines);
+
+
+/*
+ * spool_peek:
+ *   copy the oldest records into "out" (which is reset first), as long as
+ *   they fit in "max" bytes, but at least one. returns the number of records
+ *   copied, 0 if the spool is empty, or -1 on errors. the records stay in
+ *   the spool until spool_consume is called.
+ */
+int spool_peek (struct spool *sp, struct influx_buffer *out, size_t max);
+
+
+/*
+ * spool_consume:
+ *   mark the records returned by the last spool_peek as done, and delete
+ *   segments that have nothing left in them.
+ */
+void spool_consume (struct spool *sp);
+
+
+/*
+ * spool_sync:
+ *   flush everything written since the last sync to disk.
+ *   returns -1 and sets errno on errors.
+ */
+int spool_sync (struct spool *sp);
+
+
+#endif /* _SPOOL_H */
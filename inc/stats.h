@@ -0,0 +1,91 @@
+
+/*
+ * stats.h
+ * lucas@pamorana.net (2024)
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "influx.h"
+
+/*
+ * the measurement the daemon reports on itself in, every "period_ms" of
+ * the [stats] section of the configuration (see config.h). the lines are
+ * told apart by their tags: "bus", "meter" and "block" for the modbus
+ * transactions of one register block of one meter, "bus" and "stage" =
+ * "encode" for the encoding of lines, and "stage" = "upload" for posts.
+ * every line covers the time since the one before it.
+ */
+#define STATS_MEASUREMENT "modbus_stats"
+
+/*
+ * a histogram of latencies, after HdrHistogram.
+ *
+ * values below 2^HIST_SUB are counted exactly. above that, every power
+ * of two is split into 2^(HIST_SUB - 1) buckets of equal width, so every
+ * bucket is within 1 / 2^(HIST_SUB - 1) of the values in it, from one
+ * microsecond to an hour, in a fixed array. recording is a shift and an
+ * increment, and never allocates.
+ */
+#define HIST_SUB     7U
+#define HIST_BUCKETS ((1U << HIST_SUB) + (32U - HIST_SUB) * (1U << (HIST_SUB - 1U)))
+
+struct hist
+{
+	uint64_t count;
+	uint64_t sum;
+	uint32_t max;
+	uint32_t buckets[HIST_BUCKETS];
+};
+
+
+/*
+ * hist_record:
+ *   count the value "v" in "h".
+ */
+void hist_record (struct hist *h, uint32_t v);
+
+
+/*
+ * hist_quantile:
+ *   the value that a fraction "q" (0 to 1) of the values in "h" is at most
+ *   equal to, give or take the width of its bucket. 0 if "h" is empty.
+ */
+uint32_t hist_quantile (const struct hist *h, double q);
+
+
+/*
+ * hist_reset:
+ *   forget every value in "h".
+ */
+void hist_reset (struct hist *h);
+
+
+/*
+ * hist_fields:
+ *   add the count, mean, median, 90th, 99th and 99.9th percentile and the
+ *   maximum of "h" to the line being encoded in "buf", as unsigned fields
+ *   whose names end in "_<unit>", i.e. "p99_us" for a "unit" of "us".
+ */
+int hist_fields (struct influx_buffer *buf, const struct hist *h, const char *unit);
+
+
+#endif /* _STATS_H */
@@ -0,0 +1,89 @@
+
+/*
+ * ticker.h
+ * lucas@pamorana.net (2024)
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TICKER_H
+#define _TICKER_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * a periodic wake-up on absolute deadlines.
+ *
+ * ticks fall on whole multiples of the period on the wall clock (a 5 s
+ * ticker fires at :00, :05, :10, ...), so samples from different runs and
+ * different hosts line up. the deadlines are kept by the kernel, in a
+ * timerfd with TFD_TIMER_ABSTIME, so time spent between reads never
+ * shifts the schedule, and ticks that pass while nobody reads are counted,
+ * not silently caught up on.
+ *
+ * the timerfd is non-blocking, to be waited for in the caller's
+ * poll/epoll loop along with everything else.
+ */
+struct ticker
+{
+	int             fd;      /* timerfd, CLOCK_REALTIME             */
+	uint64_t        period;  /* [ns]                                */
+	struct timespec next;    /* deadline of the next tick           */
+	uint64_t        ticks;   /* ticks read                          */
+	uint64_t        missed;  /* ticks that passed without a read    */
+};
+
+
+/*
+ * ticker_start:
+ *   start ticking every "period_ns" nanoseconds, aligned to the wall
+ *   clock. returns -1 and sets errno on errors.
+ */
+int ticker_start (struct ticker *t, uint64_t period_ns);
+
+
+/*
+ * ticker_set:
+ *   tick every "period_ns" nanoseconds from now on, starting on the next
+ *   whole multiple of it. returns -1 and sets errno on errors.
+ */
+int ticker_set (struct ticker *t, uint64_t period_ns);
+
+
+/*
+ * ticker_read:
+ *   take the tick that is due, once "fd" is readable. if "deadline" is not
+ *   NULL, it is set to the time the tick was due. returns the number of
+ *   ticks missed since the last read, or -1 with errno set (EAGAIN if no
+ *   tick is due, i.e. the wall clock was set and the schedule realigned).
+ */
+int64_t ticker_read (struct ticker *t, struct timespec *deadline);
+
+
+/*
+ * ticker_left:
+ *   nanoseconds until the next tick, 0 if it is already due.
+ */
+uint64_t ticker_left (const struct ticker *t);
+
+
+/*
+ * ticker_stop:
+ *   stop the ticker and close its timerfd.
+ */
+void ticker_stop (struct ticker *t);
+
+
+#endif /* _TICKER_H */
@@ -0,0 +1,167 @@
+
+/*
+ * upload.h
+ * lucas@pamorana.net (2024)
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _UPLOAD_H
+#define _UPLOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "influx.h"
+#include "ring.h"
+#include "spool.h"
+#include "stats.h"
+
+/*
+ * when a batch is posted. intervals accumulate in one batch until it is
+ * at least "max_bytes" large, has at least "max_lines" lines, or its first
+ * interval is "max_age_ms" old. a limit of 0 posts every interval.
+ */
+struct upload_limits
+{
+	size_t   max_bytes;
+	size_t   max_lines;
+	uint32_t max_age_ms;
+};
+
+/*
+ * the batches of one acquisition thread.
+ *
+ * a fixed set of batch buffers circulates between that thread and the
+ * upload thread: the acquisition thread takes an empty one from "idle",
+ * fills it and pushes it to "full"; the upload thread posts it and hands
+ * it back through "idle". neither ring ever holds more than "nbatches"
+ * elements, so a push can not fail, and nothing is allocated once the
+ * buffers have grown.
+ */
+struct upload_source
+{
+	struct ring           full;     /* acquisition -> upload            */
+	struct ring           idle;     /* upload -> acquisition            */
+	struct influx_buffer *batches;  /* [nbatches]                       */
+	size_t                nbatches;
+
+	/* the batch being filled, owned by the acquisition thread */
+	struct influx_buffer *current;
+	struct timespec       opened;   /* when it got its first lines      */
+	int                   aging;    /* "opened" is set                  */
+};
+
+/*
+ * a thread that posts encoded batches to InfluxDB, so the threads
+ * polling the meters never wait for the network.
+ *
+ * every acquisition thread has a source of its own, so the rings stay
+ * single-producer, single-consumer. the upload thread takes batches from
+ * the sources in turn.
+ *
+ * batches that can not be delivered go to the spool. while the server
+ * accepts new batches, the spool is sent in large chunks in between.
+ *
+ * if the writer is asynchronous (see influx_writer_async), several posts
+ * are in flight at once, and the thread waits on the writer's sockets and
+ * the eventfd together, so a slow request never holds up the others.
+ *
+ * every "period", the posts since the last report are reported in a
+ * line of their own, see STATS_MEASUREMENT in stats.h. a "retry" is a
+ * post of spooled records.
+ */
+struct uploader
+{
+	struct influx_writer *writer;
+
+	struct upload_source *sources;  /* [nsources]                       */
+	size_t                nsources;
+	size_t                turn;     /* the source to look at first      */
+
+	int                   wake;     /* eventfd, written after each push */
+	int                   epfd;     /* "wake" and the writer's fd       */
+	int                   stop;
+	struct timespec       stopped;  /* when "stop" was first seen       */
+	pthread_t             thread;
+
+	/* taken from "full", waiting for a write to finish */
+	struct influx_buffer *pending;
+
+	struct upload_limits  limits;
+
+	struct spool         *spool;    /* may be NULL                      */
+	struct influx_buffer  drain;    /* spooled records being sent       */
+	int                   draining; /* "drain" is in flight             */
+	int                   online;   /* the last request got through     */
+
+	uint64_t              period;   /* [ns], 0 if not reported          */
+	uint64_t              due;      /* [ns] wall clock of the next one  */
+	struct hist           posts;    /* [us] answered or not             */
+	uint64_t              failed;   /* to be tried again                */
+	uint64_t              rejected; /* turned down for good             */
+	uint64_t              retries;
+	uint64_t              lines;    /* delivered                        */
+	uint64_t              bytes;    /* request bodies, as sent          */
+	struct influx_buffer  report;
+	int                   reporting; /* 1: waiting to be posted, 2: in flight */
+};
+
+
+/*
+ * uploader_start:
+ *   start an upload thread posting through "writer", for "nsources"
+ *   acquisition threads with "depth" batches in circulation each. batches
+ *   that can not be delivered are stored in "spool" (if not NULL), and sent
+ *   again once the server is back. the writer and the spool belong to the
+ *   upload thread until "uploader_stop" returns. intervals are collected
+ *   into one batch within "limits", if not NULL. the posts are reported
+ *   every "stats_ms" milliseconds, never if 0.
+ *   returns -1 and sets errno on errors.
+ */
+int uploader_start (struct uploader *up, struct influx_writer *writer, struct spool *spool, size_t nsources, size_t depth, const struct upload_limits *limits, uint32_t stats_ms);
+
+
+/*
+ * uploader_batch:
+ *   [acquisition thread "source"] the batch to encode this interval's lines
+ *   into. lines accumulate in the same batch until "uploader_commit" hands
+ *   it over. returns NULL if every batch is still waiting to be posted.
+ */
+struct influx_buffer *uploader_batch (struct uploader *up, size_t source);
+
+
+/*
+ * uploader_commit:
+ *   [acquisition thread "source"] call when an interval has been encoded.
+ *   the batch is queued for posting once it has reached one of the limits.
+ */
+void uploader_commit (struct uploader *up, size_t source);
+
+
+/*
+ * uploader_stop:
+ *   call once the acquisition threads are done.
+ *   spool every batch still queued, and the ones being filled, stop the
+ *   upload thread and deallocate the batches. writes in flight are given
+ *   a few seconds to finish, and spooled if they don't. without a spool,
+ *   everything is posted, and waited for, instead.
+ *   the writer and the spool are left to the caller.
+ */
+void uploader_stop (struct uploader *up);
+
+
+#endif /* _UPLOAD_H */
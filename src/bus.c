@@ -0,0 +1,1015 @@
+
+/*
+ * bus.c
+ * lucas@pamorana.net (2024)
+ *
+ * Polling the meters of one RS-485 bus, in a thread of its own.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*---------------------------------------------------------------------------*\
+|*                                  HEADERS                                  *|
+\*---------------------------------------------------------------------------*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "bus.h"
+
+/*---------------------------------------------------------------------------*\
+|*                                POLL THREAD                                *|
+\*---------------------------------------------------------------------------*/
+
+/* "next" of a bus whose poll thread has exited, and takes no more plans */
+static struct bus_plan gone;
+
+/*
+ * midpoint:
+ *   the time halfway between "a" and "b". a register value is sampled
+ *   somewhere between sending the request and receiving the response,
+ *   so this is the best guess for when it was taken.
+ */
+static struct timespec midpoint (const struct timespec *a, const struct timespec *b)
+{
+	uint64_t ns = ((uint64_t) a->tv_sec * 1000000000U + (uint64_t) a->tv_nsec
+	            +  (uint64_t) b->tv_sec * 1000000000U + (uint64_t) b->tv_nsec) / 2U;
+
+	struct timespec ts = \
+	{
+		.tv_sec  = (time_t) (ns / 1000000000U),
+		.tv_nsec = (long)   (ns % 1000000000U)
+	};
+
+	return ts;
+}
+
+
+/*
+ * elapsed_us:
+ *   microseconds from "a" to "b", 0 if the clock went backwards.
+ */
+static uint32_t elapsed_us (const struct timespec *a, const struct timespec *b)
+{
+	int64_t us = ((int64_t) b->tv_sec - (int64_t) a->tv_sec) * 1000000 + (b->tv_nsec - a->tv_nsec) / 1000;
+
+	return (us > 0) ? (us < UINT32_MAX) ? (uint32_t) us : UINT32_MAX : 0U;
+}
+
+
+/*
+ * elapsed_ns:
+ *   nanoseconds from "a" to "b", 0 if the clock went backwards.
+ */
+static uint32_t elapsed_ns (const struct timespec *a, const struct timespec *b)
+{
+	int64_t ns = ((int64_t) b->tv_sec - (int64_t) a->tv_sec) * 1000000000 + (b->tv_nsec - a->tv_nsec);
+
+	return (ns > 0) ? (ns < UINT32_MAX) ? (uint32_t) ns : UINT32_MAX : 0U;
+}
+
+
+/*
+ * account:
+ *   count a transaction of read "rd" that took "us" microseconds and
+ *   returned "rc", with "err" as errno, in "x". "retry" if the meter
+ *   was taken for gone.
+ */
+static void account (struct bus_xfer *x, const struct reg_read *rd, int rc, int err, uint32_t us, int retry)
+{
+	hist_record(&x->rtt, us);
+
+	x->retries += (retry != 0);
+	x->bytes   += RTU_REQUEST_BYTES;
+
+	if (rc >= 0)
+		x->bytes += RTU_RESPONSE_BYTES + 2U * (unsigned) rc;
+
+	else if (err == ETIMEDOUT)
+		x->timeouts++;
+
+	/* the response came in whole, as far as anyone can tell */
+	else if (err == EMBBADCRC)
+	{
+		x->crc++;
+		x->bytes += RTU_RESPONSE_BYTES + 2U * rd->count;
+	}
+
+	/* an exception response */
+	else
+		x->bytes += RTU_RESPONSE_BYTES;
+}
+
+
+/*
+ * report:
+ *   write the statistics of "bus" since the last report into "batch",
+ *   stamped "ts", and start over.
+ */
+static void report (struct bus *bus, struct influx_buffer *batch, const struct timespec *ts)
+{
+	struct bus_plan      *plan = bus->plan;
+	const struct reg_map *map  = plan->map;
+
+	char block[8];
+
+	for (size_t k=0; k < plan->config.nmeters; k++)
+		for (size_t r=0; r < map->nreads; r++)
+		{
+			const struct bus_xfer *x = &plan->xfers[k * map->nreads + r];
+
+			if (x->rtt.count == 0)
+				continue;
+
+			snprintf(block, sizeof(block), "0x%04" PRIX16, map->reads[r].addr);
+
+			influx_line_begin      (batch, STATS_MEASUREMENT);
+			influx_line_tag        (batch, "block", block);
+			influx_line_tag        (batch, "bus",   plan->config.device);
+			influx_line_tag        (batch, "meter", plan->config.meters[k].name);
+			influx_line_field_uint (batch, "crc",      x->crc);
+			influx_line_field_uint (batch, "timeouts", x->timeouts);
+			influx_line_field_uint (batch, "retries",  x->retries);
+			influx_line_field_uint (batch, "bytes",    x->bytes);
+			hist_fields            (batch, &x->rtt, "us");
+
+			if (influx_line_end(batch, ts, bus->prec))
+				perror("influx_line_end");
+		}
+
+	if (plan->encode.count > 0)
+	{
+		influx_line_begin (batch, STATS_MEASUREMENT);
+		influx_line_tag   (batch, "bus",   plan->config.device);
+		influx_line_tag   (batch, "stage", "encode");
+		hist_fields       (batch, &plan->encode, "ns");
+
+		if (influx_line_end(batch, ts, bus->prec))
+			perror("influx_line_end");
+	}
+
+	memset(plan->xfers, 0, plan->config.nmeters * map->nreads * sizeof(struct bus_xfer));
+	hist_reset(&plan->encode);
+}
+
+
+/*
+ * stale:
+ *   mark "count" fields of group "g" of meter "k" as not read at "ts", in a
+ *   line of its own. influxdb merges it with the line of the fields that
+ *   were read, if any, since both have the same series and timestamp.
+ */
+static void stale (struct influx_buffer *batch, const struct bus_plan *plan, size_t k, size_t g, size_t count, const struct timespec *ts, enum influx_precision prec)
+{
+	influx_line_begin_key (batch, &plan->groups[g]);
+	influx_line_tagset    (batch, &plan->tagsets[k]);
+	influx_line_field_int (batch, "stale", (int64_t) count);
+
+	if (influx_line_end(batch, ts, prec))
+		perror("influx_line_end");
+}
+
+
+/*
+ * tick:
+ *   run the jobs released at "now" [ns], earliest deadline first, while
+ *   they fit before the next tick, and hand the lines to the upload thread.
+ */
+static void tick (struct bus *bus, uint64_t now)
+{
+	struct bus_plan      *plan = bus->plan;
+	const struct reg_map *map  = plan->map;
+
+	struct influx_buffer *batch;
+	struct sched_job     *job;
+	uint64_t              budget;
+
+	const struct timespec due = \
+	{
+		.tv_sec  = (time_t) (now / 1000000000U),
+		.tv_nsec = (long)   (now % 1000000000U)
+	};
+
+	/*
+	 * if the upload thread is still holding every batch, the
+	 * jobs of this tick wait for the next one.
+	 */
+	if ((batch = uploader_batch(bus->up, bus->source)) == NULL)
+	{
+		fprintf(stderr, "%s: upload queue full, dropping tick\n", plan->config.device);
+		return;
+	}
+
+	modbus_flush(bus->mb);
+
+	/*
+	 * the first job always runs, so a job that is
+	 * longer than a tick is late, but not starved.
+	 */
+	for (budget = UINT64_MAX; (job = sched_next(&plan->sched, now, budget)) != NULL; budget = ticker_left(&bus->ticker) / 1000U)
+	{
+		const size_t            g = job->group;
+		const struct bus_meter *m = &plan->config.meters[job->meter];
+
+		const struct influx_template *tpl = &plan->templates[(size_t) job->meter * map->ngroups + g];
+
+		struct rtt *rtt = &plan->rtt[job->meter];
+
+		size_t   r;
+		size_t   missing;
+		uint64_t lost;
+
+		/* when the group's first request went out, and its last response came in */
+		struct timespec sent, received, sampled;
+
+		/* the same for each request, on a clock that never steps, to time it by */
+		struct timespec asked, answered;
+
+		/* when encoding started, and ended */
+		struct timespec begun, ended;
+
+		/* a meter that is gone is left alone until its next retry */
+		if (rtt_skip(rtt, now))
+		{
+			sched_done(job, now);
+			stale(batch, plan, job->meter, g, map->first[g + 1] - map->first[g], &due, bus->prec);
+			continue;
+		}
+
+		if ((lost = sched_done(job, now)) > 0)
+			fprintf(stderr, "%s: meter %s: %s late, %" PRIu64 " periods missed\n", plan->config.device, m->name, map->groups[g].measurement, lost);
+
+		modbus_set_slave(bus->mb, m->slave);
+
+		/*
+		 * fill the group's part of the register image, one transaction at a time
+		 */
+		clock_gettime(CLOCK_REALTIME, &sent);
+		clock_gettime(CLOCK_MONOTONIC, &answered);
+
+		for (r=map->rfirst[g], received=sent; r < map->rfirst[g + 1]; r++)
+		{
+			const struct reg_read *rd = &map->reads[r];
+
+			uint32_t wire    = (rd->cost_us > plan->config.turnaround_us) ? rd->cost_us - plan->config.turnaround_us : 0U;
+			uint32_t timeout = rtt_timeout(rtt, wire);
+			int      retry   = (rtt->fails >= RTT_DEAD);
+			int      rc;
+
+			modbus_set_response_timeout(bus->mb, timeout / 1000000U, timeout % 1000000U);
+
+			/* reads go back to back, so each starts when the last one ended */
+			asked = answered;
+
+			rc = modbus_read_registers(bus->mb, rd->addr, rd->count, &plan->image[rd->offset]);
+
+			clock_gettime(CLOCK_MONOTONIC, &answered);
+			clock_gettime(CLOCK_REALTIME, &received);
+
+			account(&plan->xfers[(size_t) job->meter * map->nreads + r], rd, rc, errno, elapsed_us(&asked, &answered), retry);
+
+			if (rc == rd->count)
+			{
+				if (rtt_sample(rtt, elapsed_us(&asked, &answered), wire))
+					fprintf(stderr, "%s: meter %s: answering again\n", plan->config.device, m->name);
+
+				continue;
+			}
+
+			if (rc >= 0)
+				fprintf(stderr, "%s: meter %s: only %d of %u registers received\n", plan->config.device, m->name, rc, rd->count);
+
+			else if (errno != ETIMEDOUT)
+				fprintf(stderr, "%s: meter %s: %s\n", plan->config.device, m->name, modbus_strerror(errno));
+
+			else if (rtt_fail(rtt, now, plan->sched.tick))
+				fprintf(stderr, "%s: meter %s: no answer %" PRIu32 " times in a row, next try in %.0f s\n", plan->config.device, m->name, rtt->fails, (double) (rtt->retry - now) / 1e9);
+
+			else
+				fprintf(stderr, "%s: meter %s: no answer within %" PRIu32 " us\n", plan->config.device, m->name, timeout);
+
+			/*
+			 * an answer that comes in late must not be taken for the next
+			 * one. the rest of the group is left, but not the other jobs.
+			 */
+			modbus_flush(bus->mb);
+			break;
+		}
+
+		/*
+		 * convert into measurements to sent to influxdb, stamped
+		 * with when the registers were read, not when encoded
+		 */
+		sampled = midpoint(&sent, &received);
+		missing = map->first[g + 1] - map->first[g];
+
+		/* what was read before a failure is kept, and the rest marked stale */
+		if (r > map->rfirst[g])
+		{
+			clock_gettime(CLOCK_MONOTONIC, &begun);
+
+			regmap_decode_group(map, g, plan->image, plan->fields.v);
+
+			missing = (r < map->rfirst[g + 1]) ? regmap_leave_out(map, g, r, plan->fields.v) : 0U;
+
+			if (influx_template_render(batch, tpl, &plan->fields.v[map->first[g]], &sampled, bus->prec))
+				perror("influx_template_render");
+
+			clock_gettime(CLOCK_MONOTONIC, &ended);
+
+			hist_record(&plan->encode, elapsed_ns(&begun, &ended));
+		}
+
+		if (missing > 0)
+			stale(batch, plan, job->meter, g, missing, &sampled, bus->prec);
+	}
+
+	/* the statistics go out with the tick that ends their period */
+	if (bus->stats_period && now >= bus->stats_next)
+	{
+		report(bus, batch, &due);
+
+		bus->stats_next = (now / bus->stats_period + 1U) * bus->stats_period;
+	}
+
+	/*
+	 * hand this tick's metrics over to the upload thread,
+	 * as soon as the batch is full or old enough:
+	 */
+	uploader_commit(bus->up, bus->source);
+}
+
+
+/*
+ * adopt:
+ *   switch to the plan handed over by bus_reload, if there is one, at
+ *   "now" [ns]. called between ticks, so the old plan is no longer in use
+ *   by anyone.
+ */
+static void adopt (struct bus *bus, uint64_t now)
+{
+	const uint64_t one = 1;
+
+	const struct timespec ts = \
+	{
+		.tv_sec  = (time_t) (now / 1000000000U),
+		.tv_nsec = (long)   (now % 1000000000U)
+	};
+
+	struct influx_buffer *batch;
+
+	struct bus_plan *plan = __atomic_exchange_n(&bus->next, NULL, __ATOMIC_ACQ_REL);
+
+	if (plan == NULL)
+		return;
+
+	/*
+	 * the statistics of the old plan go out with it, as a period of their
+	 * own. the next one starts over, so no report shares its timestamp.
+	 */
+	if (bus->stats_period && (batch = uploader_batch(bus->up, bus->source)) != NULL)
+	{
+		report(bus, batch, &ts);
+		uploader_commit(bus->up, bus->source);
+
+		bus->stats_next = (now / bus->stats_period + 1U) * bus->stats_period;
+	}
+
+	/* the new plan may tick at another rate; all of its jobs are due now */
+	if (plan->sched.tick != bus->ticker.period && ticker_set(&bus->ticker, plan->sched.tick) == -1)
+		perror("ticker_set");
+
+	/* what is known about the slaves outlives the plan */
+	for (size_t k=0; k < plan->config.nmeters; k++)
+		for (size_t j=0; j < bus->plan->config.nmeters; j++)
+			if (plan->config.meters[k].slave == bus->plan->config.meters[j].slave)
+			{
+				plan->rtt[k] = bus->plan->rtt[j];
+				break;
+			}
+
+	bus_plan_free(bus->plan);
+	bus->plan = plan;
+
+	if (write(bus->swapped, &one, sizeof(one)) == -1)
+		perror("write(eventfd)");
+}
+
+
+/*
+ * bus_main:
+ *   the poll thread of a bus. sleeps until the next tick, or until
+ *   told to stop.
+ */
+static void *bus_main (void *arg)
+{
+	struct bus *bus = arg;
+
+	for (;;)
+	{
+		struct epoll_event ev;
+		struct timespec    due;
+		int64_t            missed;
+		uint64_t           now;
+
+		if (epoll_wait(bus->epfd, &ev, 1, -1) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+
+			perror("epoll_wait");
+			break;
+		}
+
+		if (ev.data.fd == bus->wake)
+			break;
+
+		if ((missed = ticker_read(&bus->ticker, &due)) == -1)
+		{
+			if (errno == EAGAIN)
+				continue;
+
+			perror("ticker_read");
+			break;
+		}
+
+		/* the last tick overran; the schedule stays put */
+		if (missed > 0)
+			fprintf(stderr, "%s: poll overran, %" PRId64 " ticks missed (%" PRIu64 " in total)\n", bus->plan->config.device, missed, bus->ticker.missed);
+
+		now = (uint64_t) due.tv_sec * UINT64_C(1000000000) + (uint64_t) due.tv_nsec;
+
+		adopt(bus, now);
+
+		tick(bus, now);
+	}
+
+	/*
+	 * from here on, bus_reload switches plans by itself. a plan that was
+	 * handed over before then is still taken here, as the caller expects.
+	 */
+	for (struct bus_plan *none = NULL; !__atomic_compare_exchange_n(&bus->next, &none, &gone, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE); none = NULL)
+	{
+		struct timespec now;
+
+		clock_gettime(CLOCK_REALTIME, &now);
+
+		adopt(bus, (uint64_t) now.tv_sec * UINT64_C(1000000000) + (uint64_t) now.tv_nsec);
+	}
+
+	return NULL;
+}
+
+
+/*
+ * watch:
+ *   add "fd" to the epoll set "epfd", for reading.
+ */
+static int watch (int epfd, int fd)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/*---------------------------------------------------------------------------*\
+|*                                SERIAL LINE                                *|
+\*---------------------------------------------------------------------------*/
+
+/* the rates tried by bus_probe after the configured one, slowest first */
+static const int rates[] = { 1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200 };
+
+/* what happened to the reads of one meter at one rate */
+struct probe
+{
+	uint64_t reads;
+	uint64_t crc;      /* EMBBADCRC        */
+	uint64_t timeouts; /* ETIMEDOUT        */
+	uint64_t other;
+	uint64_t ns;       /* spent in reads   */
+};
+
+
+/*
+ * line:
+ *   open the serial line described by "c", at "baud" rather than the
+ *   configured rate. returns NULL and sets errno on errors.
+ */
+static modbus_t *line (const struct bus_config *c, int baud, int debug)
+{
+	modbus_t *mb;
+
+	if ((mb = modbus_new_rtu(c->device, baud, c->parity, c->data_bits, c->stop_bits)) == NULL)
+		return NULL;
+
+	modbus_rtu_set_serial_mode (mb, MODBUS_RTU_RS485);
+	modbus_rtu_set_rts         (mb, MODBUS_RTU_RTS_DOWN);
+	modbus_rtu_set_rts_delay   (mb, (int) c->rts_delay_us);
+	modbus_set_debug           (mb, debug);
+	modbus_set_slave           (mb, c->meters[0].slave);
+
+	if (modbus_connect(mb) == -1)
+	{
+		int err = errno;
+
+		modbus_free(mb);
+
+		errno = err;
+		return NULL;
+	}
+
+	return mb;
+}
+
+
+/*
+ * probe_rate:
+ *   read every meter of "plan" "rounds" times over "mb", as planned, and
+ *   count what went wrong with meter "k" in "probes[k]". a meter that
+ *   doesn't answer a single read of the first round isn't asked again.
+ */
+static void probe_rate (modbus_t *mb, const struct bus_plan *plan, unsigned rounds, struct probe *probes)
+{
+	const struct reg_map *map = plan->map;
+
+	for (size_t k=0; k < plan->config.nmeters; k++)
+	{
+		struct probe *p = &probes[k];
+
+		modbus_set_slave(mb, plan->config.meters[k].slave);
+
+		for (unsigned round=0; round < rounds; round++)
+		{
+			uint64_t answered = 0;
+
+			for (size_t r=0; r < map->nreads; r++)
+			{
+				const struct reg_read *rd = &map->reads[r];
+
+				struct timespec a, b;
+				int             rc;
+
+				clock_gettime(CLOCK_MONOTONIC, &a);
+				rc = modbus_read_registers(mb, rd->addr, rd->count, &plan->image[rd->offset]);
+				clock_gettime(CLOCK_MONOTONIC, &b);
+
+				p->reads += 1U;
+				p->ns    += (uint64_t) (b.tv_sec - a.tv_sec) * UINT64_C(1000000000) + (uint64_t) b.tv_nsec - (uint64_t) a.tv_nsec;
+
+				if (rc == rd->count)
+					answered++;
+
+				else if (rc >= 0)
+					p->other++;
+
+				else if (errno == EMBBADCRC)
+					p->crc++;
+
+				else if (errno == ETIMEDOUT)
+					p->timeouts++;
+
+				else
+					p->other++;
+			}
+
+			if (round == 0 && answered == 0)
+				break;
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*\
+|*                                 INTERFACE                                 *|
+\*---------------------------------------------------------------------------*/
+
+/*
+ * bus_plan_create:
+ *   plan the polling of the meters in "config". "config" is copied, but
+ *   what it points to is borrowed. names are interned in "names", which
+ *   must outlive the plan. returns NULL and sets errno on errors.
+ */
+struct bus_plan *bus_plan_create (const struct bus_config *config, struct influx_names *names)
+{
+	const struct reg_cost cost = \
+	{
+		.baud          = (uint32_t) config->baud,
+		.char_bits     = (uint32_t) (1 + config->data_bits + (config->parity != 'N') + config->stop_bits),
+		.turnaround_us = config->turnaround_us,
+		.max_read      = MODBUS_MAX_READ_REGISTERS
+	};
+
+	struct bus_plan *plan;
+	struct reg_map  *map;
+
+	if (!config->table || !config->nmeters || config->nmeters > UINT16_MAX || config->baud <= 0)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ((plan = calloc(1, sizeof(struct bus_plan))) == NULL)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	plan->config = *config;
+
+	if ((plan->map = map = regmap_compile(config->table, &cost)) == NULL)
+	{
+		bus_plan_free(plan);
+		return NULL;
+	}
+
+	/*
+	 * everything the decode pass touches is allocated once,
+	 * and the batch buffers are re-used for every tick.
+	 */
+	plan->image     = calloc(map->nimage, sizeof(uint16_t));
+	plan->templates = calloc(config->nmeters * map->ngroups, sizeof(struct influx_template));
+	plan->tagsets   = calloc(config->nmeters, sizeof(struct influx_key));
+	plan->groups    = calloc(map->ngroups, sizeof(struct influx_key));
+	plan->rtt       = calloc(config->nmeters, sizeof(struct rtt));
+	plan->xfers     = calloc(config->nmeters * map->nreads, sizeof(struct bus_xfer));
+
+	if (!plan->image || !plan->templates || !plan->tagsets || !plan->groups || !plan->rtt || !plan->xfers)
+	{
+		bus_plan_free(plan);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	for (size_t k=0; k < config->nmeters; k++)
+		rtt_init(&plan->rtt[k], config->turnaround_us);
+
+	if (regmap_fields(map, names, &plan->fields))
+	{
+		bus_plan_free(plan);
+		return NULL;
+	}
+
+	/* names and tag sets, escaped once, and a line template per meter and group */
+	for (size_t g=0; g < map->ngroups; g++)
+		if (influx_names_intern(names, map->groups[g].measurement, INFLUX_NAME_MEASUREMENT, &plan->groups[g]))
+		{
+			bus_plan_free(plan);
+			return NULL;
+		}
+
+	for (size_t k=0; k < config->nmeters; k++)
+	{
+		struct influx_key *meter = &plan->tagsets[k];
+
+		/* tags are only read */
+		struct tag tag = \
+		{
+			.name  = "meter",
+			.value = (char *) config->meters[k].name
+		};
+
+		const struct tag *tags[] = \
+		{
+			&tag,
+			NULL
+		};
+
+		if (influx_names_tagset(names, tags, meter))
+		{
+			bus_plan_free(plan);
+			return NULL;
+		}
+
+		for (size_t g=0; g < map->ngroups; g++)
+		{
+			if (influx_template_init(&plan->templates[k * map->ngroups + g], &plan->groups[g], meter, &plan->fields.v[map->first[g]], map->first[g + 1] - map->first[g])
+			||  sched_add(&plan->sched, (uint16_t) k, (uint8_t) g, map->groups[g].period_ms * UINT64_C(1000000), regmap_group_cost(map, g))
+			){
+				bus_plan_free(plan);
+				return NULL;
+			}
+		}
+	}
+
+	return plan;
+}
+
+
+/*
+ * bus_plan_free:
+ *   deallocate a plan. does nothing if plan is NULL.
+ */
+void bus_plan_free (struct bus_plan *plan)
+{
+	if (plan == NULL)
+		return;
+
+	if (plan->templates)
+		for (size_t t=0; t < plan->config.nmeters * plan->map->ngroups; t++)
+			influx_template_free(&plan->templates[t]);
+
+	free(plan->xfers);
+	free(plan->rtt);
+	free(plan->groups);
+	free(plan->tagsets);
+	free(plan->templates);
+	free(plan->image);
+	influx_fields_free(&plan->fields);
+	sched_free(&plan->sched);
+	regmap_free(plan->map);
+	free(plan);
+}
+
+
+/*
+ * bus_open:
+ *   plan the polling of the meters in "config", and prepare their lines,
+ *   timestamped with precision "prec". "config" is copied, but what it
+ *   points to is borrowed. names are interned in "names", which must
+ *   outlive the bus. the serial line is not opened yet, see "bus_connect".
+ *   returns -1 and sets errno on errors.
+ */
+int bus_open (struct bus *bus, const struct bus_config *config, struct influx_names *names, enum influx_precision prec)
+{
+	*bus = (struct bus) { .prec = prec, .wake = -1, .swapped = -1, .epfd = -1, .ticker.fd = -1 };
+
+	if ((bus->plan = bus_plan_create(config, names)) == NULL)
+		return -1;
+
+	return 0;
+}
+
+
+/*
+ * bus_connect:
+ *   open the serial line of "bus". returns -1 and sets errno on errors.
+ */
+int bus_connect (struct bus *bus, int debug)
+{
+	const struct bus_config *c = &bus->plan->config;
+
+	return (bus->mb = line(c, c->baud, debug)) ? 0 : -1;
+}
+
+
+/*
+ * bus_start:
+ *   start polling "bus" in a thread of its own, posting the lines through
+ *   "up" as "source", and the statistics every "stats_ms" milliseconds
+ *   (never if 0). returns -1 and sets errno on errors.
+ */
+int bus_start (struct bus *bus, struct uploader *up, size_t source, uint32_t stats_ms)
+{
+	struct timespec now;
+
+	int rc;
+
+	bus->up     = up;
+	bus->source = source;
+
+	/* the first report covers less than a period, so the rest line up with the clock */
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	bus->stats_period = stats_ms * UINT64_C(1000000);
+	bus->stats_next   = (bus->stats_period == 0) ? 0U
+	                  : ((uint64_t) now.tv_sec * UINT64_C(1000000000) + (uint64_t) now.tv_nsec) / bus->stats_period * bus->stats_period + bus->stats_period;
+
+	if (ticker_start(&bus->ticker, bus->plan->sched.tick) == -1)
+		return -1;
+
+	if ((bus->wake    = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1
+	||  (bus->swapped = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1
+	||  (bus->epfd = epoll_create1(EPOLL_CLOEXEC))            == -1
+	||  watch(bus->epfd, bus->wake)                          == -1
+	||  watch(bus->epfd, bus->ticker.fd)                     == -1
+	)
+		return -1;
+
+	/* signals are left to the main thread, which blocks them before this */
+	if ((rc = pthread_create(&bus->thread, NULL, bus_main, bus)) != 0)
+	{
+		errno = rc;
+		return -1;
+	}
+
+	bus->running = 1;
+
+	return 0;
+}
+
+
+/*
+ * bus_reload:
+ *   switch the started "bus" over to "plan" (from bus_plan_create) before
+ *   its next tick, and take ownership of it. the serial settings of the
+ *   plan are ignored, as the line stays open. returns 1 if the poll thread
+ *   is to switch, and writes "swapped" once it has; until then, the
+ *   configuration of the old plan must stay around. returns 0 if the poll
+ *   thread has exited, and the bus was switched over right away.
+ */
+int bus_reload (struct bus *bus, struct bus_plan *plan)
+{
+	struct bus_plan *prev = __atomic_load_n(&bus->next, __ATOMIC_ACQUIRE);
+
+	do
+	{
+		/* nobody else is left to use the old plan */
+		if (prev == &gone)
+		{
+			bus_plan_free(bus->plan);
+			bus->plan = plan;
+			return 0;
+		}
+	}
+	while (!__atomic_compare_exchange_n(&bus->next, &prev, plan, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	/* a plan that was handed over, but not taken yet, is never used */
+	bus_plan_free(prev);
+
+	return 1;
+}
+
+
+/*
+ * bus_probe:
+ *   try the serial line of "bus" at its configured baud rate, and then at
+ *   every standard rate above it, reading every meter "rounds" times as
+ *   planned, until a rate that worked is followed by one that doesn't. the
+ *   error counts of every meter, and the fastest rate at which nothing went
+ *   wrong with any of them, are written to "fp". the line must not be
+ *   connected (see bus_connect).
+ *   returns that rate, 0 if there is none, or -1 and sets errno on errors.
+ */
+int bus_probe (FILE *fp, const struct bus *bus, unsigned rounds)
+{
+	const struct bus_plan   *plan = bus->plan;
+	const struct bus_config *c    = &plan->config;
+
+	struct probe *probes;
+
+	int    best = 0;
+	size_t i    = 0;
+
+	if ((probes = calloc(c->nmeters, sizeof(struct probe))) == NULL)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+
+	fprintf(fp, "%s: %d%c%d, %zu meters, %u rounds of %zu reads\n",
+		c->device, c->data_bits, c->parity, c->stop_bits, c->nmeters, rounds, plan->map->nreads);
+
+	fprintf(fp, "%8s  %-12s  %7s  %5s  %8s  %5s  %9s  %9s\n", "baud", "meter", "reads", "crc", "timeout", "other", "error [%]", "read [ms]");
+
+	/* the configured rate first, even if it isn't a standard one */
+	for (int baud = c->baud; baud; baud = (i < sizeof(rates) / sizeof(*rates)) ? rates[i] : 0)
+	{
+		modbus_t *mb;
+		uint64_t  errors = 0;
+
+		if ((mb = line(c, baud, 0)) == NULL)
+		{
+			int err = errno;
+
+			free(probes);
+
+			errno = err;
+			return -1;
+		}
+
+		memset(probes, 0, c->nmeters * sizeof(struct probe));
+
+		probe_rate(mb, plan, rounds, probes);
+
+		modbus_close(mb);
+		modbus_free(mb);
+
+		for (size_t k=0; k < c->nmeters; k++)
+		{
+			const struct probe *p = &probes[k];
+
+			uint64_t failed = p->crc + p->timeouts + p->other;
+
+			fprintf(fp, "%8d  %-12s  %7" PRIu64 "  %5" PRIu64 "  %8" PRIu64 "  %5" PRIu64 "  %9.2f  %9.2f\n",
+				baud, c->meters[k].name, p->reads, p->crc, p->timeouts, p->other,
+				p->reads ? 100.0 * (double) failed / (double) p->reads : 0.0,
+				p->reads ? (double) p->ns / (double) p->reads / 1e6 : 0.0
+			);
+
+			errors += failed;
+		}
+
+		/* once a rate works, go faster until one doesn't */
+		if (errors == 0)
+			best = baud;
+
+		else if (best)
+			break;
+
+		while (i < sizeof(rates) / sizeof(*rates) && rates[i] <= baud)
+			i++;
+	}
+
+	free(probes);
+
+	if (best == 0)
+		fprintf(fp, "no rate from %d baud and up is stable\n", c->baud);
+
+	else if (best == c->baud)
+		fprintf(fp, "fastest stable rate: %d baud, as configured\n", best);
+
+	else
+		fprintf(fp, "fastest stable rate: %d baud, set \"baud = %d\" under [bus %s]\n", best, best, c->device);
+
+	return best;
+}
+
+
+/*
+ * bus_stop:
+ *   stop polling "bus", after the tick in progress, if any.
+ */
+void bus_stop (struct bus *bus)
+{
+	const uint64_t one = 1;
+
+	if (!bus->running)
+		return;
+
+	if (write(bus->wake, &one, sizeof(one)) == -1)
+		perror("write(eventfd)");
+
+	pthread_join(bus->thread, NULL);
+
+	bus->running = 0;
+}
+
+
+/*
+ * bus_close:
+ *   close the serial line of "bus" and deallocate everything it holds.
+ */
+void bus_close (struct bus *bus)
+{
+	bus_stop(bus);
+
+	ticker_stop(&bus->ticker);
+
+	if (bus->wake != -1)
+		close(bus->wake);
+
+	if (bus->swapped != -1)
+		close(bus->swapped);
+
+	if (bus->epfd != -1)
+		close(bus->epfd);
+
+	if (bus->mb)
+	{
+		modbus_close(bus->mb);
+		modbus_free(bus->mb);
+	}
+
+	bus_plan_free(bus->plan);
+
+	if (bus->next != &gone)
+		bus_plan_free(bus->next);
+
+	*bus = (struct bus) { .wake = -1, .swapped = -1, .epfd = -1, .ticker.fd = -1 };
+}
+
+
+/*
+ * bus_print_plan:
+ *   write the serial settings and the planned reads of "bus" to "fp".
+ */
+void bus_print_plan (FILE *fp, const struct bus *bus)
+{
+	const struct bus_config *c = &bus->plan->config;
+
+	fprintf(fp, "%s: %d baud, %d%c%d, %u us turnaround, %zu meters\n",
+		c->device, c->baud, c->data_bits, c->parity, c->stop_bits, c->turnaround_us, c->nmeters);
+
+	regmap_print_plan(fp, bus->plan->map);
+}
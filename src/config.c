@@ -0,0 +1,973 @@
+
+/*
+ * config.c
+ * lucas@pamorana.net (2024)
+ *
+ * Reading the site configuration file.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*---------------------------------------------------------------------------*\
+|*                                  HEADERS                                  *|
+\*---------------------------------------------------------------------------*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+
+#include "config.h"
+
+/*---------------------------------------------------------------------------*\
+|*                                  PARSER                                   *|
+\*---------------------------------------------------------------------------*/
+
+enum section
+{
+	SECTION_NONE = 0,
+	SECTION_INFLUX,
+	SECTION_BATCH,
+	SECTION_SPOOL,
+	SECTION_STATS,
+	SECTION_MAP,
+	SECTION_BUS
+};
+
+/* a run of elements in one of the arrays of a config */
+struct range
+{
+	size_t first;
+	size_t count;
+};
+
+/* a [map] section; its tables are only placed once the file is read */
+struct map_entry
+{
+	const char  *name;
+	unsigned     line;
+	struct range defs;
+	struct range groups;
+	struct range spans;
+
+	/* the last group so far, and how many registers it has */
+	unsigned     group_line;
+	size_t       group_defs;
+};
+
+/* a [bus] section; its meters are placed, and its map found, likewise */
+struct bus_entry
+{
+	struct bus_config config;
+	unsigned          line;
+	struct range      meters;
+};
+
+struct parser
+{
+	const char       *path;
+	unsigned          line;
+	struct config    *cfg;
+	enum section      section;
+
+	size_t            ndefs,   capdefs;
+	size_t            ngroups, capgroups;
+	size_t            nspans,  capspans;
+	size_t            nmeters, capmeters;
+	size_t            capstrings;
+
+	struct map_entry *maps;
+	size_t            nmaps,   capmaps;
+	struct bus_entry *buses;
+	size_t            nbuses,  capbuses;
+
+	const struct bus_config *bus_defaults;
+};
+
+
+/*
+ * fail:
+ *   report a mistake on the current line, and set errno to EINVAL.
+ *   always returns -1.
+ */
+static int fail (struct parser *p, const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "%s:%u: ", p->path, p->line);
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+
+	fputc('\n', stderr);
+
+	errno = EINVAL;
+	return -1;
+}
+
+
+/*
+ * grow:
+ *   make room for one more element of "size" bytes in the array "arr",
+ *   holding "n" elements out of "*cap". returns the array, which may have
+ *   moved, or NULL on allocation errors, leaving "arr" as it was.
+ */
+static void *grow (void *arr, size_t *cap, size_t n, size_t size)
+{
+	void  *mem;
+	size_t c;
+
+	if (n < *cap)
+		return arr;
+
+	c = *cap ? 2 * *cap : 8;
+
+	if ((mem = realloc(arr, c * size)) == NULL)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	*cap = c;
+
+	return mem;
+}
+
+
+/*
+ * keep:
+ *   a copy of "str" that lives as long as the config.
+ *   returns NULL on allocation errors.
+ */
+static const char *keep (struct parser *p, const char *str)
+{
+	struct config *cfg = p->cfg;
+
+	char *dup;
+	void *tmp;
+
+	if ((tmp = grow(cfg->strings, &p->capstrings, cfg->nstrings, sizeof(char *))) == NULL)
+		return NULL;
+
+	cfg->strings = tmp;
+
+	if ((dup = strdup(str)) == NULL)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return cfg->strings[cfg->nstrings++] = dup;
+}
+
+
+/*
+ * number:
+ *   parse "str" as a decimal, hexadecimal (0x) or octal (0) number of at
+ *   most "max". returns -1 if it isn't one.
+ */
+static int number (const char *str, uint64_t max, uint64_t *out)
+{
+	unsigned long long v;
+	char              *end;
+
+	if (str == NULL || *str == '\0' || *str == '-' || *str == '+')
+		return -1;
+
+	errno = 0;
+	v     = strtoull(str, &end, 0);
+
+	if (errno || *end != '\0' || v > max)
+		return -1;
+
+	*out = (uint64_t) v;
+	return 0;
+}
+
+
+/* trim white space from both ends of "str", in place */
+static char *trim (char *str)
+{
+	char *end;
+
+	while (*str == ' ' || *str == '\t')
+		str++;
+
+	end = str + strlen(str);
+
+	while (end > str && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n' || end[-1] == '\r'))
+		*--end = '\0';
+
+	return str;
+}
+
+
+/*
+ * filled:
+ *   check that the last group of map "m" has registers, once no more
+ *   can be added to it.
+ */
+static int filled (struct parser *p, const struct map_entry *m)
+{
+	if (m->groups.count == 0 || m->group_defs > 0)
+		return 0;
+
+	p->line = m->group_line;
+
+	return fail(p, "group %s has no registers", p->cfg->groups[m->groups.first + m->groups.count - 1].measurement);
+}
+
+
+/*
+ * leave:
+ *   check the current section, before the next one starts or the file ends.
+ */
+static int leave (struct parser *p)
+{
+	if (p->section == SECTION_MAP)
+		return filled(p, &p->maps[p->nmaps - 1]);
+
+	return 0;
+}
+
+
+/*
+ * section:
+ *   start the section "[name arg]".
+ */
+static int section (struct parser *p, const char *name, const char *arg)
+{
+	static const char *const plain[] = \
+	{
+		[SECTION_INFLUX] = "influx",
+		[SECTION_BATCH]  = "batch",
+		[SECTION_SPOOL]  = "spool",
+		[SECTION_STATS]  = "stats",
+	};
+
+	if (leave(p))
+		return -1;
+
+	for (enum section s=SECTION_INFLUX; s <= SECTION_STATS; s++)
+		if (strcmp(name, plain[s]) == 0)
+		{
+			if (*arg)
+				return fail(p, "[%s] takes no argument", name);
+
+			p->section = s;
+			return 0;
+		}
+
+	if (*arg == '\0')
+		return fail(p, "[%s] needs a name", name);
+
+	if (strcmp(name, "map") == 0)
+	{
+		struct map_entry *m;
+		void             *tmp;
+
+		for (size_t i=0; i < p->nmaps; i++)
+			if (strcmp(p->maps[i].name, arg) == 0)
+				return fail(p, "map \"%s\" is defined twice", arg);
+
+		if ((tmp = grow(p->maps, &p->capmaps, p->nmaps, sizeof(struct map_entry))) == NULL)
+			return -1;
+
+		p->maps = tmp;
+
+		m = &p->maps[p->nmaps];
+
+		*m = (struct map_entry) \
+		{
+			.line   = p->line,
+			.defs   = { .first = p->ndefs   },
+			.groups = { .first = p->ngroups },
+			.spans  = { .first = p->nspans  }
+		};
+
+		if ((m->name = keep(p, arg)) == NULL)
+			return -1;
+
+		p->nmaps++;
+		p->section = SECTION_MAP;
+		return 0;
+	}
+
+	if (strcmp(name, "bus") == 0)
+	{
+		struct bus_entry *b;
+		void             *tmp;
+
+		/* two poll threads can't share one line */
+		for (size_t i=0; i < p->nbuses; i++)
+			if (strcmp(p->buses[i].config.device, arg) == 0)
+				return fail(p, "bus %s is there twice", arg);
+
+		if ((tmp = grow(p->buses, &p->capbuses, p->nbuses, sizeof(struct bus_entry))) == NULL)
+			return -1;
+
+		p->buses = tmp;
+
+		b = &p->buses[p->nbuses];
+
+		*b = (struct bus_entry) \
+		{
+			.line   = p->line,
+			.meters = { .first = p->nmeters }
+		};
+
+		/* the serial settings and map name of the first default bus, if any */
+		if (p->bus_defaults)
+			b->config = *p->bus_defaults;
+
+		b->config.meters  = NULL;
+		b->config.nmeters = 0;
+		b->config.table   = NULL;
+
+		if ((b->config.device = keep(p, arg)) == NULL)
+			return -1;
+
+		p->nbuses++;
+		p->section = SECTION_BUS;
+		return 0;
+	}
+
+	return fail(p, "unknown section [%s]", name);
+}
+
+
+/*
+ * map_setting:
+ *   apply a setting of a [map] section.
+ */
+static int map_setting (struct parser *p, const char *key, char *args[], size_t nargs)
+{
+	struct config    *cfg = p->cfg;
+	struct map_entry *m   = &p->maps[p->nmaps - 1];
+
+	uint64_t addr, count, width, scale, period;
+	void    *tmp;
+
+	if (strcmp(key, "readable") == 0)
+	{
+		if (nargs != 2 || number(args[0], UINT16_MAX, &addr) || number(args[1], UINT16_MAX, &count))
+			return fail(p, "expected \"readable = addr count\"");
+
+		if (addr + count > 0x10000)
+			return fail(p, "registers end at 0xFFFF");
+
+		if ((tmp = grow(cfg->spans, &p->capspans, p->nspans, sizeof(struct reg_span))) == NULL)
+			return -1;
+
+		cfg->spans = tmp;
+
+		cfg->spans[p->nspans++] = (struct reg_span) { (uint16_t) addr, (uint16_t) count };
+		m->spans.count++;
+		return 0;
+	}
+
+	if (strcmp(key, "group") == 0)
+	{
+		struct reg_group *g;
+
+		if (nargs != 2 || number(args[1], UINT32_MAX, &period) || period == 0)
+			return fail(p, "expected \"group = measurement period_ms\"");
+
+		if (filled(p, m))
+			return -1;
+
+		if (m->groups.count == UINT8_MAX)
+			return fail(p, "too many groups");
+
+		if ((tmp = grow(cfg->groups, &p->capgroups, p->ngroups, sizeof(struct reg_group))) == NULL)
+			return -1;
+
+		cfg->groups = tmp;
+
+		g = &cfg->groups[p->ngroups];
+
+		g->period_ms = (uint32_t) period;
+
+		if ((g->measurement = keep(p, args[0])) == NULL)
+			return -1;
+
+		p->ngroups++;
+		m->groups.count++;
+		m->group_line = p->line;
+		m->group_defs = 0;
+		return 0;
+	}
+
+	if (strcmp(key, "reg") == 0)
+	{
+		struct reg_def *d;
+		uint8_t         flags = 0;
+
+		if (nargs < 4
+		||  number(args[0], UINT16_MAX, &addr)
+		||  number(args[1], 4,          &width) || !(width == 1 || width == 2 || width == 4)
+		||  number(args[2], UINT32_MAX, &scale) || scale == 0
+		)
+			return fail(p, "expected \"reg = addr width scale field [signed] [raw]\"");
+
+		if (addr + width > 0x10000)
+			return fail(p, "registers end at 0xFFFF");
+
+		for (size_t i=4; i < nargs; i++)
+		{
+			if (strcmp(args[i], "signed") == 0)
+				flags |= REG_SIGNED;
+			else if (strcmp(args[i], "raw") == 0)
+				flags |= REG_RAW;
+			else
+				return fail(p, "unknown flag \"%s\"", args[i]);
+		}
+
+		/* every register belongs to the group above it */
+		if (m->groups.count == 0)
+			return fail(p, "\"reg\" before the first \"group\"");
+
+		if ((tmp = grow(cfg->defs, &p->capdefs, p->ndefs, sizeof(struct reg_def))) == NULL)
+			return -1;
+
+		cfg->defs = tmp;
+
+		d = &cfg->defs[p->ndefs];
+
+		d->addr  = (uint16_t) addr;
+		d->width = (uint8_t)  width;
+		d->flags = flags;
+		d->group = (uint8_t)  (m->groups.count - 1);
+		d->scale = (uint32_t) scale;
+
+		if ((d->name = keep(p, args[3])) == NULL)
+			return -1;
+
+		p->ndefs++;
+		m->defs.count++;
+		m->group_defs++;
+		return 0;
+	}
+
+	return fail(p, "bad setting \"%s\"", key);
+}
+
+
+/*
+ * bus_setting:
+ *   apply a setting of a [bus] section.
+ */
+static int bus_setting (struct parser *p, const char *key, char *args[], size_t nargs)
+{
+	struct config     *cfg = p->cfg;
+	struct bus_entry  *b   = &p->buses[p->nbuses - 1];
+	struct bus_config *c   = &b->config;
+
+	uint64_t v;
+	void    *tmp;
+
+	if (strcmp(key, "meter") == 0)
+	{
+		struct bus_meter *m;
+
+		if (nargs > 2 || number(args[0], 247, &v) || v == 0)
+			return fail(p, "expected \"meter = slave [name]\", with a slave id from 1 to 247");
+
+		if ((tmp = grow(cfg->meters, &p->capmeters, p->nmeters, sizeof(struct bus_meter))) == NULL)
+			return -1;
+
+		cfg->meters = tmp;
+
+		/* slave ids only have to be unique on their bus, meter names everywhere */
+		for (size_t i=0; i < p->nmeters; i++)
+		{
+			if (i >= b->meters.first && cfg->meters[i].slave == (int) v)
+				return fail(p, "bus %s: slave %d is there twice", c->device, (int) v);
+
+			if (strcmp(cfg->meters[i].name, args[nargs - 1]) == 0)
+				return fail(p, "meter \"%s\" is there twice", args[nargs - 1]);
+		}
+
+		m = &cfg->meters[p->nmeters];
+
+		m->slave = (int) v;
+
+		/* named after the slave id, unless told otherwise */
+		if ((m->name = keep(p, args[nargs - 1])) == NULL)
+			return -1;
+
+		p->nmeters++;
+		b->meters.count++;
+		return 0;
+	}
+
+	if (nargs != 1)
+		return fail(p, "too many values for \"%s\"", key);
+
+	if (strcmp(key, "map") == 0)
+		return (c->map = keep(p, args[0])) ? 0 : -1;
+
+	if (strcmp(key, "parity") == 0)
+	{
+		if (strlen(args[0]) != 1 || !strchr("NEO", args[0][0]))
+			return fail(p, "parity is one of N, E and O");
+
+		c->parity = args[0][0];
+		return 0;
+	}
+
+	if (strcmp(key, "baud") == 0 && number(args[0], 4000000, &v) == 0 && v > 0)
+	{
+		c->baud = (int) v;
+		return 0;
+	}
+
+	if (strcmp(key, "data_bits") == 0 && number(args[0], 8, &v) == 0 && v >= 5)
+	{
+		c->data_bits = (int) v;
+		return 0;
+	}
+
+	if (strcmp(key, "stop_bits") == 0 && number(args[0], 2, &v) == 0 && v >= 1)
+	{
+		c->stop_bits = (int) v;
+		return 0;
+	}
+
+	if (strcmp(key, "turnaround_us") == 0 && number(args[0], UINT32_MAX, &v) == 0)
+	{
+		c->turnaround_us = (uint32_t) v;
+		return 0;
+	}
+
+	if (strcmp(key, "rts_delay_us") == 0 && number(args[0], UINT32_MAX, &v) == 0)
+	{
+		c->rts_delay_us = (uint32_t) v;
+		return 0;
+	}
+
+	return fail(p, "bad setting \"%s\"", key);
+}
+
+
+/*
+ * setting:
+ *   apply "key = value" to the current section. "value" is modified.
+ */
+static int setting (struct parser *p, const char *key, char *value)
+{
+	struct config *cfg = p->cfg;
+
+	char    *args[8];
+	size_t   nargs = 0;
+	char    *save;
+	uint64_t v;
+
+	/* the spool directory is the only setting that may be left empty */
+	if (p->section == SECTION_SPOOL && strcmp(key, "dir") == 0)
+		return (cfg->spool_dir = keep(p, value)) ? 0 : -1;
+
+	for (char *tok = strtok_r(value, " \t", &save); tok; tok = strtok_r(NULL, " \t", &save))
+	{
+		if (nargs == sizeof(args) / sizeof(*args))
+			return fail(p, "too many values for \"%s\"", key);
+
+		args[nargs++] = tok;
+	}
+
+	if (nargs == 0)
+		return fail(p, "no value for \"%s\"", key);
+
+	switch (p->section)
+	{
+	case SECTION_NONE:
+		return fail(p, "\"%s\" outside of a section", key);
+
+	case SECTION_INFLUX:
+		if (strcmp(key, "url") == 0)
+			return (cfg->url = keep(p, args[0])) ? 0 : -1;
+
+		if (strcmp(key, "org") == 0)
+			return (cfg->org = keep(p, args[0])) ? 0 : -1;
+
+		if (strcmp(key, "bucket") == 0)
+			return (cfg->bucket = keep(p, args[0])) ? 0 : -1;
+
+		if (strcmp(key, "precision") == 0)
+		{
+			for (int i=0; i < INFLUX_PRECISION_END; i++)
+				if (strcmp(args[0], influx_precision_str[i]) == 0)
+				{
+					cfg->precision = (enum influx_precision) i;
+					return 0;
+				}
+
+			return fail(p, "precision is one of s, ms, us and ns");
+		}
+
+		if (strcmp(key, "gzip") == 0)
+		{
+			if (number(args[0], 9, &v))
+				return fail(p, "gzip is a level from 0 to 9");
+
+			cfg->gzip = (int) v;
+			return 0;
+		}
+
+		if (strcmp(key, "batches") == 0)
+		{
+			if (number(args[0], 1024, &v) || v == 0)
+				return fail(p, "batches is a number from 1 to 1024");
+
+			cfg->batches = (size_t) v;
+			return 0;
+		}
+
+		if (strcmp(key, "inflight") == 0)
+		{
+			if (number(args[0], 64, &v))
+				return fail(p, "inflight is a number from 0 to 64");
+
+			cfg->inflight = (size_t) v;
+			return 0;
+		}
+		break;
+
+	case SECTION_BATCH:
+		if (strcmp(key, "bytes") == 0 && number(args[0], SIZE_MAX, &v) == 0)
+		{
+			cfg->limits.max_bytes = (size_t) v;
+			return 0;
+		}
+
+		if (strcmp(key, "lines") == 0 && number(args[0], SIZE_MAX, &v) == 0)
+		{
+			cfg->limits.max_lines = (size_t) v;
+			return 0;
+		}
+
+		if (strcmp(key, "age_ms") == 0 && number(args[0], UINT32_MAX, &v) == 0)
+		{
+			cfg->limits.max_age_ms = (uint32_t) v;
+			return 0;
+		}
+		break;
+
+	case SECTION_SPOOL:
+		if (strcmp(key, "segment") == 0 && number(args[0], SIZE_MAX, &v) == 0)
+		{
+			cfg->spool.segment_bytes = (size_t) v;
+			return 0;
+		}
+
+		if (strcmp(key, "max") == 0 && number(args[0], SIZE_MAX, &v) == 0)
+		{
+			cfg->spool.max_bytes = (size_t) v;
+			return 0;
+		}
+
+		if (strcmp(key, "sync") == 0 && number(args[0], SIZE_MAX, &v) == 0)
+		{
+			cfg->spool.sync_bytes = (size_t) v;
+			return 0;
+		}
+		break;
+
+	case SECTION_STATS:
+		if (strcmp(key, "period_ms") == 0 && number(args[0], UINT32_MAX, &v) == 0)
+		{
+			cfg->stats_ms = (uint32_t) v;
+			return 0;
+		}
+		break;
+
+	case SECTION_MAP:
+		return map_setting(p, key, args, nargs);
+
+	case SECTION_BUS:
+		return bus_setting(p, key, args, nargs);
+	}
+
+	return fail(p, "bad setting \"%s\"", key);
+}
+
+
+/*
+ * attach:
+ *   point bus "c" at the table of the map it names, among the maps placed
+ *   in the config being read. a table is never taken from another config,
+ *   so a map that the file redefines is the one every bus uses.
+ */
+static int attach (struct parser *p, struct bus_config *c)
+{
+	const struct config *cfg = p->cfg;
+
+	if (c->map == NULL)
+		return fail(p, "bus %s has no map", c->device);
+
+	for (size_t k=0; k < cfg->nmaps; k++)
+		if (strcmp(cfg->maps[k].name, c->map) == 0)
+		{
+			c->table = &cfg->maps[k].table;
+			return 0;
+		}
+
+	return fail(p, "bus %s: no map named \"%s\"", c->device, c->map);
+}
+
+
+/*
+ * place:
+ *   point the maps and buses into the arrays that were read, now that
+ *   those are complete and won't move again.
+ */
+static int place (struct parser *p, const struct config *defaults)
+{
+	struct config *cfg = p->cfg;
+
+	struct config_map *maps;
+	struct bus_config *buses;
+
+	size_t nbuses = p->nbuses ? p->nbuses : defaults->nbuses;
+
+	if ((maps  = calloc(p->nmaps + defaults->nmaps + 1, sizeof(struct config_map))) == NULL
+	||  (cfg->maps = maps, buses = calloc(nbuses + 1, sizeof(struct bus_config))) == NULL
+	){
+		errno = ENOMEM;
+		return -1;
+	}
+
+	cfg->buses = buses;
+
+	for (size_t i=0; i < p->nmaps; i++)
+	{
+		const struct map_entry *m = &p->maps[i];
+
+		p->line = m->line;
+
+		if (m->defs.count == 0)
+			return fail(p, "map \"%s\" has no registers", m->name);
+
+		maps[cfg->nmaps++] = (struct config_map) \
+		{
+			.name  = m->name,
+			.table = \
+			{
+				.defs      = &cfg->defs[m->defs.first],
+				.groups    = &cfg->groups[m->groups.first],
+				.readable  = m->spans.count ? &cfg->spans[m->spans.first] : NULL,
+				.ndefs     = m->defs.count,
+				.ngroups   = m->groups.count,
+				.nreadable = m->spans.count
+			}
+		};
+	}
+
+	/* the compiled-in maps, unless redefined */
+	for (size_t i=0; i < defaults->nmaps; i++)
+	{
+		size_t k = 0;
+
+		while (k < p->nmaps && strcmp(p->maps[k].name, defaults->maps[i].name))
+			k++;
+
+		if (k == p->nmaps)
+			maps[cfg->nmaps++] = defaults->maps[i];
+	}
+
+	if (p->nbuses == 0)
+	{
+		for (size_t i=0; i < defaults->nbuses; i++)
+		{
+			buses[cfg->nbuses] = defaults->buses[i];
+
+			if (attach(p, &buses[cfg->nbuses++]))
+				return -1;
+		}
+
+		return 0;
+	}
+
+	for (size_t i=0; i < p->nbuses; i++)
+	{
+		struct bus_entry *b = &p->buses[i];
+
+		p->line = b->line;
+
+		if (b->meters.count == 0)
+			return fail(p, "bus %s has no meters", b->config.device);
+
+		if (attach(p, &b->config))
+			return -1;
+
+		b->config.meters  = &cfg->meters[b->meters.first];
+		b->config.nmeters = b->meters.count;
+
+		buses[cfg->nbuses++] = b->config;
+	}
+
+	return 0;
+}
+
+/*---------------------------------------------------------------------------*\
+|*                                 INTERFACE                                 *|
+\*---------------------------------------------------------------------------*/
+
+/*
+ * config_load:
+ *   read the configuration file "path" on top of "defaults". errors are
+ *   reported on stderr, with the line they were found on.
+ *   returns NULL and sets errno on errors.
+ */
+struct config *config_load (const char *path, const struct config *defaults)
+{
+	struct parser  p = { .path = path };
+	struct config *cfg;
+
+	FILE  *fp;
+	char  *line = NULL;
+	size_t cap  = 0;
+	int    rc   = 0;
+	int    err;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return NULL;
+
+	if ((cfg = calloc(1, sizeof(struct config))) == NULL)
+	{
+		fclose(fp);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	/* the settings; the tables are placed once the whole file is read */
+	cfg->url       = defaults->url;
+	cfg->org       = defaults->org;
+	cfg->bucket    = defaults->bucket;
+	cfg->precision = defaults->precision;
+	cfg->gzip      = defaults->gzip;
+	cfg->batches   = defaults->batches;
+	cfg->inflight  = defaults->inflight;
+	cfg->limits    = defaults->limits;
+	cfg->spool_dir = defaults->spool_dir;
+	cfg->spool     = defaults->spool;
+	cfg->stats_ms  = defaults->stats_ms;
+
+	p.cfg          = cfg;
+	p.bus_defaults = defaults->nbuses ? &defaults->buses[0] : NULL;
+
+	while (rc == 0 && getline(&line, &cap, fp) != -1)
+	{
+		char *str;
+		char *mark;
+
+		p.line++;
+
+		if ((mark = strchr(line, '#')) != NULL)
+			*mark = '\0';
+
+		if (*(str = trim(line)) == '\0')
+			continue;
+
+		if (*str == '[')
+		{
+			char *arg;
+
+			if (str[strlen(str) - 1] != ']')
+			{
+				rc = fail(&p, "expected \"[section]\"");
+				break;
+			}
+
+			str[strlen(str) - 1] = '\0';
+
+			str = trim(str + 1);
+			arg = str + strcspn(str, " \t");
+
+			if (*arg)
+				*arg++ = '\0';
+
+			rc = section(&p, str, trim(arg));
+			continue;
+		}
+
+		if ((mark = strchr(str, '=')) == NULL)
+		{
+			rc = fail(&p, "expected \"key = value\"");
+			break;
+		}
+
+		*mark = '\0';
+
+		rc = setting(&p, trim(str), trim(mark + 1));
+	}
+
+	if (rc == 0 && ferror(fp))
+		rc = -1;
+
+	if (rc == 0)
+		rc = leave(&p);
+
+	free(line);
+	fclose(fp);
+
+	if (rc == 0)
+		rc = place(&p, defaults);
+
+	err = errno;
+
+	free(p.maps);
+	free(p.buses);
+
+	if (rc == -1)
+	{
+		/* mistakes in the file have been reported already */
+		if (err != EINVAL)
+			fprintf(stderr, "%s:%u: %s\n", path, p.line, strerror(err));
+
+		config_free(cfg);
+		errno = err;
+		return NULL;
+	}
+
+	return cfg;
+}
+
+
+/*
+ * config_free:
+ *   deallocate a configuration from config_load. does nothing if NULL.
+ */
+void config_free (struct config *cfg)
+{
+	if (cfg)
+	{
+		for (size_t i=0; i < cfg->nstrings; i++)
+			free(cfg->strings[i]);
+
+		free(cfg->strings);
+		free(cfg->defs);
+		free(cfg->groups);
+		free(cfg->spans);
+		free(cfg->meters);
+		free((void *) cfg->maps);
+		free((void *) cfg->buses);
+		free(cfg);
+	}
+}
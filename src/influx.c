@@ -37,6 +37,7 @@
 #include <stddef.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <limits.h>
 #include <errno.h>
 #include <signal.h>
 #include <stdlib.h>
@@ -44,12 +45,19 @@
 #include <string.h>
 #include <time.h>
 #include <assert.h>
+#include <math.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 
 /* for data transmission */
 #include <curl/curl.h>
 #include <curl/curlver.h>
 
+/* for request body compression */
+#include <zlib.h>
+
 #include "influx.h"
 
 /*---------------------------------------------------------------------------*\
@@ -165,6 +173,24 @@ char *fstringa (char *str, const char fmt[static 1], ...)
 #define fstring(...) fstringa(NULL, __VA_ARGS__)
 
 
+/*
+ * the curl library will use a callback function
+ * to let this application handle the response data.
+ *
+ * this is the structure used by the callback
+ * implementation further down.
+ */
+struct mem
+{
+	char   *mem;
+	size_t  len;
+};
+
+
+/* installs headers and the request options that never change, see below */
+static int influx_writer_setup (struct influx_writer *ctx);
+
+
 /*
  * influx_writer_create:
  *   creates a new writer instance.
@@ -189,6 +215,9 @@ struct influx_writer *influx_writer_create
 	{
 		CURLUcode rc;
 
+		write->epfd = -1;
+		write->tfd  = -1;
+
 		char *query = NULL;
 
 		if ((write->curl    = curl_easy_init()) == NULL
@@ -234,6 +263,13 @@ struct influx_writer *influx_writer_create
 			return NULL;
 		}
 
+		if (influx_writer_setup(write))
+		{
+			/* errno has been set */
+			influx_writer_destroy(write);
+			return NULL;
+		}
+
 		/* done! */
 	} /* <-- if calloc writer */
 	else
@@ -251,651 +287,2081 @@ void influx_writer_destroy (struct influx_writer *ctx)
 {
 	if (ctx)
 	{
+		struct mem *resp = ctx->response;
+
+		/* in-flight writes are abandoned, without calling "done" */
+		for (size_t i=0; i < ctx->ntransfers; i++)
+		{
+			struct influx_transfer *xfer = &ctx->transfers[i];
+
+			if (xfer->buf)
+				curl_multi_remove_handle(ctx->multi, xfer->curl);
+
+			curl_easy_cleanup(xfer->curl);
+			influx_buffer_free(&xfer->zbuf);
+		}
+
+		curl_multi_cleanup(ctx->multi);
+
+		if (ctx->epfd != -1) close(ctx->epfd);
+		if (ctx->tfd  != -1) close(ctx->tfd);
+
+		free(ctx->transfers);
+
 		curl_url_cleanup  (ctx->curlurl);
 		curl_easy_cleanup (ctx->curl);
+		curl_slist_free_all(ctx->headers);
+		curl_slist_free_all(ctx->retired);
+
+		if (resp)
+			free(resp->mem);
+
+		if (ctx->zstream)
+			deflateEnd(ctx->zstream);
+
+		influx_buffer_free(&ctx->zbuf);
+
+		free(ctx->zstream);
+		free(ctx->token);
+		free(resp);
 		free(ctx);
 	}
 }
 
 
+/*---------------------------------------------------------------------------*\
+|*                           LINE PROTOCOL ENCODER                           *|
+\*---------------------------------------------------------------------------*/
+
 /*
- * influx_timestamp_precision:
- *   get a timestamp as string, based on the current time.
- *   precision will decide how many digits will be included
- *   in the sub-second resolution.
+ * influx_buffer_reserve:
+ *   make room for at least "extra" more bytes (plus a terminating null-byte)
+ *   in "buf". capacity grows geometrically, and is never given back until
+ *   "influx_buffer_free" is called.
+ *   returns -1 on memory allocation errors, leaving "buf" intact.
  */
-static char *influx_timestamp_precision (enum influx_precision prec)
+int influx_buffer_reserve (struct influx_buffer *buf, size_t extra)
 {
-	struct timespec ts;
+	size_t need = buf->len + extra + 1U;
+	size_t cap  = buf->cap ? buf->cap : 256U;
+	char  *mem;
 
-	char *stamp;
+	if (need <= buf->cap)
+		return 0;
 
-	const double divisors[INFLUX_PRECISION_END] = \
-	{
-		1.e9,
-		1.e6,
-		1.e3,
-		1.e0
-	};
+	while (cap < need)
+		cap *= 2U;
 
-	if (clock_gettime(CLOCK_REALTIME, &ts))
+	if ((mem = realloc(buf->mem, cap)) == NULL)
 	{
-		perror("clock_gettime");
-		return NULL;
+		errno = ENOMEM;
+		return -1;
 	}
 
-	if (prec)
-		stamp = fstring("%ld%.0f", ts.tv_sec, (double) ts.tv_nsec / divisors[prec]);
-	else
-		stamp = fstring("%ld", ts.tv_sec);
+	buf->mem = mem;
+	buf->cap = cap;
 
-	return stamp;
+	return 0;
 }
 
 
 /*
- * influx_writer_line:
- *   constructs a line protocol line from a set of tags and fields.
- *     "measurement" is a name for this measurement.
- *     "tags"        is a NULL-terminated list of "struct tags".
- *     "fields"      is a NULL-terminated list of "struct fields".
- *     "prec"        is the precision for the automatically generated timestamp.
+ * influx_buffer_reset:
+ *   forget the contents of "buf", but keep its memory for re-use.
  */
-char *influx_writer_line
-(
-	const char *measurement,
-	const struct tag   *tags[],
-	const struct field *fields[],
-	enum influx_precision prec
-)
+void influx_buffer_reset (struct influx_buffer *buf)
 {
-	char
-		*timestamp,
-		*fieldstr,
-		*tagstr,
-		*retval;
+	buf->len    = 0;
+	buf->lines  = 0;
+	buf->start  = 0;
+	buf->fields = 0;
+	buf->fail   = 0;
+
+	if (buf->mem)
+		buf->mem[0] = '\0';
+}
 
-	if (!tags || !fields || !measurement)
-	{
-		errno = EINVAL;
-		return NULL;
-	}
 
-	timestamp = influx_timestamp_precision(prec);
-	fieldstr  = fstring("");
-	tagstr    = fstring("");
+/*
+ * influx_buffer_free:
+ *   deallocate the memory held by "buf", and reset it.
+ */
+void influx_buffer_free (struct influx_buffer *buf)
+{
+	free(buf->mem);
+	buf->mem = NULL;
+	buf->cap = 0;
+	influx_buffer_reset(buf);
+}
 
-	if (!timestamp || !fieldstr || !tagstr)
-	{
-		free(timestamp);
-		free(fieldstr);
-		free(tagstr);
-		errno = ENOMEM;
-		return NULL;
-	}
 
-	for (int i=0; tags[i]; i++)
+/* append "len" raw bytes, without escaping */
+static int put_raw (struct influx_buffer *buf, const char *src, size_t len)
+{
+	if (buf->fail || influx_buffer_reserve(buf, len))
 	{
-		char *sep = (*tagstr == '\0') ? "" : ",";
-
-		if (!*(tags[i]->name) || !*(tags[i]->value))
-			continue;
+		buf->fail = 1;
+		return -1;
+	}
 
-		tagstr = fstringa(tagstr, "%s%s=%s", sep, tags[i]->name, tags[i]->value);
+	memcpy(&buf->mem[buf->len], src, len);
+	buf->len += len;
+	buf->mem[buf->len] = '\0';
 
-		if (tagstr == NULL)
-			break;
-	}
+	return 0;
+}
 
-	for (int i=0; fields[i]; i++)
-	{
-		char *sep = (*fieldstr == '\0') ? "" : ",";
 
-		if (!*(fields[i]->name))
-			continue;
+/*
+ * append "src", escaping every character in "special" with a backslash.
+ * in the common case there's nothing to escape, which costs one scan.
+ */
+static int put_escaped (struct influx_buffer *buf, const char *src, const char *special)
+{
+	size_t len  = strlen(src);
+	size_t span = strcspn(src, special);
 
-		fieldstr = fstringa(fieldstr, "%s%s=%f", sep, fields[i]->name, fields[i]->value);
+	if (span == len)
+		return put_raw(buf, src, len);
 
-		if (fieldstr == NULL)
-			break;
+	/* worst case: every character needs escaping */
+	if (buf->fail || influx_buffer_reserve(buf, 2U * len))
+	{
+		buf->fail = 1;
+		return -1;
 	}
 
-	if (tagstr && fieldstr)
-		retval = fstring("%s,%s %s %s", measurement, tagstr, fieldstr, timestamp);
-	else
+	for (const char *c = src; *c; c++)
 	{
-		errno = ENOMEM;
-		retval = NULL;
+		if (strchr(special, *c))
+			buf->mem[buf->len++] = '\\';
+
+		buf->mem[buf->len++] = *c;
 	}
 
-	free(tagstr);
-	free(fieldstr);
-	free(timestamp);
+	buf->mem[buf->len] = '\0';
 
-	return retval;
+	return 0;
 }
 
 
 /*
- * the curl library will use a callback function
- * to let this application handle the response data.
- *
- * this is the structure used by the callback
- * implementation below.
+ * fmt_u64:
+ *   write the decimal representation of "v" to "dst" (at least 20 bytes),
+ *   two digits at a time. returns the number of characters written.
  */
-struct mem
+static size_t fmt_u64 (char *dst, uint64_t v)
 {
-	char   *mem;
-	size_t  len;
-};
+	static const char digits[201] = \
+		"00010203040506070809"
+		"10111213141516171819"
+		"20212223242526272829"
+		"30313233343536373839"
+		"40414243444546474849"
+		"50515253545556575859"
+		"60616263646566676869"
+		"70717273747576777879"
+		"80818283848586878889"
+		"90919293949596979899";
+
+	char   tmp[20];
+	size_t pos = sizeof(tmp);
+	size_t len;
+
+	while (v >= 100)
+	{
+		unsigned d = (unsigned) (v % 100U) * 2U;
+
+		v /= 100U;
+		tmp[--pos] = digits[d + 1];
+		tmp[--pos] = digits[d];
+	}
+
+	if (v >= 10)
+	{
+		unsigned d = (unsigned) v * 2U;
+
+		tmp[--pos] = digits[d + 1];
+		tmp[--pos] = digits[d];
+	}
+	else
+		tmp[--pos] = (char) ('0' + v);
+
+	len = sizeof(tmp) - pos;
+	memcpy(dst, &tmp[pos], len);
+
+	return len;
+}
 
 
 /*
- * [POV: libcurl]
- *
- * a curl "write" callback definition, for ingress data.
- * the task: copy retrieved data from "data" to "user".
- *
- * assumption:
- *   'user' is a "struct mem" pointer.
+ * fmt_ufixed:
+ *   write "mag / 10^decimals" in plain decimal notation to "dst" (at least
+ *   32 bytes), without trailing zeros in the fraction. since it's only
+ *   integer arithmetic, the text is exact. returns the number of characters.
  */
-size_t response_callback
-(
-	void   *data,
-	size_t  size,
-	size_t  leng,
-	void   *user
-)
+static size_t fmt_ufixed (char *dst, uint64_t mag, unsigned decimals)
 {
-	char   *ptr;
-	size_t  add_len = (size * leng);
-	struct  mem *restrict mem = user;
+	static const uint64_t pow10[] = \
+	{
+		1U, 10U, 100U, 1000U, 10000U, 100000U, 1000000U, 10000000U,
+		100000000U, 1000000000U, 10000000000U, 100000000000U,
+		1000000000000U, 10000000000000U, 100000000000000U,
+		1000000000000000U, 10000000000000000U, 100000000000000000U,
+		1000000000000000000U
+	};
 
-	/*
-	 * adjust the size of struct mem. according to the curl documentation:
-	 *
-	 *   "This callback function gets called by libcurl as soon as there is
-	 *    data received that needs to be saved.
-	 *   "
-	 * => always resize the "user" buffer.
-	 */
+	size_t   len = 0;
+	uint64_t frac;
 
-	/* if mem->mem is NULL, it behaves like malloc */
-	ptr = realloc(mem->mem, mem->len + add_len + 1U); /* extra null-byte */
+	if (decimals >= sizeof(pow10) / sizeof(*pow10))
+		decimals = sizeof(pow10) / sizeof(*pow10) - 1;
 
-	if (ptr)
+	frac = mag % pow10[decimals];
+	len += fmt_u64(&dst[len], mag / pow10[decimals]);
+
+	if (frac)
 	{
-		/* re-allocation success; copy data */
-		mem->mem = ptr;
-		memcpy(&(mem->mem[mem->len]), data, add_len);
-		mem->len += add_len;
-		mem->mem[mem->len] = '\0'; /* null-terminate */
+		/* drop trailing zeros, then zero-pad from the left */
+		while (frac % 10U == 0)
+		{
+			frac /= 10U;
+			decimals--;
+		}
 
-		return add_len;
+		dst[len++] = '.';
+
+		for (uint64_t p = pow10[decimals - 1]; frac < p; p /= 10U)
+			dst[len++] = '0';
+
+		len += fmt_u64(&dst[len], frac);
 	}
-	else
+
+	return len;
+}
+
+
+/*
+ * fmt_fixed:
+ *   like "fmt_ufixed", for the signed "mant".
+ */
+static size_t fmt_fixed (char *dst, int64_t mant, unsigned decimals)
+{
+	if (mant < 0)
 	{
-		/*
-		 * re-allocation failure; leave mem->mem intact,
-		 * for the higher-level user to free
-		 */
-		errno = ENOMEM;
-		return 0U;
+		dst[0] = '-';
+		return 1U + fmt_ufixed(&dst[1], (uint64_t) 0 - (uint64_t) mant, decimals);
 	}
+
+	return fmt_ufixed(dst, (uint64_t) mant, decimals);
 }
 
 
 /*
- * [POV: libcurl]
- *
- * a curl "read" callback definition, for egress data.
- * the task: copy user data from "user" to "dest".
+ * fmt_double:
+ *   write the shortest decimal text that parses back to exactly "v" to
+ *   "dst" (at least 32 bytes). returns the number of characters, or 0 if
+ *   "v" is not finite, since line protocol has no representation for it.
  *
- * assumption:
- *   "user" is a "struct mem" pointer, that has been
- *  set up with the data to write.
+ *   practically all values we see are integers divided by a power of ten,
+ *   so first look for the smallest "k" where round(v * 10^k) / 10^k == v.
+ *   both the integer and 10^k are exact below 2^53, and IEEE division is
+ *   correctly rounded, so the decimal text of that quotient round-trips.
+ *   anything else falls back to printf with increasing precision, which
+ *   is slow, but still gives the shortest text that round-trips.
  */
-size_t request_callback
-(
-	void   *dest,
-	size_t  size, /* of chunk    */
-	size_t  leng, /* # of chunks */
-	void   *user
-)
+static size_t fmt_double (char *dst, double v)
 {
-	struct mem *restrict upload = user;
-	size_t max = (size * leng);
+	static const double pow10[] = \
+	{
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9
+	};
 
-	if (max < 1)
+	if (!isfinite(v))
 		return 0;
 
-	if (upload->len)
+	for (unsigned k=0; k < sizeof(pow10) / sizeof(*pow10); k++)
 	{
-		/* there's data left */
-		size_t copylen = max;
+		double  s = v * pow10[k];
+		int64_t m;
 
-		if (copylen > upload->len)
-			copylen = upload->len;
+		if (s >= 9007199254740992.0 || s <= -9007199254740992.0)
+			break;
+
+		m = (int64_t) (s < 0 ? s - 0.5 : s + 0.5);
 
-		memcpy(dest, upload->mem, copylen);
+		if ((double) m / pow10[k] == v)
+			return fmt_fixed(dst, m, k);
+	}
 
-		upload->mem += copylen;
-		upload->len -= copylen;
+	for (int prec = 1; prec <= 17; prec++)
+	{
+		int len = snprintf(dst, 32, "%.*g", prec, v);
 
-		return copylen;
+		if (len > 0 && (prec == 17 || strtod(dst, NULL) == v))
+			return (size_t) len;
 	}
 
 	return 0;
 }
 
 
-/* catch errors and clean up if append fails. not much better than that. */
-static struct curl_slist *slist_append(struct curl_slist *s, const char *h)
+/*
+ * influx_line_begin:
+ *   start a new line with measurement name "measurement" in "buf".
+ */
+int influx_line_begin (struct influx_buffer *buf, const char *measurement)
 {
-	struct curl_slist *tmp;
-
-	tmp = curl_slist_append(s, h);
+	buf->start  = buf->len;
+	buf->fields = 0;
+	buf->fail   = 0;
 
-	if (!tmp)
+	if (!measurement || !*measurement)
 	{
-		curl_slist_free_all(s);
-		return NULL;
+		buf->fail = 1;
+		errno = EINVAL;
+		return -1;
 	}
 
-	/*
-	 * yes, if one call fails the list will be rebuilt from that point
-	 * on in the chained calls. is stupid? yes. unlikely to matter, ever,
-	 * unless you do embedded stuff. then you should do something smarter.
-	 *
-	 * see usage below to clearly see the issue.
-	 */
-	return tmp;
+	return put_escaped(buf, measurement, ", ");
 }
 
 
 /*
- * influx_http_post:
- *   send a POST request with "lines" to the InfluxDB API.
- *   "headers" should be a CURL struct slist with additional HTTP headers.
- *   if no errors occur and no HTTP errors are returned, the "response" pointer
- *   will be set to the response body (heap allocated).
- *   local system errors will be returned as -1.
- *   HTTP API errors (4xx and 5xx) will be returned as positive integers.
+ * influx_line_begin_key:
+ *   same as influx_line_begin, but with an interned (pre-escaped) name.
  */
-static int influx_http_post
-(
-	struct influx_writer     *ctx,
-	const char               *lines,
-	const struct curl_slist  *headers,
-	char                    **response
-)
+int influx_line_begin_key (struct influx_buffer *buf, const struct influx_key *measurement)
 {
-	int retval = -1;
+	buf->start  = buf->len;
+	buf->fields = 0;
+	buf->fail   = 0;
 
-	struct mem resp = \
+	if (!measurement || !measurement->len)
 	{
-		.len = 0,
-		.mem = NULL
-	};
+		buf->fail = 1;
+		errno = EINVAL;
+		return -1;
+	}
 
-	sigset_t old_sigset;
-	sigset_t all_sigset;
+	return put_raw(buf, measurement->str, measurement->len);
+}
+
+
+/*
+ * influx_line_tag:
+ *   add a tag to the line being encoded. must come before any field.
+ *   tags with an empty name or value are skipped, as InfluxDB rejects them.
+ */
+int influx_line_tag (struct influx_buffer *buf, const char *name, const char *value)
+{
+	if (!name || !value || !*name || !*value)
+		return 0;
 
-	struct mem req = \
+	if (buf->fields)
 	{
-		.len = strlen(lines),
-		.mem = DISCARD_QUALIFIER(lines)
-	};
+		buf->fail = 1;
+		errno = EINVAL;
+		return -1;
+	}
 
-	if (!ctx || !lines)
+	put_raw(buf, ",", 1);
+	put_escaped(buf, name, ",= ");
+	put_raw(buf, "=", 1);
+
+	return put_escaped(buf, value, ",= ");
+}
+
+
+/*
+ * influx_line_tagset:
+ *   add a complete, pre-rendered tag set (see influx_names_tagset) to
+ *   the line being encoded. must come before any field.
+ */
+int influx_line_tagset (struct influx_buffer *buf, const struct influx_key *tagset)
+{
+	if (!tagset || !tagset->len)
+		return 0;
+
+	if (buf->fields)
 	{
+		buf->fail = 1;
 		errno = EINVAL;
-		return retval;
+		return -1;
 	}
 
-	/*
-	 * save the current sigmask, to be restored later,
-	 * and temporarily block all signals
-	 */
-	sigfillset(&all_sigset);
-	sigprocmask(SIG_BLOCK, &all_sigset, &old_sigset);
+	return put_raw(buf, tagset->str, tagset->len);
+}
 
-	if (ctx->curl)
+
+/*
+ * fmt_value:
+ *   write the line protocol text of a field value to "dst" (at least 32
+ *   bytes). returns the number of characters, or 0 if it can't be written.
+ */
+static size_t fmt_value (char *dst, const struct field *f)
+{
+	size_t len;
+
+	switch (f->type)
 	{
-		CURLcode rc;
+	case INFLUX_FLOAT:
+		return fmt_double(dst, f->value.f);
 
-		/*
-		 * curl options are sticky, but since the same set
-		 * of values are installed every time, there's no
-		 * real danger in not calling curl_easy_reset() in
-		 * this context.
-		 */
+	case INFLUX_INTEGER:
+		len = fmt_fixed(dst, f->value.i, 0);
+		dst[len++] = 'i';
+		return len;
 
-		#define SETOPT_TRY(SETOPT)  rc=(SETOPT);if(rc!=CURLE_OK) break
+	case INFLUX_UNSIGNED:
+		len = fmt_u64(dst, f->value.u);
+		dst[len++] = 'u';
+		return len;
 
+	case INFLUX_FIXED:
+		return fmt_fixed(dst, f->value.i, f->decimals);
 
+	case INFLUX_UFIXED:
+		return fmt_ufixed(dst, f->value.u, f->decimals);
+
+	default:
+		return 0;
+	}
+}
+
+
+/*
+ * influx_line_field_typed:
+ *   add the field "f" to the line being encoded, according to its type.
+ *   if "f->namelen" is set, the name is taken as already escaped.
+ */
+int influx_line_field_typed (struct influx_buffer *buf, const struct field *f)
+{
+	char   tmp[32];
+	size_t len;
+
+	if (!f->name || !*f->name)
+		return 0;
+
+	if (f->type >= INFLUX_TYPE_END)
+	{
+		buf->fail = 1;
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* NaN and infinities can't be written, leave the field out */
+	if ((len = fmt_value(tmp, f)) == 0)
+		return 0;
+
+	if (f->namelen)
+	{
+		/* pre-escaped: one reservation, plain copies */
+		if (buf->fail || influx_buffer_reserve(buf, f->namelen + len + 2U))
+		{
+			buf->fail = 1;
+			return -1;
+		}
+
+		buf->mem[buf->len++] = buf->fields++ ? ',' : ' ';
+		memcpy(&buf->mem[buf->len], f->name, f->namelen);
+		buf->len += f->namelen;
+		buf->mem[buf->len++] = '=';
+		memcpy(&buf->mem[buf->len], tmp, len);
+		buf->len += len;
+		buf->mem[buf->len] = '\0';
+
+		return 0;
+	}
+
+	put_raw(buf, buf->fields++ ? "," : " ", 1);
+	put_escaped(buf, f->name, ",= ");
+	put_raw(buf, "=", 1);
+
+	return put_raw(buf, tmp, len);
+}
+
+
+/*
+ * influx_line_field:
+ *   add a float field to the line being encoded, in the shortest decimal
+ *   form that reads back as "value". NaN and infinities are skipped.
+ */
+int influx_line_field (struct influx_buffer *buf, const char *name, double value)
+{
+	const struct field f = { .name = name, .type = INFLUX_FLOAT, .value.f = value };
+
+	return influx_line_field_typed(buf, &f);
+}
+
+
+/*
+ * influx_line_field_int:
+ *   add a signed integer field to the line being encoded.
+ */
+int influx_line_field_int (struct influx_buffer *buf, const char *name, int64_t value)
+{
+	const struct field f = { .name = name, .type = INFLUX_INTEGER, .value.i = value };
+
+	return influx_line_field_typed(buf, &f);
+}
+
+
+/*
+ * influx_line_field_uint:
+ *   add an unsigned integer field to the line being encoded.
+ */
+int influx_line_field_uint (struct influx_buffer *buf, const char *name, uint64_t value)
+{
+	const struct field f = { .name = name, .type = INFLUX_UNSIGNED, .value.u = value };
+
+	return influx_line_field_typed(buf, &f);
+}
+
+
+/*
+ * influx_line_field_fixed:
+ *   add a float field with the exact value "mant / 10^decimals" to the
+ *   line being encoded. trailing zeros in the fraction are left out.
+ */
+int influx_line_field_fixed (struct influx_buffer *buf, const char *name, int64_t mant, unsigned decimals)
+{
+	const struct field f = \
+	{
+		.name     = name,
+		.type     = INFLUX_FIXED,
+		.decimals = decimals,
+		.value.i  = mant
+	};
+
+	return influx_line_field_typed(buf, &f);
+}
+
+
+/*
+ * influx_line_fields:
+ *   add "num" consecutive fields from "f" to the line being encoded.
+ */
+int influx_line_fields (struct influx_buffer *buf, const struct field *f, size_t num)
+{
+	for (size_t i=0; i < num; i++)
+		influx_line_field_typed(buf, &f[i]);
+
+	return buf->fail ? -1 : 0;
+}
+
+
+/*
+ * influx_line_end:
+ *   terminate the line being encoded with a timestamp and a newline.
+ *   "ts" is a CLOCK_REALTIME timestamp, or NULL to use the current time.
+ *   if anything went wrong while encoding the line, or if it doesn't have
+ *   a single field, the whole line is removed from "buf" and -1 returned.
+ */
+int influx_line_end (struct influx_buffer *buf, const struct timespec *ts, enum influx_precision prec)
+{
+	static const uint32_t divisors[INFLUX_PRECISION_END] = \
+	{
+		1000000000U,
+		1000000U,
+		1000U,
+		1U
+	};
+
+	struct timespec now;
+
+	char     tmp[32];
+	size_t   len = 0;
+	uint64_t stamp;
+
+	if (ts == NULL)
+	{
+		if (clock_gettime(CLOCK_REALTIME, &now))
+			buf->fail = 1;
+
+		ts = &now;
+	}
+
+	if (!buf->fail && buf->fields == 0)
+	{
+		buf->fail = 1;
+		errno = EINVAL;
+	}
+
+	if (!buf->fail)
+	{
+		stamp = (uint64_t) ts->tv_sec * (1000000000U / divisors[prec])
+		      + (uint64_t) ts->tv_nsec / divisors[prec];
+
+		tmp[len++] = ' ';
+		len += fmt_u64(&tmp[len], stamp);
+		tmp[len++] = '\n';
+
+		put_raw(buf, tmp, len);
+	}
+
+	if (buf->fail)
+	{
+		/* roll back to before influx_line_begin */
+		buf->len  = buf->start;
+		buf->fail = 0;
+
+		if (buf->mem)
+			buf->mem[buf->len] = '\0';
+
+		return -1;
+	}
+
+	buf->lines++;
+	buf->start = buf->len;
+
+	return 0;
+}
+
+
+/*
+ * influx_template_init:
+ *   render the constant parts of a line into "tpl": the measurement, the
+ *   tag set (either may come from influx_names) and the keys of "num"
+ *   fields. values in "fields" are ignored. free with influx_template_free.
+ *   returns -1 on invalid arguments or memory allocation errors.
+ */
+int influx_template_init
+(
+	struct influx_template   *tpl,
+	const struct influx_key  *measurement,
+	const struct influx_key  *tagset,
+	const struct field       *fields,
+	size_t                    num
+)
+{
+	struct influx_buffer text = { 0 };
+
+	memset(tpl, 0, sizeof(struct influx_template));
+
+	if (!measurement || !measurement->len || !fields || !num)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((tpl->keys = calloc(num + 1, sizeof(size_t))) == NULL)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+
+	put_raw(&text, measurement->str, measurement->len);
+
+	if (tagset)
+		put_raw(&text, tagset->str, tagset->len);
+
+	tpl->prefix = text.len;
+
+	for (size_t i=0; i < num; i++)
+	{
+		tpl->keys[i] = text.len;
+
+		if (fields[i].namelen)
+			put_raw(&text, fields[i].name, fields[i].namelen);
+		else
+			put_escaped(&text, fields[i].name, ",= ");
+
+		put_raw(&text, "=", 1);
+	}
+
+	tpl->keys[num] = text.len;
+	tpl->nfields   = num;
+	tpl->text      = text.mem;
+
+	if (text.fail)
+	{
+		influx_template_free(tpl);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * influx_template_free:
+ *   deallocate the memory held by "tpl".
+ */
+void influx_template_free (struct influx_template *tpl)
+{
+	free(tpl->text);
+	free(tpl->keys);
+	memset(tpl, 0, sizeof(struct influx_template));
+}
+
+
+/*
+ * influx_template_render:
+ *   append a complete line to "buf", using the text of "tpl" and the
+ *   values of "fields", which must be laid out as when "tpl" was made.
+ *   "ts" and "prec" are as for influx_line_end. fields of type
+ *   INFLUX_TYPE_END are left out, key and all.
+ *   returns -1 if the line could not be written, leaving "buf" as it was.
+ */
+int influx_template_render
+(
+	struct influx_buffer         *buf,
+	const struct influx_template *tpl,
+	const struct field           *fields,
+	const struct timespec        *ts,
+	enum influx_precision         prec
+)
+{
+	char *out;
+
+	buf->start  = buf->len;
+	buf->fields = 0;
+	buf->fail   = 0;
+
+	/*
+	 * one reservation covers the whole line: the template text,
+	 * a separator and at most 32 characters per value, and the
+	 * timestamp (done by influx_line_end).
+	 */
+	if (influx_buffer_reserve(buf, tpl->keys[tpl->nfields] + 33U * tpl->nfields + 32U))
+		return -1;
+
+	out = &buf->mem[buf->len];
+
+	memcpy(out, tpl->text, tpl->prefix);
+	out += tpl->prefix;
+
+	for (size_t i=0; i < tpl->nfields; i++)
+	{
+		size_t klen = tpl->keys[i + 1] - tpl->keys[i];
+		size_t vlen;
+		char   val[32];
+
+		/* values that can't be written are left out, key and all */
+		if ((vlen = fmt_value(val, &fields[i])) == 0)
+			continue;
+
+		*out++ = buf->fields++ ? ',' : ' ';
+
+		memcpy(out, &tpl->text[tpl->keys[i]], klen);
+		out += klen;
+
+		memcpy(out, val, vlen);
+		out += vlen;
+	}
+
+	buf->len = (size_t) (out - buf->mem);
+	buf->mem[buf->len] = '\0';
+
+	return influx_line_end(buf, ts, prec);
+}
+
+
+/*
+ * influx_writer_line:
+ *   constructs a line protocol line from a set of tags and fields.
+ *     "measurement" is a name for this measurement.
+ *     "tags"        is a NULL-terminated list of "struct tags".
+ *     "fields"      is a NULL-terminated list of "struct fields", of any type.
+ *     "prec"        is the precision for the automatically generated timestamp.
+ */
+char *influx_writer_line
+(
+	const char *measurement,
+	const struct tag   *tags[],
+	const struct field *fields[],
+	enum influx_precision prec
+)
+{
+	struct influx_buffer buf = { 0 };
+
+	if (!tags || !fields || !measurement)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	influx_line_begin(&buf, measurement);
+
+	for (int i=0; tags[i]; i++)
+		influx_line_tag(&buf, tags[i]->name, tags[i]->value);
+
+	for (int i=0; fields[i]; i++)
+		influx_line_field_typed(&buf, fields[i]);
+
+	if (influx_line_end(&buf, NULL, prec))
+	{
+		influx_buffer_free(&buf);
+		return NULL;
+	}
+
+	/* strip the newline */
+	buf.mem[--buf.len] = '\0';
+
+	return buf.mem;
+}
+
+
+/*
+ * [POV: libcurl]
+ *
+ * a curl "write" callback definition, for ingress data.
+ * the task: copy retrieved data from "data" to "user".
+ *
+ * assumption:
+ *   'user' is a "struct mem" pointer.
+ */
+size_t response_callback
+(
+	void   *data,
+	size_t  size,
+	size_t  leng,
+	void   *user
+)
+{
+	char   *ptr;
+	size_t  add_len = (size * leng);
+	struct  mem *restrict mem = user;
+
+	/*
+	 * adjust the size of struct mem. according to the curl documentation:
+	 *
+	 *   "This callback function gets called by libcurl as soon as there is
+	 *    data received that needs to be saved.
+	 *   "
+	 * => always resize the "user" buffer.
+	 */
+
+	/* if mem->mem is NULL, it behaves like malloc */
+	ptr = realloc(mem->mem, mem->len + add_len + 1U); /* extra null-byte */
+
+	if (ptr)
+	{
+		/* re-allocation success; copy data */
+		mem->mem = ptr;
+		memcpy(&(mem->mem[mem->len]), data, add_len);
+		mem->len += add_len;
+		mem->mem[mem->len] = '\0'; /* null-terminate */
+
+		return add_len;
+	}
+	else
+	{
 		/*
-		 * Sure, we could use non-local jumps to handle this in a more appealing
-		 * fashion, but the overhead of the setjmp API would just slow this down
-		 * more than what can be justified.
+		 * re-allocation failure; leave mem->mem intact,
+		 * for the higher-level user to free
 		 */
-		do
+		errno = ENOMEM;
+		return 0U;
+	}
+}
+
+
+/* catch errors and clean up if append fails. not much better than that. */
+static struct curl_slist *slist_append(struct curl_slist *s, const char *h)
+{
+	struct curl_slist *tmp;
+
+	tmp = curl_slist_append(s, h);
+
+	if (!tmp)
+	{
+		curl_slist_free_all(s);
+		return NULL;
+	}
+
+	/*
+	 * yes, if one call fails the list will be rebuilt from that point
+	 * on in the chained calls. is stupid? yes. unlikely to matter, ever,
+	 * unless you do embedded stuff. then you should do something smarter.
+	 *
+	 * see usage below to clearly see the issue.
+	 */
+	return tmp;
+}
+
+
+/*
+ * influx_writer_headers:
+ *   build the HTTP header list for "token" (may be NULL) and "gzip", and
+ *   install it in the curl handle of "ctx". the previous list is free'd.
+ *   returns -1 on errors, leaving the previous headers in place.
+ */
+static int influx_writer_headers (struct influx_writer *ctx, const char *token, int gzip)
+{
+	CURLcode rc;
+
+	char
+		*authorization;
+
+	struct curl_slist *headers = NULL;
+
+	headers = slist_append(headers, "Accept: application/json");
+	headers = slist_append(headers, "Content-Type: text/plain; charset=utf-8");
+
+	/* the body is always sent in one go, no need to wait for 100-continue */
+	headers = slist_append(headers, "Expect:");
+
+	if (gzip)
+		headers = slist_append(headers, "Content-Encoding: gzip");
+
+	if (token)
+	{
+		authorization = fstring("Authorization: Token %s", token);
+
+		if (authorization == NULL)
+		{
+			curl_slist_free_all(headers);
+			return -1;
+		}
+
+		headers = slist_append(headers, authorization);
+		free(authorization);
+	}
+
+	if (headers == NULL)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if ((rc = curl_easy_setopt(ctx->curl, CURLOPT_HTTPHEADER, headers)) != CURLE_OK)
+	{
+		fprintf(stderr, "curl_easy_setopt(): %s\n", curl_easy_strerror(rc));
+		curl_slist_free_all(headers);
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (size_t i=0; i < ctx->ntransfers; i++)
+		curl_easy_setopt(ctx->transfers[i].curl, CURLOPT_HTTPHEADER, headers);
+
+	if (ctx->inflight && ctx->headers)
+	{
+		/* writes in flight may still use the old list; free it once they are done */
+		struct curl_slist *last = ctx->headers;
+
+		while (last->next)
+			last = last->next;
+
+		last->next   = ctx->retired;
+		ctx->retired = ctx->headers;
+	}
+	else
+		curl_slist_free_all(ctx->headers);
+
+	ctx->headers = headers;
+
+	return 0;
+}
+
+
+/*
+ * influx_writer_reload_token:
+ *   rebuild the HTTP headers of "ctx" with a new Authorization token.
+ *   if "token" is NULL, it is re-read from the environment variable
+ *   "INFLUXDB_TOKEN", and no Authorization header is sent if it is unset.
+ *   returns -1 on errors, leaving the previous headers in place.
+ */
+int influx_writer_reload_token (struct influx_writer *ctx, const char *token)
+{
+	char *copy = NULL;
+
+	if (!ctx || !ctx->curl)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!token)
+		token = getenv("INFLUXDB_TOKEN");
+
+	if (token && (copy = strdup(token)) == NULL)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (influx_writer_headers(ctx, copy, ctx->gzip))
+	{
+		free(copy);
+		return -1;
+	}
+
+	free(ctx->token);
+	ctx->token = copy;
+
+	return 0;
+}
+
+
+/*
+ * influx_writer_set_gzip:
+ *   compress request bodies with gzip at deflate level "level" (1-9, or -1
+ *   for the zlib default), and send them with "Content-Encoding: gzip".
+ *   level 0 turns compression off. returns -1 on errors.
+ */
+int influx_writer_set_gzip (struct influx_writer *ctx, int level)
+{
+	z_stream *z;
+
+	if (!ctx || !ctx->curl || level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (level == Z_NO_COMPRESSION)
+	{
+		if (ctx->gzip && influx_writer_headers(ctx, ctx->token, 0))
+			return -1;
+
+		if (ctx->zstream)
+			deflateEnd(ctx->zstream);
+
+		free(ctx->zstream);
+		influx_buffer_free(&ctx->zbuf);
+
+		ctx->zstream = NULL;
+		ctx->gzip    = 0;
+
+		return 0;
+	}
+
+	if ((z = ctx->zstream) == NULL)
+	{
+		if ((z = calloc(1, sizeof(z_stream))) == NULL)
+		{
+			errno = ENOMEM;
+			return -1;
+		}
+
+		/* 15 + 16: largest window, with a gzip header and trailer */
+		if (deflateInit2(z, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			free(z);
+			errno = ENOMEM;
+			return -1;
+		}
+
+		ctx->zstream = z;
+	}
+	else if (deflateReset(z) != Z_OK || deflateParams(z, level, Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!ctx->gzip && influx_writer_headers(ctx, ctx->token, 1))
+		return -1;
+
+	ctx->gzip = level;
+
+	return 0;
+}
+
+
+/*
+ * influx_deflate:
+ *   compress "len" bytes of "lines" into a single gzip member in "out".
+ *   the stream and the buffer are reused, so once the buffer has grown to
+ *   fit the largest body, compression does not allocate.
+ *   returns -1 on errors.
+ */
+static int influx_deflate (struct influx_writer *ctx, struct influx_buffer *out, const char *lines, size_t len)
+{
+	z_stream             *z    = ctx->zstream;
+	size_t                left = len;
+	size_t                room;
+	int                   rc;
+
+	if (deflateReset(z) != Z_OK)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	out->len    = 0;
+	z->next_in  = (Bytef *) DISCARD_QUALIFIER(lines);
+	z->avail_in = 0;
+
+	do
+	{
+		/* zlib counts in uInt; larger bodies are fed in pieces */
+		if (z->avail_in == 0)
+		{
+			z->avail_in = (left > UINT_MAX) ? UINT_MAX : (uInt) left;
+			left       -= z->avail_in;
+		}
+
+		/* the bound makes this a single pass for anything but huge bodies */
+		if (influx_buffer_reserve(out, (size_t) deflateBound(z, (uLong) z->avail_in + left)))
+			return -1;
+
+		room = out->cap - out->len - 1U;
+
+		z->next_out  = (Bytef *) &out->mem[out->len];
+		z->avail_out = (room > UINT_MAX) ? UINT_MAX : (uInt) room;
+
+		rc = deflate(z, left ? Z_NO_FLUSH : Z_FINISH);
+
+		out->len = (size_t) ((char *) z->next_out - out->mem);
+	}
+	while (rc == Z_OK);
+
+	if (rc != Z_STREAM_END)
+	{
+		fprintf(stderr, "deflate(): %s\n", z->msg ? z->msg : "error");
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * influx_writer_setup:
+ *   install the headers and every request option that stays the same from
+ *   one write to the next. curl options are sticky, so after this, a request
+ *   only needs to bind its body.
+ */
+static int influx_writer_setup (struct influx_writer *ctx)
+{
+	CURLcode rc;
+
+	if ((ctx->response = calloc(1, sizeof(struct mem))) == NULL)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (influx_writer_reload_token(ctx, NULL))
+		return -1;
+
+	#define SETOPT_TRY(SETOPT)  rc=(SETOPT);if(rc!=CURLE_OK) break
+
+	do
+	{
+		SETOPT_TRY( curl_easy_setopt(ctx->curl,CURLOPT_CURLU,ctx->curlurl)                    );
+		SETOPT_TRY( curl_easy_setopt(ctx->curl,CURLOPT_USERAGENT,"libcurl/" LIBCURL_VERSION)  );
+		SETOPT_TRY( curl_easy_setopt(ctx->curl,CURLOPT_NOPROGRESS,1L)                         );
+		SETOPT_TRY( curl_easy_setopt(ctx->curl,CURLOPT_NOSIGNAL,1L)                           );
+		SETOPT_TRY( curl_easy_setopt(ctx->curl,CURLOPT_SSL_VERIFYPEER,1L)                     );
+		SETOPT_TRY( curl_easy_setopt(ctx->curl,CURLOPT_SSL_VERIFYHOST,1L)                     );
+		SETOPT_TRY( curl_easy_setopt(ctx->curl,CURLOPT_IPRESOLVE,CURL_IPRESOLVE_WHATEVER)     );
+		SETOPT_TRY( curl_easy_setopt(ctx->curl,CURLOPT_WRITEFUNCTION,response_callback)       );
+		SETOPT_TRY( curl_easy_setopt(ctx->curl,CURLOPT_WRITEDATA,ctx->response)               );
+		SETOPT_TRY( curl_easy_setopt(ctx->curl,CURLOPT_VERBOSE,(long)zDEBUG)                  );
+		SETOPT_TRY( curl_easy_setopt(ctx->curl,CURLOPT_POST,1L)                               );
+		SETOPT_TRY( curl_easy_setopt(ctx->curl,CURLOPT_ACCEPT_ENCODING,"gzip")                );
+		SETOPT_TRY( curl_easy_setopt(ctx->curl,CURLOPT_FAILONERROR,1L)                        );
+		SETOPT_TRY( curl_easy_setopt(ctx->curl,CURLOPT_TIMEOUT_MS,INFLUX_WRITE_TIMEOUT_MS)    );
+	}
+	while(0);
+
+	#undef SETOPT_TRY
+
+	if (rc != CURLE_OK)
+	{
+		fprintf(stderr, "curl_easy_setopt(): %s\n", curl_easy_strerror(rc));
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * measure:
+ *   keep the duration and body size of the request that "curl" just did.
+ */
+static void measure (struct influx_writer *ctx, void *curl)
+{
+	curl_off_t us    = 0;
+	curl_off_t bytes = 0;
+
+	curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T,  &us);
+	curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &bytes);
+
+	ctx->last_us    = (uint64_t) us;
+	ctx->last_bytes = (uint64_t) bytes;
+}
+
+
+/*
+ * influx_http_post:
+ *   send a POST request with "len" bytes of "lines" to the InfluxDB API.
+ *   the data is sent straight from "lines" (or its compressed copy), which
+ *   must stay intact until the request completes.
+ *   if no errors occur and no HTTP errors are returned, the "response" pointer
+ *   will be set to the response body (heap allocated).
+ *   local system errors will be returned as -1.
+ *   HTTP API errors (4xx and 5xx) will be returned as positive integers.
+ */
+static int influx_http_post
+(
+	struct influx_writer  *ctx,
+	const char            *lines,
+	size_t                 len,
+	char                 **response
+)
+{
+	int retval = -1;
+
+	struct mem *resp;
+
+	sigset_t old_sigset;
+	sigset_t all_sigset;
+
+	if (!ctx || !lines)
+	{
+		errno = EINVAL;
+		return retval;
+	}
+
+	if (!ctx->curl || !ctx->response)
+	{
+		fprintf(stderr, "%s(): %s\n", __func__, "libcurl not initialized");
+		return retval;
+	}
+
+	resp = ctx->response;
+
+	/* for a request that never went out */
+	ctx->last_us    = 0;
+	ctx->last_bytes = 0;
+
+	/*
+	 * save the current sigmask, to be restored later,
+	 * and temporarily block all signals
+	 */
+	sigfillset(&all_sigset);
+	pthread_sigmask(SIG_BLOCK, &all_sigset, &old_sigset);
+
+	do
+	{
+		CURLcode rc;
+
+		if (ctx->gzip)
+		{
+			if (influx_deflate(ctx, &ctx->zbuf, lines, len))
+				break;
+
+			lines = ctx->zbuf.mem;
+			len   = ctx->zbuf.len;
+		}
+
+		/* everything else was set up by influx_writer_setup */
+		if ((rc = curl_easy_setopt(ctx->curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t) len)) != CURLE_OK
+		||  (rc = curl_easy_setopt(ctx->curl, CURLOPT_POSTFIELDS, lines))                     != CURLE_OK
+		){
+			fprintf(stderr, "curl_easy_setopt(): %s\n", curl_easy_strerror(rc));
+			break;
+		}
+
+		resp->mem = NULL;
+		resp->len = 0;
+
+		rc = curl_easy_perform(ctx->curl);
+
+		measure(ctx, ctx->curl);
+
+		switch (rc)
 		{
-			SETOPT_TRY( curl_easy_setopt(ctx->curl,CURLOPT_CURLU,ctx->curlurl)                    );
-			SETOPT_TRY( curl_easy_setopt(ctx->curl,CURLOPT_USERAGENT,"libcurl/" LIBCURL_VERSION)  );
-			SETOPT_TRY( curl_easy_setopt(ctx->curl,CURLOPT_NOPROGRESS,1L)                         );
-			SETOPT_TRY( curl_easy_setopt(ctx->curl,CURLOPT_NOSIGNAL,1L)                           );
-			SETOPT_TRY( curl_easy_setopt(ctx->curl,CURLOPT_SSL_VERIFYPEER,1L)                     );
-			SETOPT_TRY( curl_easy_setopt(ctx->curl,CURLOPT_SSL_VERIFYHOST,1L)                     );
-			SETOPT_TRY( curl_easy_setopt(ctx->curl,CURLOPT_IPRESOLVE,CURL_IPRESOLVE_WHATEVER)     );
-			SETOPT_TRY( curl_easy_setopt(ctx->curl,CURLOPT_WRITEFUNCTION,response_callback)       );
-			SETOPT_TRY( curl_easy_setopt(ctx->curl,CURLOPT_WRITEDATA,&resp)                       );
-			SETOPT_TRY( curl_easy_setopt(ctx->curl,CURLOPT_VERBOSE,(long)zDEBUG)                  );
-			SETOPT_TRY( curl_easy_setopt(ctx->curl,CURLOPT_READFUNCTION,request_callback)         );
-			SETOPT_TRY( curl_easy_setopt(ctx->curl,CURLOPT_READDATA,&req)                         );
-			SETOPT_TRY( curl_easy_setopt(ctx->curl,CURLOPT_POST,1L)                               );
-			SETOPT_TRY( curl_easy_setopt(ctx->curl,CURLOPT_ACCEPT_ENCODING,"gzip")                );
-			SETOPT_TRY( curl_easy_setopt(ctx->curl,CURLOPT_FAILONERROR,1L)                        );
-			if (headers)
+		case CURLE_OK:
+			if (resp->mem)
+				if (response)
+				{
+					*response = resp->mem;
+					resp->mem = NULL;
+				}
+			retval = 0;
+			break;
+
+		case CURLE_HTTP_RETURNED_ERROR:
 			{
-			SETOPT_TRY( curl_easy_setopt(ctx->curl,CURLOPT_HTTPHEADER,DISCARD_QUALIFIER(headers)) );
+				long http_status = -1;
+				curl_easy_getinfo(ctx->curl, CURLINFO_RESPONSE_CODE, &http_status);
+				retval = (int) http_status;
 			}
+			break;
+
+		default:
+			fprintf(stderr, "curl_easy_perform(): %s\n", curl_easy_strerror(rc));
+			break;
+		}
+
+		free(resp->mem);
+		resp->mem = NULL;
+	}
+	while (0);
+
+	/* restore the signal mask */
+	pthread_sigmask(SIG_SETMASK, &old_sigset, NULL);
+
+	return retval;
+}
+
+
+/*
+ * influx_writer_write:
+ *   write a list of line protocol lines to InfluxDB.
+ *   if API returns HTTP (2|3)xx, this function returns 0 and "response"
+ *   is set to point to a response body ONLY when the server sent one.
+ *
+ *   HTTP API error codes (4|5)xx will be returned as positive integers.
+ *   internal library and system errors will be returned as -1.
+ *
+ *   the response body is formatted as json, if one is received.
+ */
+int influx_writer_write (struct influx_writer *ctx, const char *lines[], char **response)
+{
+	int rc;
+
+	struct influx_buffer data = { 0 };
+
+	for (int i=0; lines[i]; i++)
+	{
+		put_raw(&data, lines[i], strlen(lines[i]));
+		put_raw(&data, "\n", 1);
+	}
+
+	if (data.fail)
+	{
+		influx_buffer_free(&data);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	rc = influx_http_post(ctx, data.mem, data.len, response);
+
+	influx_buffer_free(&data);
+
+	return rc;
+}
+
+
+/*
+ * influx_writer_write_buffer:
+ *   same as influx_writer_write, but posts the lines encoded in "buf".
+ */
+int influx_writer_write_buffer (struct influx_writer *ctx, const struct influx_buffer *buf, char **response)
+{
+	if (!buf || !buf->mem || !buf->len)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	return influx_http_post(ctx, buf->mem, buf->len, response);
+}
+
+
+/*
+ * [POV: libcurl]
+ *
+ * a curl "write" callback for asynchronous writes. the response
+ * body is of no interest there, only the status code is.
+ */
+static size_t discard_callback (void *data, size_t size, size_t leng, void *user)
+{
+	(void) data;
+	(void) user;
+
+	return size * leng;
+}
+
+
+/*
+ * [POV: libcurl]
+ *
+ * a curl multi "socket" callback: keep the epoll set in sync with the
+ * sockets curl wants to be told about. sockets that are already in the
+ * set are marked with curl_multi_assign.
+ */
+static int socket_callback (CURL *easy, curl_socket_t fd, int what, void *user, void *socketp)
+{
+	struct influx_writer *ctx = user;
+
+	struct epoll_event ev = { .data.fd = fd };
+
+	(void) easy;
+
+	if (what == CURL_POLL_REMOVE)
+	{
+		/* may fail if curl has closed it already, which is fine */
+		epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, fd, NULL);
+		curl_multi_assign(ctx->multi, fd, NULL);
+		return 0;
+	}
+
+	if (what & CURL_POLL_IN)  ev.events |= EPOLLIN;
+	if (what & CURL_POLL_OUT) ev.events |= EPOLLOUT;
+
+	if (epoll_ctl(ctx->epfd, socketp ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) == -1)
+	{
+		perror("epoll_ctl");
+		return -1;
+	}
+
+	curl_multi_assign(ctx->multi, fd, ctx);
+
+	return 0;
+}
+
+
+/*
+ * [POV: libcurl]
+ *
+ * a curl multi "timer" callback: arm the timerfd to expire when curl
+ * wants CURL_SOCKET_TIMEOUT to be signalled, or disarm it.
+ */
+static int timer_callback (CURLM *multi, long timeout_ms, void *user)
+{
+	struct influx_writer *ctx = user;
+
+	struct itimerspec its = { 0 };
+
+	(void) multi;
+
+	if (timeout_ms == 0)
+		its.it_value.tv_nsec = 1; /* as soon as possible; 0 would disarm */
+
+	else if (timeout_ms > 0)
+	{
+		its.it_value.tv_sec  = timeout_ms / 1000;
+		its.it_value.tv_nsec = (timeout_ms % 1000) * 1000000L;
+	}
+
+	return timerfd_settime(ctx->tfd, 0, &its, NULL);
+}
+
+
+/*
+ * influx_writer_async:
+ *   allow up to "max" writes to be in flight at the same time, posted with
+ *   influx_writer_post. returns -1 and sets errno on errors, after which
+ *   the writer can only be destroyed.
+ */
+int influx_writer_async (struct influx_writer *ctx, size_t max)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+
+	if (!ctx || !ctx->curl || ctx->multi || !max)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((ctx->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1
+	||  (ctx->tfd  = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1
+	)
+		return -1;
+
+	ev.data.fd = ctx->tfd;
+
+	if (epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, ctx->tfd, &ev) == -1)
+		return -1;
+
+	if ((ctx->multi     = curl_multi_init())                             == NULL
+	||  (ctx->transfers = calloc(max, sizeof(struct influx_transfer))) == NULL
+	){
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* every transfer starts out with the options of the blocking handle */
+	for (; ctx->ntransfers < max; ctx->ntransfers++)
+	{
+		struct influx_transfer *xfer = &ctx->transfers[ctx->ntransfers];
+
+		if ((xfer->curl = curl_easy_duphandle(ctx->curl)) == NULL)
+		{
+			errno = ENOMEM;
+			return -1;
 		}
-		while(0);
 
-		if (rc != CURLE_OK)
-		{
-			/* setopt error code "rc" */
-			fprintf(stderr, "curl_easy_setopt(): %s\n", curl_easy_strerror(rc));
-			retval = -1;
-		}
-		else
-		{
-			/* setopt no error */
-			rc = curl_easy_perform(ctx->curl);
+		curl_easy_setopt(xfer->curl, CURLOPT_WRITEFUNCTION, discard_callback);
+		curl_easy_setopt(xfer->curl, CURLOPT_WRITEDATA,     NULL);
+		curl_easy_setopt(xfer->curl, CURLOPT_PRIVATE,       xfer);
+	}
+
+	curl_multi_setopt(ctx->multi, CURLMOPT_SOCKETFUNCTION, socket_callback);
+	curl_multi_setopt(ctx->multi, CURLMOPT_SOCKETDATA,     ctx);
+	curl_multi_setopt(ctx->multi, CURLMOPT_TIMERFUNCTION,  timer_callback);
+	curl_multi_setopt(ctx->multi, CURLMOPT_TIMERDATA,      ctx);
+
+	return 0;
+}
+
+
+/*
+ * influx_writer_fd:
+ *   a file descriptor that becomes readable when asynchronous writes can
+ *   make progress, for the caller's poll/epoll loop. influx_writer_perform
+ *   should then be called.
+ */
+int influx_writer_fd (const struct influx_writer *ctx)
+{
+	return ctx->epfd;
+}
+
+
+/*
+ * influx_writer_post:
+ *   start posting the lines in "buf" without waiting for the response.
+ *   "buf" must stay intact until "done" is called for it, from within
+ *   influx_writer_perform. returns -1 and sets errno to EAGAIN if "max"
+ *   writes are in flight already, and on other errors.
+ */
+int influx_writer_post (struct influx_writer *ctx, const struct influx_buffer *buf, influx_done_fn *done, void *arg)
+{
+	struct influx_transfer *xfer = NULL;
+
+	const char *body;
+	size_t      len;
+
+	CURLMcode rc;
+
+	if (!ctx || !ctx->multi || !buf || !buf->mem || !buf->len)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (size_t i=0; i < ctx->ntransfers && !xfer; i++)
+		if (ctx->transfers[i].buf == NULL)
+			xfer = &ctx->transfers[i];
+
+	if (xfer == NULL)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+
+	body = buf->mem;
+	len  = buf->len;
 
-			switch (rc)
-			{
-			case CURLE_OK:
-				if (resp.mem)
-					if (response)
-					{
-						*response = resp.mem;
-						resp.mem  = NULL;
-					}
-				retval = 0;
-				break;
+	/* the stream is shared, but compression is over before this returns */
+	if (ctx->gzip)
+	{
+		if (influx_deflate(ctx, &xfer->zbuf, body, len))
+			return -1;
 
-			case CURLE_HTTP_RETURNED_ERROR:
-				{
-					long http_status = -1;
-					curl_easy_getinfo(ctx->curl, CURLINFO_RESPONSE_CODE, &http_status);
-					retval = (int) http_status;
-				}
-				break;
+		body = xfer->zbuf.mem;
+		len  = xfer->zbuf.len;
+	}
 
-			default:
-				fprintf(stderr, "curl_easy_perform(): %s\n", curl_easy_strerror(rc));
-				break;
-			}
+	curl_easy_setopt(xfer->curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t) len);
+	curl_easy_setopt(xfer->curl, CURLOPT_POSTFIELDS,          body);
 
-			free(resp.mem);
-		}
+	if ((rc = curl_multi_add_handle(ctx->multi, xfer->curl)) != CURLM_OK)
+	{
+		fprintf(stderr, "curl_multi_add_handle(): %s\n", curl_multi_strerror(rc));
+		errno = EINVAL;
+		return -1;
+	}
 
-		#undef SETOPT_TRY
+	xfer->buf  = buf;
+	xfer->done = done;
+	xfer->arg  = arg;
 
-	} /* <- if curl_easy handle */
-	else
-		fprintf(stderr, "%s(): %s\n", __func__, "libcurl not initialized");
+	ctx->inflight++;
 
-	/* restore the signal mask */
-	sigprocmask(SIG_SETMASK, &old_sigset, NULL);
+	return 0;
+}
 
-	return retval;
+
+/*
+ * retire:
+ *   take a finished (or aborted) write out of the multi handle, free its
+ *   slot and report "status" to its "done" callback.
+ */
+static void retire (struct influx_writer *ctx, struct influx_transfer *xfer, int status)
+{
+	const struct influx_buffer *buf = xfer->buf;
+
+	int err = errno;
+
+	measure(ctx, xfer->curl);
+
+	curl_multi_remove_handle(ctx->multi, xfer->curl);
+
+	/* free the slot before "done", which may well post again */
+	xfer->buf = NULL;
+
+	ctx->inflight--;
+
+	if (ctx->inflight == 0)
+	{
+		curl_slist_free_all(ctx->retired);
+		ctx->retired = NULL;
+	}
+
+	if (xfer->done)
+	{
+		errno = err;
+		xfer->done(xfer->arg, buf, status);
+	}
 }
 
 
 /*
- * influx_lines_post:
- *   performs an HTTP POST request to the InfluxDB API.
- *   the authorization token is fetched from the environment variable
- *   "INFLUXDB_TOKEN".
- *   "lines" should be line protocol lines, newline-separated.
+ * influx_writer_perform:
+ *   move asynchronous writes along, without blocking, and call "done" for
+ *   those that have finished. returns the number of writes still in flight.
  */
-static int influx_lines_post
-(
-	struct influx_writer  *ctx,
-	const char            *lines,
-	char                 **response
-)
+size_t influx_writer_perform (struct influx_writer *ctx)
 {
-	int ret;
+	struct epoll_event events[16];
 
-	char
-		*authorization;
+	CURLMsg *msg;
 
-	struct curl_slist *headers = NULL;
+	int n;
+	int running;
+	int left;
 
-	headers = slist_append(headers, "Accept: application/json");
-	headers = slist_append(headers, "Content-Type: text/plain; charset=utf-8");
+	if (!ctx || !ctx->multi)
+		return 0;
 
-	if ((authorization = getenv("INFLUXDB_TOKEN")))
+	n = epoll_wait(ctx->epfd, events, (int) (sizeof(events) / sizeof(*events)), 0);
+
+	for (int i=0; i < n; i++)
 	{
-		authorization = fstring("Authorization: Token %s", authorization);
+		int fd = events[i].data.fd;
 
-		if (authorization == NULL)
+		if (fd == ctx->tfd)
 		{
-			curl_slist_free_all(headers);
-			return -1;
+			uint64_t expirations;
+
+			if (read(ctx->tfd, &expirations, sizeof(expirations)) > 0)
+				curl_multi_socket_action(ctx->multi, CURL_SOCKET_TIMEOUT, 0, &running);
 		}
+		else
+		{
+			int what = 0;
 
-		headers = slist_append(headers, authorization);
-		free(authorization);
+			if (events[i].events & EPOLLIN)             what |= CURL_CSELECT_IN;
+			if (events[i].events & EPOLLOUT)            what |= CURL_CSELECT_OUT;
+			if (events[i].events & (EPOLLERR|EPOLLHUP)) what |= CURL_CSELECT_ERR;
+
+			curl_multi_socket_action(ctx->multi, fd, what, &running);
+		}
 	}
 
-	ret = influx_http_post(ctx, lines, headers, response);
+	while ((msg = curl_multi_info_read(ctx->multi, &left)))
+	{
+		struct influx_transfer *xfer;
+
+		int status = -1;
+
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &xfer);
+
+		switch (msg->data.result)
+		{
+		case CURLE_OK:
+			status = 0;
+			break;
+
+		case CURLE_HTTP_RETURNED_ERROR:
+			{
+				long http_status = -1;
+				curl_easy_getinfo(xfer->curl, CURLINFO_RESPONSE_CODE, &http_status);
+				status = (int) http_status;
+			}
+			break;
+
+		default:
+			fprintf(stderr, "curl_multi_socket_action(): %s\n", curl_easy_strerror(msg->data.result));
+			errno = EIO;
+			break;
+		}
 
-	curl_slist_free_all(headers);
+		retire(ctx, xfer, status);
+	}
 
-	return ret;
+	return ctx->inflight;
 }
 
 
 /*
- * influx_writer_write:
- *   write a list of line protocol lines to InfluxDB.
- *   if API returns HTTP (2|3)xx, this function returns 0 and "response"
- *   is set to point to a response body ONLY when the server sent one.
- *
- *   HTTP API error codes (4|5)xx will be returned as positive integers.
- *   internal library and system errors will be returned as -1.
- *
- *   the response body is formatted as json, if one is received.
+ * influx_writer_cancel:
+ *   abort every asynchronous write in flight, and call "done" for each with
+ *   a status of -1 and errno set to ECANCELED. writes posted from "done"
+ *   are not aborted.
  */
-int influx_writer_write (struct influx_writer *ctx, const char *lines[], char **response)
+void influx_writer_cancel (struct influx_writer *ctx)
 {
-	int rc;
+	if (!ctx || !ctx->multi)
+		return;
 
-	char *data = NULL;
-
-	for (int i=0; lines[i]; i++)
-	{
-		data = fstringa(data, "%s\n", lines[i]);
+	/* only the slots that are busy now; "done" may fill others */
+	for (size_t i=0; i < ctx->ntransfers; i++)
+		ctx->transfers[i].cancel = (ctx->transfers[i].buf != NULL);
 
-		if (data == NULL)
+	for (size_t i=0; i < ctx->ntransfers; i++)
+		if (ctx->transfers[i].cancel)
 		{
-			errno = ENOMEM;
-			return -1;
+			ctx->transfers[i].cancel = 0;
+
+			errno = ECANCELED;
+			retire(ctx, &ctx->transfers[i], -1);
 		}
+}
+
+
+/*
+ * influx_fields_reserve:
+ *   make room for at least "extra" more fields in "fields".
+ *   returns -1 on memory allocation errors, leaving "fields" intact.
+ */
+int influx_fields_reserve (struct influx_fields *fields, size_t extra)
+{
+	size_t        need = fields->num + extra;
+	size_t        cap  = fields->cap ? fields->cap : 16U;
+	struct field *v;
+
+	if (need <= fields->cap)
+		return 0;
+
+	while (cap < need)
+		cap *= 2U;
+
+	if ((v = realloc(fields->v, cap * sizeof(struct field))) == NULL)
+	{
+		errno = ENOMEM;
+		return -1;
 	}
 
-	rc = influx_lines_post(ctx, data, response);
+	fields->v   = v;
+	fields->cap = cap;
 
-	free(data);
+	return 0;
+}
 
-	return rc;
+
+/*
+ * influx_fields_append:
+ *   append a copy of "f" to "fields". the name is borrowed, not copied.
+ *   returns -1 on memory allocation errors.
+ */
+int influx_fields_append (struct influx_fields *fields, const struct field *f)
+{
+	if (!fields || !f)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (influx_fields_reserve(fields, 1))
+		return -1;
+
+	fields->v[fields->num++] = *f;
+
+	return 0;
+}
+
+
+/*
+ * influx_fields_reset:
+ *   remove all fields, but keep the memory for re-use.
+ */
+void influx_fields_reset (struct influx_fields *fields)
+{
+	fields->num = 0;
 }
 
 
 /*
- * influx_field_list_create:
- *   initializes a linked list of fields. heap allocated.
+ * influx_fields_free:
+ *   deallocate the memory held by "fields", and reset it.
  */
-struct influx_field_list *influx_field_list_create (void)
+void influx_fields_free (struct influx_fields *fields)
 {
-	return (struct influx_field_list *) \
-		calloc(1, sizeof(struct influx_field_list));
+	free(fields->v);
+	fields->v   = NULL;
+	fields->num = 0;
+	fields->cap = 0;
 }
 
 
+/*---------------------------------------------------------------------------*\
+|*                               NAME INTERNING                              *|
+\*---------------------------------------------------------------------------*/
+
+#define NAMES_BLOCK_SIZE 4096U
+
+
 /*
- * influx_field_list_append:
- *   append a new measurement to a list of fields.
- *   returns -1 if heap allocation errors, or if lst is NULL or malformed.
+ * influx_names_create:
+ *   create an empty table of interned names. heap allocated.
  */
-int influx_field_list_append (struct influx_field_list *lst, const char *field, const double value)
+struct influx_names *influx_names_create (void)
 {
-	struct field f = \
+	struct influx_names *names;
+
+	if ((names = calloc(1, sizeof(struct influx_names))) == NULL)
 	{
-		.name  = fstring("%s", field),
-		.value = value
-	};
+		errno = ENOMEM;
+		return NULL;
+	}
 
-	if (f.name == NULL)
-		return -1;
+	names->nslots = 64U;
+	names->slots  = calloc(names->nslots, sizeof(struct influx_key));
+	names->hashes = calloc(names->nslots, sizeof(uint32_t));
 
-	if (lst)
+	if (!names->slots || !names->hashes)
 	{
-		if (lst->next == NULL)
-		{
-			lst->next = calloc(1, sizeof(struct influx_field_elem));
+		influx_names_destroy(names);
+		errno = ENOMEM;
+		return NULL;
+	}
 
-			if (lst->next)
-			{
-				lst->num++;
-				lst->next->f = f;
-				lst->last = lst->next;
-				return 0;
-			}
-			else
-			{
-				free(f.name);
-				return -1;
-			}
-		}
-		else
-		if (lst->last)
-		{
-			lst->last->next = calloc(1, sizeof(struct influx_field_elem));
+	return names;
+}
 
-			if (lst->last->next)
-			{
-				lst->num++;
-				lst->last->next->f = f;
-				lst->last = lst->last->next;
-				return 0;
-			}
-			else
-			{
-				free(f.name);
-				return -1;
-			}
-		}
-		else
+
+/*
+ * influx_names_destroy:
+ *   deallocate a name table, and every key handed out by it.
+ *   does nothing if names is NULL.
+ */
+void influx_names_destroy (struct influx_names *names)
+{
+	if (names)
+	{
+		struct influx_names_block *b = names->blocks;
+
+		while (b)
 		{
-			free(f.name);
-			return -1;
+			struct influx_names_block *next = b->next;
+			free(b);
+			b = next;
 		}
+
+		influx_buffer_free(&names->scratch);
+		free(names->slots);
+		free(names->hashes);
+		free(names);
 	}
-	else
+}
+
+
+/* 32-bit FNV-1a */
+static uint32_t names_hash (const char *str, size_t len)
+{
+	uint32_t h = 2166136261U;
+
+	for (size_t i=0; i < len; i++)
+	{
+		h ^= (uint8_t) str[i];
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+
+/* double the hash table, re-inserting every key */
+static int names_grow (struct influx_names *names)
+{
+	size_t             nslots = names->nslots * 2U;
+	struct influx_key *slots  = calloc(nslots, sizeof(struct influx_key));
+	uint32_t          *hashes = calloc(nslots, sizeof(uint32_t));
+
+	if (!slots || !hashes)
+	{
+		free(slots);
+		free(hashes);
+		errno = ENOMEM;
 		return -1;
+	}
+
+	for (size_t i=0; i < names->nslots; i++)
+	{
+		size_t j;
+
+		if (names->slots[i].str == NULL)
+			continue;
+
+		for (j = names->hashes[i] & (nslots - 1); slots[j].str; j = (j + 1) & (nslots - 1))
+			;
+
+		slots[j]  = names->slots[i];
+		hashes[j] = names->hashes[i];
+	}
+
+	free(names->slots);
+	free(names->hashes);
+
+	names->slots  = slots;
+	names->hashes = hashes;
+	names->nslots = nslots;
+
+	return 0;
 }
 
 
 /*
- * influx_field_list_destroy:
- *   free all resources and elements belonging to "lst",
- *   including the list object.
+ * names_store:
+ *   look up "len" bytes of "str" in "names", and copy them
+ *   into the table if they're not there yet.
  */
-void influx_field_list_destroy (struct influx_field_list *lst)
+static int names_store (struct influx_names *names, const char *str, size_t len, struct influx_key *key)
 {
-	struct influx_field_elem
-		*head,
-		*tail;
+	struct influx_names_block *b = names->blocks;
 
-	if (lst)
+	uint32_t h = names_hash(str, len);
+	size_t   i;
+
+	for (i = h & (names->nslots - 1); names->slots[i].str; i = (i + 1) & (names->nslots - 1))
+	{
+		if (names->hashes[i] == h
+		&&  names->slots[i].len == len
+		&&  memcmp(names->slots[i].str, str, len) == 0
+		){
+			*key = names->slots[i];
+			return 0;
+		}
+	}
+
+	/* not found; copy it into the newest block, or a new one */
+	if (b == NULL || b->cap - b->used < len + 1U)
 	{
-		head = tail = lst->next;
+		size_t cap = (len + 1U > NAMES_BLOCK_SIZE) ? len + 1U : NAMES_BLOCK_SIZE;
 
-		while (head)
+		if ((b = malloc(sizeof(struct influx_names_block) + cap)) == NULL)
 		{
-			free(head->f.name);
-			head = head->next;
-			free(tail);
-			tail = head;
+			errno = ENOMEM;
+			return -1;
 		}
+
+		b->next = names->blocks;
+		b->used = 0;
+		b->cap  = cap;
+
+		names->blocks = b;
 	}
 
-	free(lst);
+	memcpy(&b->mem[b->used], str, len);
+	b->mem[b->used + len] = '\0';
+
+	names->slots[i].str = &b->mem[b->used];
+	names->slots[i].len = len;
+	names->hashes[i]    = h;
+
+	b->used += len + 1U;
+
+	*key = names->slots[i];
+
+	/* keep the load factor below one half */
+	if (++names->used * 2U > names->nslots)
+		return names_grow(names);
+
+	return 0;
 }
 
+
 /*
- * influx_field_compact_free:
- *   free the resources occupied by a compact field list,
- *   including the list itself.
+ * influx_names_intern:
+ *   escape "name" for use as "kind", and store the result in "names",
+ *   unless an identical string is already there. "key" is set to the
+ *   stored string. meant to be called once, at startup, per name.
+ *   returns -1 on memory allocation errors.
  */
-void influx_field_compact_free (struct field *fields[])
+int influx_names_intern
+(
+	struct influx_names *names,
+	const char          *name,
+	enum influx_name     kind,
+	struct influx_key   *key
+)
 {
-	if (fields)
+	if (!names || !name || !key)
 	{
-		for (int i=0; fields[i]; i++)
-		{
-			free(fields[i]->name);
-			free(fields[i]);
-		}
-
-		free(fields);
+		errno = EINVAL;
+		return -1;
 	}
+
+	influx_buffer_reset(&names->scratch);
+	put_escaped(&names->scratch, name, (kind == INFLUX_NAME_MEASUREMENT) ? ", " : ",= ");
+
+	if (names->scratch.fail)
+		return -1;
+
+	return names_store(names, names->scratch.mem ? names->scratch.mem : "", names->scratch.len, key);
 }
 
+
 /*
- * influx_field_list_compact:
- *   reduce the flexible linked list structure into a
- *   compact element array. heap allocated.
- *   returns NULL on memory allocation errors.
+ * influx_names_tagset:
+ *   render the NULL-terminated list "tags" as a line protocol tag set,
+ *   i.e. ",key=value,key=value", sorted by key and escaped, and intern it.
+ *   tags with an empty name or value are skipped.
+ *   returns -1 on memory allocation errors.
  */
-struct field **influx_field_list_compact (const struct influx_field_list *lst)
+int influx_names_tagset (struct influx_names *names, const struct tag *tags[], struct influx_key *key)
 {
-	if (lst)
-	{
-		size_t i=0;
+	const struct tag **sorted;
 
-		struct influx_field_elem *head;
+	size_t n = 0;
+	size_t m = 0;
 
-		struct field **fields = calloc(lst->num + 1, sizeof(struct influx_field_list *));
+	if (!names || !tags || !key)
+	{
+		errno = EINVAL;
+		return -1;
+	}
 
-		if (fields == NULL)
-			return fields;
+	while (tags[n])
+		n++;
 
-		head = lst->next;
+	if ((sorted = calloc(n + 1, sizeof(struct tag *))) == NULL)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
 
-		while (head && i < lst->num)
-		{
-			struct field *f = fields[i++] = calloc(1, sizeof(struct field));
+	/*
+	 * InfluxDB wants the tags sorted by key, and they are few,
+	 * so an insertion sort it is.
+	 */
+	for (size_t i=0; i < n; i++)
+	{
+		size_t j = m++;
 
-			if (f == NULL || (f->name = fstring("%s", head->f.name)) == NULL)
-			{
-				influx_field_compact_free(fields);
-				return NULL;
-			}
-			f->value = head->f.value;
+		if (!tags[i]->name || !tags[i]->value)
+		{
+			m--;
+			continue;
+		}
 
-			/* next element */
-			head = head->next;
+		while (j > 0 && strcmp(sorted[j - 1]->name, tags[i]->name) > 0)
+		{
+			sorted[j] = sorted[j - 1];
+			j--;
 		}
 
-		return fields;
+		sorted[j] = tags[i];
 	}
-	else
-		return NULL;
+
+	/* let influx_line_tag do the rendering, on a line that never ends */
+	influx_buffer_reset(&names->scratch);
+
+	for (size_t i=0; i < m; i++)
+		influx_line_tag(&names->scratch, sorted[i]->name, sorted[i]->value);
+
+	free(sorted);
+
+	if (names->scratch.fail)
+		return -1;
+
+	return names_store(names, names->scratch.mem ? names->scratch.mem : "", names->scratch.len, key);
 }
@@ -22,19 +22,24 @@
 
 #include <stddef.h>
 #include <stdint.h>
-#include <inttypes.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <signal.h>
-#include <time.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
 
 #include <modbus/modbus-rtu.h>
 #include <modbus/modbus-version.h>
 
+#include "bus.h"
+#include "config.h"
 #include "influx.h"
+#include "regmap.h"
+#include "spool.h"
+#include "upload.h"
 
 #undef zDEBUG
 #ifdef DEBUG
@@ -44,13 +49,13 @@
 #endif
 
 /*
- * SERIAL
+ * CONFIGURATION
+ *
+ * everything below is the compiled-in default, and can be overridden
+ * per site in the file "-c", see config.h. a missing file is fine,
+ * unless it was asked for.
  */
-#define UART_DEV   "/dev/ttyAMA4"
-#define BAUD       9600
-#define PARITY     'N' /* 'N', 'E', 'O' */
-#define BITS_BYTE  8
-#define BITS_STOP  1
+#define CONFIG_FILE "/etc/modbus.conf"
 
 /*
  * INFLUXDB
@@ -59,448 +64,708 @@
 #define FLUX_URL "https://8f.nu"
 #define FLUX_ORG "Kandidatarbete"
 #define FLUX_BKT "electricity"
-#define FLUX_PRC INFLUX_PRECISION_S
+#define FLUX_PRC INFLUX_PRECISION_MS
+#define FLUX_ZIP 6 /* gzip level of request bodies, 0 for none */
+#define FLUX_BUF 8 /* batches that may be waiting for upload     */
+#define FLUX_ASY 4 /* posts in flight at once, 0 for blocking    */
 
+/*
+ * BATCHING
+ *
+ * ticks are posted together, once one of these is reached.
+ */
+#define BATCH_BYTES (256UL << 10) /* [B]  */
+#define BATCH_LINES 5000          /* [#]  */
+#define BATCH_AGE   30000         /* [ms] */
 
-static uint32_t regs2uint32 (uint16_t regs[static 2])
+/*
+ * SPOOL
+ *
+ * intervals that can not be delivered are kept on disk until the
+ * server is back, see spool.h.
+ */
+#define SPOOL_DIR "/var/spool/modbus"
+#define SPOOL_SEG (4UL   << 20) /* [B] segment file size           */
+#define SPOOL_MAX (256UL << 20) /* [B] disk space, oldest goes     */
+#define SPOOL_SYN (64UL  << 10) /* [B] written between disk syncs  */
+
+
+/*
+ * STATISTICS
+ *
+ * how the buses and the uploads are doing, written to the same bucket
+ * as the readings, see stats.h.
+ */
+#define STATS_PERIOD 60000 /* [ms] between reports, 0 for none  */
+
+
+/*
+ * REGISTER MAP (ABB A43)
+ *
+ * every group ends up as one line protocol line per meter, once per
+ * period of the group. the registers are read in as few requests as
+ * the cost model allows, see "regmap_compile" and the dry-run option
+ * "-n", which also shows how much of the bus every group takes.
+ */
+
+#define TURNAROUND 20000 /* [us] slave processing time per request */
+#define RTS_DELAY  1     /* [us] between setting RTS and Tx       */
+
+/*
+ * reads of every meter at each baud rate tried by the probe option "-p",
+ * see bus_probe. a rate is only stable if all of them succeed.
+ */
+#define PROBE_ROUNDS 20
+
+enum
 {
-	uint32_t
-		up = (uint32_t) regs[0],
-		lo = (uint32_t) regs[1];
+	GROUP_INSTANT = 0,
+	GROUP_TOTAL,
+	GROUP_PHASE,
+	GROUP_END
+};
 
-	return ((uint32_t) up << 16) | lo;
-}
+static const struct reg_group a43_groups[GROUP_END] = \
+{
+	/*                  measurement          period [ms] */
+	[GROUP_INSTANT] = { "instant",            1000 },
+	[GROUP_TOTAL]   = { "accumulator_total", 60000 },
+	[GROUP_PHASE]   = { "accumulator_phase", 60000 },
+};
 
-static uint64_t regs2uint64 (uint16_t regs[static 4])
+/*
+ * register ranges known to be readable in one request. anything in
+ * between is not documented for the A43, so reads never span it.
+ */
+static const struct reg_span a43_readable[] = \
 {
-	uint64_t
-		ms   = (uint64_t) regs[0],
-		midl = (uint64_t) regs[1],
-		midr = (uint64_t) regs[2],
-		ls   = (uint64_t) regs[3];
-
-	return   ( (uint64_t) ms    << 48 )
-	       | ( (uint64_t) midl  << 32 )
-	       | ( (uint64_t) midr  << 16 )
-	       | ( (uint64_t) ls    << 0  )
-	       ;
-}
+	{ 0x5000, 56 }, /* total energy accumulators     */
+	{ 0x5460, 36 }, /* per-phase energy accumulators */
+	{ 0x5B00, 28 }, /* instantaneous values          */
+};
 
-/* global writer handle for signal handler cleanup */
-static struct influx_writer *writer = NULL;
+static const struct reg_def a43_defs[] = \
+{
+	/*
+	 *  addr.   description             what   res.   unit      type
+	 *  0x5B00  Voltage                 L1-N   0,1    V         Unsigned
+	 *  0x5B02  Voltage                 L2-N   0,1    V         Unsigned
+	 *  0x5B04  Voltage                 L3-N   0,1    V         Unsigned
+	 *  0x5B06  Voltage                 L1-L2  0,1    V         Unsigned
+	 *  0x5B08  Voltage                 L3-L2  0,1    V         Unsigned
+	 *  0x5B0A  Voltage                 L1-L3  0,1    V         Unsigned
+	 *  0x5B0C  Current                 L1     0,01   A         Unsigned
+	 *  0x5B0E  Current                 L2     0,01   A         Unsigned
+	 *  0x5B10  Current                 L3     0,01   A         Unsigned
+	 *  0x5B12  Current                 N      0,01   A         Unsigned
+	 *  0x5B14  Active power            Total  0,01   W         Signed
+	 *  0x5B16  Active power            L1     0,01   W         Signed
+	 *  0x5B18  Active power            L2     0,01   W         Signed
+	 *  0x5B1A  Active power            L3     0,01   W         Signed
+	 */
+	{ 0x5B00, 2,          0, GROUP_INSTANT,   10, "voltage_l1_n"  },
+	{ 0x5B02, 2,          0, GROUP_INSTANT,   10, "voltage_l2_n"  },
+	{ 0x5B04, 2,          0, GROUP_INSTANT,   10, "voltage_l3_n"  },
+	{ 0x5B06, 2,          0, GROUP_INSTANT,   10, "voltage_l1_l2" },
+	{ 0x5B08, 2,          0, GROUP_INSTANT,   10, "voltage_l3_l2" },
+	{ 0x5B0A, 2,          0, GROUP_INSTANT,   10, "voltage_l1_l3" },
+	{ 0x5B0C, 2,          0, GROUP_INSTANT,  100, "current_l1"    },
+	{ 0x5B0E, 2,          0, GROUP_INSTANT,  100, "current_l2"    },
+	{ 0x5B10, 2,          0, GROUP_INSTANT,  100, "current_l3"    },
+	{ 0x5B12, 2,          0, GROUP_INSTANT,  100, "current_n"     },
+	{ 0x5B14, 2, REG_SIGNED, GROUP_INSTANT,  100, "active_tot"    },
+	{ 0x5B16, 2, REG_SIGNED, GROUP_INSTANT,  100, "active_l1"     },
+	{ 0x5B18, 2, REG_SIGNED, GROUP_INSTANT,  100, "active_l2"     },
+	{ 0x5B1A, 2, REG_SIGNED, GROUP_INSTANT,  100, "active_l3"     },
 
-/* also made global*/
-static modbus_t *mb = NULL;
+	/*
+	 *  addr.   description             res.   unit      type
+	 *  0x5000  Active import           0,01   kWh       Unsigned
+	 *  0x5004  Active export           0,01   kWh       Unsigned
+	 *  0x5008  Active net              0,01   kWh       Signed
+	 *  0x500C  Reactive import         0,01   kvarh     Unsigned
+	 *  0x5010  Reactive export         0,01   kVArh     Unsigned
+	 *  0x5014  Reactive net            0,01   kVArh     Signed
+	 *  0x5018  Apparent import         0,01   kVAh      Unsigned
+	 *  0x501C  Apparent export         0,01   kVAh      Unsigned
+	 *  0x5020  Apparent net            0,01   kVAh      Signed
+	 *  0x5024  Active import CO2       0,001  kg        Unsigned
+	 *  0x5034  Active import Currency  0,001  currency  Unsigned
+	 */
+	{ 0x5000, 4,          0, GROUP_TOTAL,    100, "import"        },
+	{ 0x5004, 4,          0, GROUP_TOTAL,    100, "export"        },
+	{ 0x5008, 4, REG_SIGNED, GROUP_TOTAL,    100, "netto"         },
+	{ 0x5034, 4,          0, GROUP_TOTAL,   1000, "currency"      },
 
-void signal_handler (int sig)
+	/*
+	 *  addr.   description    line  res.  unit  type
+	 *  0x5460  Active import  L1    0,01  kWh   Unsigned
+	 *  0x5464  Active import  L2    0,01  kWh   Unsigned
+	 *  0x5468  Active import  L3    0,01  kWh   Unsigned
+	 *  0x546C  Active export  L1    0,01  kWh   Unsigned
+	 *  0x5470  Active export  L2    0,01  kWh   Unsigned
+	 *  0x5474  Active export  L3    0,01  kWh   Unsigned
+	 *  0x5478  Active net     L1    0,01  kWh   Signed
+	 *  0x547C  Active net     L2    0,01  kWh   Signed
+	 *  0x5480  Active net     L3    0,01  kWh   Signed
+	 */
+	{ 0x5460, 4,          0, GROUP_PHASE,    100, "import_l1"     },
+	{ 0x5464, 4,          0, GROUP_PHASE,    100, "import_l2"     },
+	{ 0x5468, 4,          0, GROUP_PHASE,    100, "import_l3"     },
+	{ 0x546C, 4,          0, GROUP_PHASE,    100, "export_l1"     },
+	{ 0x5470, 4,          0, GROUP_PHASE,    100, "export_l2"     },
+	{ 0x5474, 4,          0, GROUP_PHASE,    100, "export_l3"     },
+	{ 0x5478, 4, REG_SIGNED, GROUP_PHASE,    100, "netto_l1"      },
+	{ 0x547C, 4, REG_SIGNED, GROUP_PHASE,    100, "netto_l2"      },
+	{ 0x5480, 4, REG_SIGNED, GROUP_PHASE,    100, "netto_l3"      },
+};
+
+#define NELEMS(A) (sizeof(A) / sizeof(*(A)))
+
+/* the maps a configuration file may refer to without defining them */
+static const struct config_map maps[] = \
 {
-	switch (sig)
 	{
-	case SIGINT:
-	case SIGTERM:
-		/*
-		 * can race if SIGINT and SIGTERM are delivered simultaneously.
-		 * bad practice, but I don't care right now.
-		 */
-		influx_writer_destroy(writer);
-		modbus_close(mb);
-		modbus_free(mb);
-		exit(EXIT_FAILURE);
-	}
-}
+		.name  = "a43",
+		.table = \
+		{
+			.defs      = a43_defs,
+			.groups    = a43_groups,
+			.readable  = a43_readable,
+			.ndefs     = NELEMS(a43_defs),
+			.ngroups   = NELEMS(a43_groups),
+			.nreadable = NELEMS(a43_readable)
+		}
+	},
+};
 
-#define INTERVAL 5 /* in seconds */
+/*
+ * SERIAL
+ *
+ * every bus is polled by a thread of its own, see bus.h. slave ids
+ * only have to be unique on their bus, meter names everywhere.
+ */
+static const struct bus_meter ama4_meters[] = \
+{
+	{ 1, "1" },
+	{ 2, "2" },
+	{ 3, "3" },
+};
 
-/* computes a - b */
-static struct timespec ts_diff (struct timespec a, struct timespec b)
+static const struct bus_config buses[] = \
+{
+	{
+		.device        = "/dev/ttyAMA4",
+		.baud          = 9600,
+		.parity        = 'N', /* 'N', 'E', 'O' */
+		.data_bits     = 8,
+		.stop_bits     = 1,
+		.turnaround_us = TURNAROUND,
+		.rts_delay_us  = RTS_DELAY,
+		.meters        = ama4_meters,
+		.nmeters       = NELEMS(ama4_meters),
+		.map           = "a43",
+		.table         = &maps[0].table
+	},
+};
+
+static const struct config defaults = \
 {
-	long diff_sec;
-	long diff_nsec;
+	.url       = FLUX_URL,
+	.org       = FLUX_ORG,
+	.bucket    = FLUX_BKT,
+	.precision = FLUX_PRC,
+	.gzip      = FLUX_ZIP,
+	.batches   = FLUX_BUF,
+	.inflight  = FLUX_ASY,
+
+	.limits = \
+	{
+		.max_bytes  = BATCH_BYTES,
+		.max_lines  = BATCH_LINES,
+		.max_age_ms = BATCH_AGE
+	},
 
-	struct timespec diff;
+	.spool_dir = SPOOL_DIR,
+	.spool = \
+	{
+		.segment_bytes = SPOOL_SEG,
+		.max_bytes     = SPOOL_MAX,
+		.sync_bytes    = SPOOL_SYN
+	},
 
-	diff_sec  = a.tv_sec - b.tv_sec;
-	diff_nsec = 1000000000 * diff_sec + (a.tv_nsec - b.tv_nsec);
+	.stats_ms = STATS_PERIOD,
 
-	diff.tv_nsec = diff_nsec % 1000000000L;
-	diff.tv_sec  = diff_nsec / 1000000000L;
+	.maps   = maps,
+	.nmaps  = NELEMS(maps),
+	.buses  = buses,
+	.nbuses = NELEMS(buses)
+};
 
-	return diff;
+/*
+ * watch:
+ *   add "fd" to the epoll set "epfd", for reading.
+ */
+static int watch (int epfd, int fd)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/*
+ * same_line:
+ *   whether "a" and "b" describe the same serial line.
+ */
+static int same_line (const struct bus_config *a, const struct bus_config *b)
+{
+	return strcmp(a->device, b->device) == 0
+	    && a->baud         == b->baud
+	    && a->parity       == b->parity
+	    && a->data_bits    == b->data_bits
+	    && a->stop_bits    == b->stop_bits
+	    && a->rts_delay_us == b->rts_delay_us;
 }
 
-static void increment_time (struct timespec *spec)
+
+/*
+ * same_upload:
+ *   whether "a" and "b" post and spool the same way.
+ */
+static int same_upload (const struct config *a, const struct config *b)
 {
-	struct timespec
-		now,
-		d;
+	return strcmp(a->url,       b->url)       == 0
+	    && strcmp(a->org,       b->org)       == 0
+	    && strcmp(a->bucket,    b->bucket)    == 0
+	    && strcmp(a->spool_dir, b->spool_dir) == 0
+	    && a->precision            == b->precision
+	    && a->gzip                 == b->gzip
+	    && a->batches              == b->batches
+	    && a->inflight             == b->inflight
+	    && a->limits.max_bytes     == b->limits.max_bytes
+	    && a->limits.max_lines     == b->limits.max_lines
+	    && a->limits.max_age_ms    == b->limits.max_age_ms
+	    && a->spool.segment_bytes  == b->spool.segment_bytes
+	    && a->spool.max_bytes      == b->spool.max_bytes
+	    && a->spool.sync_bytes     == b->spool.sync_bytes
+	    && a->stats_ms             == b->stats_ms;
+}
 
-	clock_gettime(CLOCK_MONOTONIC_RAW, &now);
 
-	d = ts_diff(*spec, now);
+/*
+ * reload:
+ *   read the configuration file "path" again, and hand the new meters and
+ *   register maps of every bus in "bus" over to its poll thread. the serial
+ *   lines and the upload side stay as they are, so "cfg" and the new file
+ *   must agree on the buses. returns the new configuration, and the number
+ *   of poll threads that are yet to switch to it in "pending", or NULL if
+ *   it could not be used, in which case everything is left as it was.
+ */
+static struct config *reload (const char *path, const struct config *cfg, struct bus *bus, struct influx_names *names, size_t *pending)
+{
+	struct config    *next;
+	struct bus_plan **plans;
+	size_t            b;
 
-	while (d.tv_sec < 0 || (d.tv_sec == 0 && d.tv_nsec < 0))
+	if ((next = config_load(path, &defaults)) == NULL)
 	{
-		spec->tv_nsec  = 0;
+		if (errno != EINVAL)
+			fprintf(stderr, "%s: %s\n", path, strerror(errno));
 
-		if (spec->tv_sec % INTERVAL == 0)
-			spec->tv_sec += INTERVAL;
-		else
-			spec->tv_sec += spec->tv_sec % INTERVAL;
+		return NULL;
+	}
+
+	for (b=0; b < cfg->nbuses && b < next->nbuses; b++)
+		if (!same_line(&cfg->buses[b], &next->buses[b]))
+			break;
 
-		d = ts_diff(*spec, now);
+	if (b < cfg->nbuses || b < next->nbuses)
+	{
+		fprintf(stderr, "%s: the serial lines have changed; restart to use it\n", path);
+		config_free(next);
+		return NULL;
 	}
-}
 
-static void wait_until_and_increment(struct timespec *then)
-{
-	useconds_t wait;
-	struct timespec now, diff;
+	if (!same_upload(cfg, next))
+		fprintf(stderr, "%s: [influx], [batch], [spool] and [stats] take effect on restart\n", path);
 
-	/*
-	 * advance the future timepoint in increments of INTERVAL seconds
-	 * until we have a positive difference
-	 */
-	increment_time(then);
+	if ((plans = calloc(cfg->nbuses, sizeof(struct bus_plan *))) == NULL)
+	{
+		perror("calloc");
+		config_free(next);
+		return NULL;
+	}
 
-	/* get current time counter */
-	clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+	/* all or nothing, so no bus is left behind on the old file */
+	for (b=0; b < next->nbuses; b++)
+		if ((plans[b] = bus_plan_create(&next->buses[b], names)) == NULL)
+		{
+			fprintf(stderr, "bus_plan_create: %s: %s\n", next->buses[b].device, strerror(errno));
+			break;
+		}
+
+	if (b < next->nbuses)
+	{
+		while (b--)
+			bus_plan_free(plans[b]);
+
+		free(plans);
+		config_free(next);
+		return NULL;
+	}
 
-	/* calculate difference in microseconds to target */
-	diff = ts_diff(*then, now);
+	*pending = 0;
 
-	wait = (useconds_t) diff.tv_sec  * 1000000U
-	     + (useconds_t) diff.tv_nsec / 1000U;
+	for (b=0; b < next->nbuses; b++)
+		*pending += (size_t) bus_reload(&bus[b], plans[b]);
 
-	usleep(wait);
+	free(plans);
+
+	return next;
 }
 
+
 int main (int argc, char *argv[])
 {
-	int rc;
+	/*
+	 * SIGINT and SIGTERM are blocked, in every thread, and read from a
+	 * signalfd in the main loop, so shutdown happens in order. SIGHUP
+	 * reloads the meters and register maps from the configuration file.
+	 */
+	sigset_t sigset;
+
+	int sfd  = -1;
+	int epfd = -1;
+	int quit = 0;
+	int rc   = EXIT_FAILURE;
+
+	struct epoll_event ev;
 
-	struct sigaction sa = \
+	struct bus *bus;
+	size_t      nbuses;
+	size_t      opened = 0;
+
+	struct influx_writer *writer = NULL;
+	struct uploader       uploader;
+	int                   uploading = 0;
+
+	/* names and tag sets, escaped once, shared by every bus */
+	struct influx_names *names = NULL;
+
+	int dry_run  = 0;
+	int probe    = 0;
+	int required = 0;
+	int gzip    = -1;
+
+	const char *spool_dir   = NULL;
+	const char *config_file = NULL;
+
+	/* "cfg" is either "loaded" or the compiled-in defaults */
+	const struct config *cfg = &defaults;
+	struct config       *loaded;
+
+	/* the configuration before a reload, until every bus has let go of it */
+	struct config *retired = NULL;
+	size_t         pending = 0;
+
+	struct spool *spool = NULL;
+
+	const char *const restrict argv0 = argv[0];
+
+	for (int opt; (opt = getopt(argc, argv, "c:hnps:z:")) != -1;)
 	{
-		.sa_flags   = SA_RESTART, /* restart system calls */
-		.sa_mask    = 0,
-		.sa_handler = signal_handler
-	};
+		switch (opt)
+		{
+		case 'c':
+			config_file = optarg;
+			break;
 
-	struct timespec ts_next;
+		case 'n':
+			dry_run = 1;
+			break;
 
-	const char *const restrict argv0 = *argv++; argc--;
+		case 'p':
+			probe = 1;
+			break;
 
-	if ((sigaction(SIGINT,  &sa, NULL) == -1)
-	||  (sigaction(SIGTERM, &sa, NULL) == -1)
-	){
-		perror("sigaction");
-		return 1;
+		case 's':
+			spool_dir = optarg;
+			break;
+
+		case 'z':
+		{
+			char *end;
+			long  level = strtol(optarg, &end, 10);
+
+			if (end != optarg && *end == '\0' && level >= 0 && level <= 9)
+			{
+				gzip = (int) level;
+				break;
+			}
+
+			fprintf(stderr, "%s: invalid gzip level -- '%s'\n", argv0, optarg);
+			opt = '?';
+		}
+			/* fall through */
+
+		default:
+			fprintf(stderr,
+				"usage: %s [-hnp] [-c file] [-s dir] [-z level]\n"
+				"  -c  configuration file (default %s)\n"
+				"  -h  show this help\n"
+				"  -n  dry run: print the planned modbus reads and exit\n"
+				"  -p  probe for the fastest baud rate every bus runs at without errors, and exit\n"
+				"  -s  spool directory for undelivered data, \"\" for none (default %s)\n"
+				"  -z  gzip level of uploads, 0-9 (default %d)\n",
+				argv0, CONFIG_FILE, SPOOL_DIR, FLUX_ZIP
+			);
+			return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
 	}
 
-	mb = modbus_new_rtu(UART_DEV, BAUD, PARITY, BITS_BYTE, BITS_STOP);
+	if (config_file == NULL)
+		config_file = CONFIG_FILE;
+
+	else
+		required = 1;
+
+	if ((loaded = config_load(config_file, &defaults)) != NULL)
+		cfg = loaded;
 
-	if (mb == NULL)
+	else if (errno != ENOENT || required)
 	{
-		perror("modbus_new_rtu");
+		/* mistakes in the file have been reported already */
+		if (errno != EINVAL)
+			fprintf(stderr, "%s: %s\n", config_file, strerror(errno));
+
 		return EXIT_FAILURE;
 	}
 
-	modbus_rtu_set_serial_mode (mb, MODBUS_RTU_RS485);
-	modbus_rtu_set_rts         (mb, MODBUS_RTU_RTS_DOWN);
-	modbus_rtu_set_rts_delay   (mb, 1); /* [us] between setting RTS and Tx */
-	modbus_set_debug           (mb, zDEBUG);
-	modbus_set_slave           (mb, 0x1);
+	/* the command line has the last word */
+	if (gzip == -1)
+		gzip = cfg->gzip;
+
+	if (spool_dir == NULL)
+		spool_dir = cfg->spool_dir;
+
+	nbuses = cfg->nbuses;
 
-	if (modbus_connect(mb) == -1)
+	if ((bus = calloc(nbuses, sizeof(struct bus))) == NULL)
 	{
-		fprintf(stderr, "Connection failed: %s\n", modbus_strerror(errno));
-		modbus_free(mb);
-		return EXIT_FAILURE;
+		perror("calloc");
+		goto out;
+	}
+
+	/* before any thread is started, so they all inherit the mask */
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGINT);
+	sigaddset(&sigset, SIGTERM);
+	sigaddset(&sigset, SIGHUP);
+
+	if ((sigprocmask(SIG_BLOCK, &sigset, NULL) == -1)
+	||  (sfd = signalfd(-1, &sigset, SFD_CLOEXEC)) == -1
+	){
+		perror("signalfd");
+		goto out;
 	}
 
-	/* just check that CLOCK_MONOTONIC_RAW exists on this system */
-	if (clock_gettime(CLOCK_MONOTONIC_RAW, &ts_next))
+	if ((names = influx_names_create()) == NULL)
 	{
-		perror("clock_gettime");
-		modbus_close(mb);
-		modbus_free(mb);
-		return EXIT_FAILURE;
+		perror("influx_names_create");
+		goto out;
 	}
 
-	writer = influx_writer_create(FLUX_URL, FLUX_ORG, FLUX_BKT, FLUX_PRC);
+	for (; opened < nbuses; opened++)
+		if (bus_open(&bus[opened], &cfg->buses[opened], names, cfg->precision) == -1)
+		{
+			fprintf(stderr, "bus_open: %s: %s\n", cfg->buses[opened].device, strerror(errno));
+			goto out;
+		}
+
+	if (dry_run)
+	{
+		for (size_t b=0; b < nbuses; b++)
+			bus_print_plan(stdout, &bus[b]);
+
+		rc = EXIT_SUCCESS;
+		goto out;
+	}
+
+	if (probe)
+	{
+		int stable = 1;
+
+		for (size_t b=0; b < nbuses; b++)
+		{
+			int found = bus_probe(stdout, &bus[b], PROBE_ROUNDS);
+
+			if (found == -1)
+				fprintf(stderr, "bus_probe: %s: %s\n", cfg->buses[b].device, modbus_strerror(errno));
+
+			if (found <= 0)
+				stable = 0;
+		}
+
+		rc = stable ? EXIT_SUCCESS : EXIT_FAILURE;
+		goto out;
+	}
+
+	for (size_t b=0; b < nbuses; b++)
+		if (bus_connect(&bus[b], zDEBUG) == -1)
+		{
+			fprintf(stderr, "Connection failed: %s: %s\n", cfg->buses[b].device, modbus_strerror(errno));
+			goto out;
+		}
+
+	writer = influx_writer_create(cfg->url, cfg->org, cfg->bucket, cfg->precision);
 
 	if (writer == NULL)
 	{
 		perror("influx_writer_create");
-		modbus_close(mb);
-		modbus_free(mb);
-		return EXIT_FAILURE;
+		goto out;
 	}
 
-	for (;;)
+	if (influx_writer_set_gzip(writer, gzip) == -1)
 	{
-		char *lines = NULL;
+		perror("influx_writer_set_gzip");
+		goto out;
+	}
 
-		lines = malloc(sizeof(char));
+	/* running without a spool beats not running at all */
+	if (*spool_dir && (spool = spool_open(spool_dir, &cfg->spool)) == NULL)
+		fprintf(stderr, "spool_open: %s: %s\n", spool_dir, strerror(errno));
 
-		/* waits untill next interval, according to "INTERVAL" */
-		wait_until_and_increment(&ts_next);
+	if (spool && spool->records)
+		printf("spool: %zu records from an earlier run\n", spool->records);
 
-		if (lines == NULL)
-			continue;
+	if (cfg->inflight > 0 && influx_writer_async(writer, cfg->inflight) == -1)
+	{
+		perror("influx_writer_async");
+		goto out;
+	}
 
-		*lines = '\0';
+	/* one source of batches per bus */
+	if (uploader_start(&uploader, writer, spool, nbuses, cfg->batches, &cfg->limits, cfg->stats_ms) == -1)
+	{
+		perror("uploader_start");
+		goto out;
+	}
 
-		modbus_flush(mb);
+	uploading = 1;
 
-		for (int i=1; i < 4; i++) /* 3 meters */
+	for (size_t b=0; b < nbuses && !quit; b++)
+		if (bus_start(&bus[b], &uploader, b, cfg->stats_ms) == -1)
 		{
-			uint16_t regs [MODBUS_MAX_READ_REGISTERS];
-
-			uint32_t instants [16] = {0};
-			uint64_t totals   [16] = {0};
-			uint64_t phases   [16] = {0};
-
-			modbus_set_slave (mb, i);
-
-			/*
-			 * instantaneous values begin at 0x5B00,
-			 * and each value is 2 modbus registers
-			 * wide, which makes it a 32-bit value.
-			 *
-			 * addr.   description     what   res.  unit  type
-			 * 0x5B00  Voltage         L1-N   0,1   V     Unsigned
-			 * 0x5B02  Voltage         L2-N   0,1   V     Unsigned
-			 * 0x5B04  Voltage         L3-N   0,1   V     Unsigned
-			 * 0x5B06  Voltage         L1-L2  0,1   V     Unsigned
-			 * 0x5B08  Voltage         L3-L2  0,1   V     Unsigned
-			 * 0x5B0A  Voltage         L1-L3  0,1   V     Unsigned
-			 * 0x5B0C  Current         L1     0,01  A     Unsigned
-			 * 0x5B0E  Current         L2     0,01  A     Unsigned
-			 * 0x5B10  Current         L3     0,01  A     Unsigned
-			 * 0x5B12  Current         N      0,01  A     Unsigned
-			 * 0x5B14  Active power    Total  0,01  W     Signed
-			 * 0x5B16  Active power    L1     0,01  W     Signed
-			 * 0x5B18  Active power    L2     0,01  W     Signed
-			 * 0x5B1A  Active power    L3     0,01  W     Signed
-			 *
-			 * this reading spans 28 registers in total.
-			 */
-
-			rc = modbus_read_registers(mb, 0x5B00, 28, regs);
-
-			if (rc < 0)
-			{
-				fprintf(stderr, "%s\n", modbus_strerror(errno));
-				break;
-			}
+			fprintf(stderr, "bus_start: %s: %s\n", cfg->buses[b].device, strerror(errno));
+			quit = 1;
+		}
 
-			if (rc == 28)
-				for (int j=0; j < 28/2; j++)
-					instants[j] = regs2uint32(&regs[j*2]);
-			else
-			{
-				fprintf(stderr, "modbus_read_registers: only %u of 28 registers received\n", rc);
-				break;
-			}
+	/*
+	 * the buses poll in threads of their own, and the http side is served
+	 * by the upload thread; all that is left here is to wait for signals.
+	 */
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1 || watch(epfd, sfd) == -1)
+	{
+		perror("epoll");
+		quit = 1;
+	}
 
-			/*
-			 * total energy accumulators begin at 0x5000.
-			 * each measurement is 4 modbus registers wide,
-			 * which makes it a 64-bit value.
-			 *
-			 *   addr.   description             res.   unit      type
-			 *   0x5000  Active import           0,01   kWh       Unsigned
-			 *   0x5004  Active export           0,01   kWh       Unsigned
-			 *   0x5008  Active net              0,01   kWh       Signed
-			 *   0x500C  Reactive import         0,01   kvarh     Unsigned
-			 *   0x5010  Reactive export         0,01   kVArh     Unsigned
-			 *   0x5014  Reactive net            0,01   kVArh     Signed
-			 *   0x5018  Apparent import         0,01   kVAh      Unsigned
-			 *   0x501C  Apparent export         0,01   kVAh      Unsigned
-			 *   0x5020  Apparent net            0,01   kVAh      Signed
-			 *   0x5024  Active import CO2       0,001  kg        Unsigned
-			 *   0x5034  Active import Currency  0,001  currency  Unsigned
-			 *
-			 * this block spans 56 registers in total.
-			 */
-
-			rc = modbus_read_registers(mb, 0x5000, 56, regs);
-
-			if (rc < 0)
-			{
-				fprintf(stderr, "%s\n", modbus_strerror(errno));
-				break;
-			}
+	/* told when a bus has switched over to a reloaded configuration */
+	for (size_t b=0; b < nbuses && !quit; b++)
+		if (watch(epfd, bus[b].swapped) == -1)
+		{
+			perror("epoll_ctl");
+			quit = 1;
+		}
 
-			if (rc == 56)
-				for (int j=0; j < 56/4; j++)
-					totals[j] = regs2uint64(&regs[j*4]);
-			else
-			{
-				fprintf(stderr, "modbus_read_registers: only %u of 56 registers received\n", rc);
-				break;
-			}
+	while (!quit)
+	{
+		struct signalfd_siginfo si;
+		struct config          *next;
 
-			/*
-			 * per-phase energy accumulators begin at 0x5460.
-			 * each measurement is 4 modbus registers wide,
-			 * which makes it a 64-bit value.
-			 *
-			 *   addr.   description    line  res.  unit  type
-			 *   0x5460  Active import  L1    0,01  kWh   Unsigned
-			 *   0x5464  Active import  L2    0,01  kWh   Unsigned
-			 *   0x5468  Active import  L3    0,01  kWh   Unsigned
-			 *   0x546C  Active export  L1    0,01  kWh   Unsigned
-			 *   0x5470  Active export  L2    0,01  kWh   Unsigned
-			 *   0x5474  Active export  L3    0,01  kWh   Unsigned
-			 *   0x5478  Active net     L1    0,01  kWh   Signed
-			 *   0x547C  Active net     L2    0,01  kWh   Signed
-			 *   0x5480  Active net     L3    0,01  kWh   Signed
-			 *
-			 * this selected block spans 36 registers in total.
-			 */
-
-			rc = modbus_read_registers(mb, 0x5460, 36, regs);
-
-			if (rc < 0)
-			{
-				fprintf(stderr, "%s\n", modbus_strerror(errno));
-				break;
-			}
+		if (epoll_wait(epfd, &ev, 1, -1) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+
+			perror("epoll_wait");
+			break;
+		}
+
+		if (ev.data.fd != sfd)
+		{
+			uint64_t n;
 
-			if (rc == 36)
-				for (int j=0; j < 36/4; j++)
-					phases[j] = regs2uint64(&regs[j*4]);
-			else
+			if (read(ev.data.fd, &n, sizeof(n)) == (ssize_t) sizeof(n) && pending > 0 && --pending == 0)
 			{
-				fprintf(stderr, "modbus_read_registers: only %u of 36 registers received\n", rc);
-				break;
-			}
+				config_free(retired);
+				retired = NULL;
 
-			/*
-			 * convert into measurements to sent to influxdb
-			 */
-			if (1) {
-				struct influx_field_list
-					*instant_fields,
-					*total_fields,
-					*phase_fields;
-
-				struct field
-					**compact_instants,
-					**compact_totals,
-					**compact_phases;
-
-				char
-					*line_total,
-					*line_instant,
-					*line_phase;
-
-				struct tag tag = \
-				{
-					.name="meter",
-					.value=""
-				};
-
-				struct tag *tags[] = \
-				{
-					&tag,
-					NULL
-				};
-
-				instant_fields = influx_field_list_create();
-				  total_fields = influx_field_list_create();
-				  phase_fields = influx_field_list_create();
-
-				tag.value = fstring("%d", i);
-
-				/*
-				 * instantaneous values
-				 */
-
-				/* voltages */
-				influx_field_list_append(instant_fields, "voltage_l1_n",  (double) instants[0] / 10.0);
-				influx_field_list_append(instant_fields, "voltage_l2_n",  (double) instants[1] / 10.0);
-				influx_field_list_append(instant_fields, "voltage_l3_n",  (double) instants[2] / 10.0);
-				influx_field_list_append(instant_fields, "voltage_l1_l2", (double) instants[3] / 10.0);
-				influx_field_list_append(instant_fields, "voltage_l3_l2", (double) instants[4] / 10.0);
-				influx_field_list_append(instant_fields, "voltage_l1_l3", (double) instants[5] / 10.0);
-
-				/* currents */
-				influx_field_list_append(instant_fields, "current_l1", (double) instants[6] / 100.0);
-				influx_field_list_append(instant_fields, "current_l2", (double) instants[7] / 100.0);
-				influx_field_list_append(instant_fields, "current_l3", (double) instants[8] / 100.0);
-				influx_field_list_append(instant_fields, "current_n",  (double) instants[9] / 100.0);
-
-				/* active power */
-				influx_field_list_append(instant_fields, "active_tot", (double) ((int32_t) instants[10]) / 100.0);
-				influx_field_list_append(instant_fields, "active_l1",  (double) ((int32_t) instants[11]) / 100.0);
-				influx_field_list_append(instant_fields, "active_l2",  (double) ((int32_t) instants[12]) / 100.0);
-				influx_field_list_append(instant_fields, "active_l3",  (double) ((int32_t) instants[13]) / 100.0);
-
-				/*
-				 * total energy accumulators
-				 */
-
-				influx_field_list_append(total_fields, "import",   (double) ((uint64_t) totals[ 0]) / 100.00);
-				influx_field_list_append(total_fields, "export",   (double) ((uint64_t) totals[ 1]) / 100.00);
-				influx_field_list_append(total_fields, "netto",    (double) (( int64_t) totals[ 2]) / 100.00);
-				influx_field_list_append(total_fields, "currency", (double) ((uint64_t) totals[13]) / 1000.0);
-
-				/*
-				 * per-phase energy accumulators
-				 */
-
-				influx_field_list_append(phase_fields, "import_l1", (double) ((uint64_t) phases[0]) / 100.00);
-				influx_field_list_append(phase_fields, "import_l2", (double) ((uint64_t) phases[1]) / 100.00);
-				influx_field_list_append(phase_fields, "import_l3", (double) ((uint64_t) phases[2]) / 100.00);
-				influx_field_list_append(phase_fields, "export_l1", (double) ((uint64_t) phases[3]) / 100.00);
-				influx_field_list_append(phase_fields, "export_l2", (double) ((uint64_t) phases[4]) / 100.00);
-				influx_field_list_append(phase_fields, "export_l3", (double) ((uint64_t) phases[5]) / 100.00);
-				influx_field_list_append(phase_fields, "netto_l1",  (double) ((uint64_t) phases[6]) / 100.00);
-				influx_field_list_append(phase_fields, "netto_l2",  (double) ((uint64_t) phases[7]) / 100.00);
-				influx_field_list_append(phase_fields, "netto_l3",  (double) ((uint64_t) phases[8]) / 100.00);
-
-				/* create compact lists */
-				compact_instants = influx_field_list_compact(instant_fields);
-				compact_totals   = influx_field_list_compact(total_fields);
-				compact_phases   = influx_field_list_compact(phase_fields);
-
-				influx_field_list_destroy(instant_fields);
-				influx_field_list_destroy(total_fields);
-				influx_field_list_destroy(phase_fields);
-
-				line_instant = influx_writer_line("instant",           tags, compact_instants, FLUX_PRC);
-				line_total   = influx_writer_line("accumulator_total", tags, compact_totals,   FLUX_PRC);
-				line_phase   = influx_writer_line("accumulator_phase", tags, compact_phases,   FLUX_PRC);
-
-				lines = fstringa(lines, "%s%s", *lines ? "\n" : "", line_instant);
-				lines = fstringa(lines, "%s%s", *lines ? "\n" : "", line_total);
-				lines = fstringa(lines, "%s%s", *lines ? "\n" : "", line_phase);
-
-				influx_field_compact_free(compact_instants);
-				influx_field_compact_free(compact_totals);
-				influx_field_compact_free(compact_phases);
-
-				free(tag.value);
-				free(line_instant);
-				free(line_total);
-				free(line_phase);
+				fprintf(stderr, "%s: reloaded\n", config_file);
 			}
-		} /* <-- for (electricity meters) */
 
-		/*
-		 * upload this interval's metrics to influxdb:
-		 */
-		if (1) {
-			const char *l[] = { lines, NULL };
+			continue;
+		}
 
-			int ret = influx_writer_write(writer, l, NULL);
+		if (read(sfd, &si, sizeof(si)) != (ssize_t) sizeof(si))
+			continue;
 
-			if (ret < 0)
-				perror("influx_writer_write");
+		if (si.ssi_signo != SIGHUP)
+		{
+			fprintf(stderr, "%s, shutting down\n", strsignal((int) si.ssi_signo));
+			quit = 1;
 		}
 
-		free(lines);
+		/* one reload at a time; the buses switch over on their next tick */
+		else if (pending > 0)
+			fprintf(stderr, "%s: still switching to the last reload, try again\n", config_file);
+
+		else if ((next = reload(config_file, cfg, bus, names, &pending)) != NULL)
+		{
+			retired = loaded;
+			cfg     = loaded = next;
+
+			/* buses that no longer poll have switched already */
+			if (pending == 0)
+			{
+				config_free(retired);
+				retired = NULL;
+
+				fprintf(stderr, "%s: reloaded\n", config_file);
+			}
+		}
 	}
+
+	rc = EXIT_SUCCESS;
+
+	/* every exit after the configuration is loaded ends up here */
+out:
+	/* every bus finishes the tick it is in */
+	for (size_t b=0; b < opened; b++)
+		bus_stop(&bus[b]);
+
+	if (epfd != -1)
+		close(epfd);
+
+	if (sfd != -1)
+		close(sfd);
+
+	/* spools (or posts) what is still queued */
+	if (uploading)
+		uploader_stop(&uploader);
+
+	spool_close(spool);
+
+	influx_writer_destroy(writer);
+
+	for (size_t b=0; b < opened; b++)
+		bus_close(&bus[b]);
+
+	influx_names_destroy(names);
+
+	free(bus);
+	config_free(retired);
+	config_free(loaded);
+
+	return rc;
 }
@@ -0,0 +1,585 @@
+
+/*
+ * regmap.c
+ * lucas@pamorana.net (2024)
+ *
+ * Table-driven decoding of modbus register blocks.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*---------------------------------------------------------------------------*\
+|*                                  HEADERS                                  *|
+\*---------------------------------------------------------------------------*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "regmap.h"
+
+
+/*---------------------------------------------------------------------------*\
+|*                               REGISTER  MAP                               *|
+\*---------------------------------------------------------------------------*/
+
+/*
+ * regmap_read_cost:
+ *   estimated bus time in microseconds for reading "count" registers.
+ */
+uint32_t regmap_read_cost (const struct reg_cost *cost, unsigned count)
+{
+	uint64_t bytes  = RTU_REQUEST_BYTES + RTU_RESPONSE_BYTES + 2U * count;
+	uint64_t wire   = bytes * cost->char_bits * 1000000U / cost->baud;
+	uint64_t silent;
+
+	/*
+	 * the spec fixes t3,5 at 1750 us for baud rates
+	 * above 19200, otherwise it's 3,5 character times.
+	 */
+	if (cost->baud > 19200)
+		silent = 1750U;
+	else
+		silent = 7U * cost->char_bits * 1000000U / (2U * cost->baud);
+
+	return (uint32_t) (wire + 2U * silent + cost->turnaround_us);
+}
+
+
+/* a run of wanted registers that has to be read as a whole */
+struct wanted
+{
+	uint32_t addr;
+	uint32_t end;
+};
+
+static const struct reg_table *sort_table;
+
+static int cmp_def_addr (const void *a, const void *b)
+{
+	const struct reg_def
+		*x = &sort_table->defs[*(const uint16_t *) a],
+		*y = &sort_table->defs[*(const uint16_t *) b];
+
+	return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+/* if allowed by the meter, returns 1 if [addr, end) can be read at once */
+static int readable (const struct reg_table *t, uint32_t addr, uint32_t end)
+{
+	if (t->nreadable == 0)
+		return 1;
+
+	for (size_t k=0; k < t->nreadable; k++)
+		if (addr >= t->readable[k].addr
+		&&  end  <= (uint32_t) t->readable[k].addr + t->readable[k].count
+		)
+			return 1;
+
+	return 0;
+}
+
+
+/*
+ * plan_reads:
+ *   choose the cheapest partition of the (address ordered) wanted runs
+ *   into read transactions. since reads never reorder, the optimal plan
+ *   only merges neighbouring runs, which makes it a shortest path problem
+ *   over the run boundaries: best[j] is the cheapest way to cover runs
+ *   [0, j), and every read [i, j) is an edge from best[i] to best[j].
+ *
+ *   returns the number of reads written to "reads", or -1.
+ */
+static int plan_reads
+(
+	const struct reg_table *t,
+	const struct reg_cost  *cost,
+	const struct wanted    *w,
+	size_t                  nw,
+	struct reg_read        *reads
+)
+{
+	uint64_t *best;
+	size_t   *from;
+	size_t    nreads = 0;
+
+	best = calloc(nw + 1, sizeof(uint64_t));
+	from = calloc(nw + 1, sizeof(size_t));
+
+	if (!best || !from)
+	{
+		free(best);
+		free(from);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (size_t j=1; j <= nw; j++)
+	{
+		best[j] = UINT64_MAX;
+
+		for (size_t i=j; i-- > 0;)
+		{
+			uint32_t len = w[j - 1].end - w[i].addr;
+
+			/* reads only grow from here on */
+			if (len > cost->max_read || !readable(t, w[i].addr, w[j - 1].end))
+				break;
+
+			if (best[i] != UINT64_MAX && best[i] + regmap_read_cost(cost, len) < best[j])
+			{
+				best[j] = best[i] + regmap_read_cost(cost, len);
+				from[j] = i;
+			}
+		}
+
+		if (best[j] == UINT64_MAX)
+		{
+			free(best);
+			free(from);
+			errno = ERANGE;
+			return -1;
+		}
+	}
+
+	/* walk the path backwards, then put the reads in address order */
+	for (size_t j=nw; j > 0; j = from[j])
+	{
+		struct reg_read *r = &reads[nreads++];
+
+		r->addr    = (uint16_t)  w[from[j]].addr;
+		r->count   = (uint16_t) (w[j - 1].end - w[from[j]].addr);
+		r->cost_us = regmap_read_cost(cost, r->count);
+	}
+
+	for (size_t i=0; i < nreads / 2; i++)
+	{
+		struct reg_read tmp = reads[i];
+
+		reads[i] = reads[nreads - 1 - i];
+		reads[nreads - 1 - i] = tmp;
+	}
+
+	free(best);
+	free(from);
+
+	return (int) nreads;
+}
+
+
+/*
+ * regmap_compile:
+ *   build the runtime form of a register map from a meter table, and plan
+ *   the cheapest set of read transactions that covers every group.
+ *   "defs" must be sorted by group. the tables are borrowed, not copied.
+ *   returns NULL and sets errno on malformed tables or allocation errors,
+ *   and ERANGE if a definition can not be covered by any allowed read.
+ */
+struct reg_map *regmap_compile (const struct reg_table *t, const struct reg_cost *cost)
+{
+	struct reg_map *map;
+
+	struct wanted *w     = NULL;
+	uint16_t      *order = NULL;
+
+	size_t image = 0;
+	int    rc;
+
+	if (!t || !cost || !t->defs || !t->groups || !t->ndefs || !t->ngroups
+	||  t->ngroups > UINT8_MAX || t->ndefs > UINT16_MAX
+	||  !cost->baud || !cost->char_bits || !cost->max_read
+	){
+		errno = EINVAL;
+		return NULL;
+	}
+
+	for (size_t g=0; g < t->ngroups; g++)
+		if (t->groups[g].period_ms == 0)
+		{
+			errno = EINVAL;
+			return NULL;
+		}
+
+	if ((map = calloc(1, sizeof(struct reg_map))) == NULL)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	map->defs    = t->defs;
+	map->ndefs   = t->ndefs;
+	map->groups  = t->groups;
+	map->ngroups = t->ngroups;
+
+	map->reads  = calloc(t->ndefs,       sizeof(struct reg_read));
+	map->slots  = calloc(t->ndefs,       sizeof(struct reg_slot));
+	map->first  = calloc(t->ngroups + 1, sizeof(uint16_t));
+	map->rfirst = calloc(t->ngroups + 1, sizeof(uint16_t));
+
+	w     = calloc(t->ndefs, sizeof(struct wanted));
+	order = calloc(t->ndefs, sizeof(uint16_t));
+
+	if (!map->reads || !map->slots || !map->first || !map->rfirst || !w || !order)
+	{
+		free(w);
+		free(order);
+		regmap_free(map);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	for (size_t i=0, g=0; i < t->ndefs; i++)
+	{
+		const struct reg_def *d = &t->defs[i];
+
+		if (d->group >= t->ngroups || (i && d->group < t->defs[i - 1].group)
+		||  !(d->width == 1 || d->width == 2 || d->width == 4)
+		||  d->scale == 0
+		){
+			free(w);
+			free(order);
+			regmap_free(map);
+			errno = EINVAL;
+			return NULL;
+		}
+
+		/* close every group up to and including this one */
+		while (g <= d->group)
+			map->first[g++] = (uint16_t) i;
+
+		order[i] = (uint16_t) i;
+
+		map->slots[i].width = d->width;
+		map->slots[i].sign  = (d->flags & REG_SIGNED) ? 1 : 0;
+		map->slots[i].scale = d->scale;
+
+		if (d->flags & REG_RAW)
+			map->slots[i].type = map->slots[i].sign ? INFLUX_INTEGER : INFLUX_UNSIGNED;
+		else
+		{
+			uint32_t p = 1;
+			uint8_t  k = 0;
+
+			while (p < d->scale && p <= UINT32_MAX / 10U)
+			{
+				p *= 10U;
+				k++;
+			}
+
+			if (p == d->scale)
+			{
+				map->slots[i].type     = map->slots[i].sign ? INFLUX_FIXED : INFLUX_UFIXED;
+				map->slots[i].decimals = k;
+			}
+			else
+				map->slots[i].type = INFLUX_FLOAT;
+		}
+	}
+
+	for (size_t g = t->defs[t->ndefs - 1].group + 1U; g <= t->ngroups; g++)
+		map->first[g] = (uint16_t) t->ndefs;
+
+	/*
+	 * plan every group on its own, so a group polled at its own rate
+	 * never drags along the registers of another
+	 */
+	sort_table = t;
+
+	for (size_t g=0; g < t->ngroups; g++)
+	{
+		size_t lo = map->first[g];
+		size_t hi = map->first[g + 1];
+		size_t nw = 0;
+
+		map->rfirst[g] = (uint16_t) map->nreads;
+
+		/* collapse the definitions into address ordered, non-overlapping runs */
+		qsort(&order[lo], hi - lo, sizeof(uint16_t), cmp_def_addr);
+
+		for (size_t i=lo; i < hi; i++)
+		{
+			const struct reg_def *d = &t->defs[order[i]];
+
+			uint32_t end = (uint32_t) d->addr + d->width;
+
+			if (nw && d->addr < w[nw - 1].end)
+			{
+				if (end > w[nw - 1].end)
+					w[nw - 1].end = end;
+			}
+			else
+			{
+				w[nw].addr = d->addr;
+				w[nw].end  = end;
+				nw++;
+			}
+		}
+
+		rc = plan_reads(t, cost, w, nw, &map->reads[map->nreads]);
+
+		if (rc < 0)
+		{
+			int err = errno;
+			free(w);
+			free(order);
+			regmap_free(map);
+			errno = err;
+			return NULL;
+		}
+
+		map->nreads += (size_t) rc;
+	}
+
+	map->rfirst[t->ngroups] = (uint16_t) map->nreads;
+
+	free(w);
+
+	for (size_t r=0; r < map->nreads; r++)
+	{
+		map->reads[r].offset = (uint16_t) image;
+		image += map->reads[r].count;
+	}
+
+	map->nimage = image;
+
+	/* within a group, both lists are address ordered; match every definition to its read */
+	for (size_t g=0; g < t->ngroups; g++)
+		for (size_t i=map->first[g], r=map->rfirst[g]; i < map->first[g + 1]; i++)
+		{
+			const struct reg_def *d = &t->defs[order[i]];
+
+			while (d->addr >= map->reads[r].addr + map->reads[r].count)
+				r++;
+
+			map->slots[order[i]].offset = (uint16_t) (map->reads[r].offset + (d->addr - map->reads[r].addr));
+		}
+
+	free(order);
+
+	return map;
+}
+
+
+/*
+ * regmap_free:
+ *   deallocate a compiled register map. does nothing if map is NULL.
+ */
+void regmap_free (struct reg_map *map)
+{
+	if (map)
+	{
+		free(map->reads);
+		free(map->slots);
+		free(map->first);
+		free(map->rfirst);
+		free(map);
+	}
+}
+
+
+/*
+ * regmap_fields:
+ *   fill "fields" with the name and type of every definition, in order.
+ *   only the values change from one poll to the next. if "names" is
+ *   not NULL, the field names are interned (escaped once) in it.
+ *   returns -1 on memory allocation errors.
+ */
+int regmap_fields (const struct reg_map *map, struct influx_names *names, struct influx_fields *fields)
+{
+	influx_fields_reset(fields);
+
+	if (influx_fields_reserve(fields, map->ndefs))
+		return -1;
+
+	for (size_t i=0; i < map->ndefs; i++)
+	{
+		struct field f = \
+		{
+			.name     = map->defs[i].name,
+			.type     = (enum influx_type) map->slots[i].type,
+			.decimals = map->slots[i].decimals,
+			.value.u  = 0
+		};
+
+		if (names)
+		{
+			struct influx_key key;
+
+			if (influx_names_intern(names, f.name, INFLUX_NAME_KEY, &key))
+				return -1;
+
+			f.name    = key.str;
+			f.namelen = key.len;
+		}
+
+		influx_fields_append(fields, &f);
+	}
+
+	return 0;
+}
+
+
+/* decode the definitions [lo, hi) */
+static void decode (const struct reg_map *map, size_t lo, size_t hi, const uint16_t *image, struct field *fields)
+{
+	for (size_t i=lo; i < hi; i++)
+	{
+		const struct reg_slot *s = &map->slots[i];
+		const uint16_t        *r = &image[s->offset];
+
+		uint64_t raw = 0;
+		uint64_t msb = (uint64_t) 1 << (16 * s->width - 1);
+
+		/* in case it was left out last time, see regmap_leave_out */
+		fields[i].type = (enum influx_type) s->type;
+
+		/* most significant register first */
+		for (unsigned k=0; k < s->width; k++)
+			raw = (raw << 16) | r[k];
+
+		/* sign-extend to 64 bits */
+		if (s->sign)
+			raw = (raw ^ msb) - msb;
+
+		/*
+		 * the integer types and the fixed-point ones all take the
+		 * integer as is; only odd scales go through a division.
+		 */
+		if (s->type == INFLUX_FLOAT)
+		{
+			if (s->sign)
+				fields[i].value.f = (double) (int64_t) raw / (double) s->scale;
+			else
+				fields[i].value.f = (double) raw / (double) s->scale;
+		}
+		else
+			fields[i].value.u = raw;
+	}
+}
+
+
+/*
+ * regmap_decode:
+ *   decode every definition in "map" from the register image "image"
+ *   into the values of "fields" (map->ndefs elements), as initialized by
+ *   "regmap_fields".
+ */
+void regmap_decode (const struct reg_map *map, const uint16_t *image, struct field *fields)
+{
+	decode(map, 0, map->ndefs, image, fields);
+}
+
+
+/*
+ * regmap_decode_group:
+ *   like "regmap_decode", for the definitions of group "g" only.
+ */
+void regmap_decode_group (const struct reg_map *map, size_t g, const uint16_t *image, struct field *fields)
+{
+	decode(map, map->first[g], map->first[g + 1], image, fields);
+}
+
+
+/*
+ * regmap_leave_out:
+ *   leave the definitions of group "g" that are read by its reads from "r"
+ *   on out of "fields", e.g. because read "r" failed, by setting their type
+ *   to INFLUX_TYPE_END; influx_template_render skips them. the next decode
+ *   of the group puts them back. returns the number of fields left out.
+ */
+size_t regmap_leave_out (const struct reg_map *map, size_t g, size_t r, struct field *fields)
+{
+	size_t n = 0;
+
+	/* the image is laid out in the order of the reads */
+	for (size_t i=map->first[g]; i < map->first[g + 1]; i++)
+		if (map->slots[i].offset >= map->reads[r].offset)
+		{
+			fields[i].type = INFLUX_TYPE_END;
+			n++;
+		}
+
+	return n;
+}
+
+
+/*
+ * regmap_group_cost:
+ *   estimated bus time in microseconds for reading group "g".
+ */
+uint32_t regmap_group_cost (const struct reg_map *map, size_t g)
+{
+	uint32_t cost = 0;
+
+	for (size_t r=map->rfirst[g]; r < map->rfirst[g + 1]; r++)
+		cost += map->reads[r].cost_us;
+
+	return cost;
+}
+
+
+/*
+ * regmap_print_plan:
+ *   write a human readable description of the planned reads to "fp".
+ */
+void regmap_print_plan (FILE *fp, const struct reg_map *map)
+{
+	size_t wanted = 0;
+	double load   = 0;
+
+	for (size_t i=0; i < map->ndefs; i++)
+		wanted += map->defs[i].width;
+
+	fprintf(fp, "%4s  %-18s  %-6s  %5s  %5s  %9s\n", "read", "group", "addr", "count", "bytes", "cost [ms]");
+
+	for (size_t g=0; g < map->ngroups; g++)
+		for (size_t r=map->rfirst[g]; r < map->rfirst[g + 1]; r++)
+		{
+			const struct reg_read *rd = &map->reads[r];
+
+			fprintf(fp, "%4zu  %-18s  0x%04X  %5u  %5u  %9.2f\n",
+				r,
+				map->groups[g].measurement,
+				rd->addr,
+				rd->count,
+				RTU_REQUEST_BYTES + RTU_RESPONSE_BYTES + 2U * rd->count,
+				rd->cost_us / 1000.0
+			);
+		}
+
+	fprintf(fp, "%zu reads, %zu registers (%zu wanted)\n\n", map->nreads, map->nimage, wanted);
+
+	fprintf(fp, "%-18s  %10s  %9s  %8s\n", "group", "period [s]", "cost [ms]", "bus load");
+
+	for (size_t g=0; g < map->ngroups; g++)
+	{
+		uint32_t cost = regmap_group_cost(map, g);
+
+		/* share of the bus taken by polling this group, per meter */
+		double share = (double) cost / 1000.0 / map->groups[g].period_ms;
+
+		fprintf(fp, "%-18s  %10.3f  %9.2f  %7.2f%%\n",
+			map->groups[g].measurement,
+			map->groups[g].period_ms / 1000.0,
+			cost / 1000.0,
+			100.0 * share
+		);
+
+		load += share;
+	}
+
+	fprintf(fp, "%.2f%% of the bus per meter\n", 100.0 * load);
+}
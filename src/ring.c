@@ -0,0 +1,134 @@
+
+/*
+ * ring.c
+ * lucas@pamorana.net (2024)
+ *
+ * Lock-free single-producer, single-consumer ring of pointers.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*---------------------------------------------------------------------------*\
+|*                                  HEADERS                                  *|
+\*---------------------------------------------------------------------------*/
+
+#include <stddef.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#include "ring.h"
+
+/*---------------------------------------------------------------------------*\
+|*                              SPSC RING QUEUE                              *|
+\*---------------------------------------------------------------------------*/
+
+/*
+ * ring_init:
+ *   allocate room for at least "size" elements, rounded up to a power of two.
+ *   returns -1 on memory allocation errors.
+ */
+int ring_init (struct ring *ring, size_t size)
+{
+	size_t cap = 1U;
+
+	while (cap < size)
+		cap *= 2U;
+
+	if ((ring->slot = calloc(cap, sizeof(void *))) == NULL)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+
+	ring->mask = cap - 1U;
+	ring->head = 0;
+	ring->tail = 0;
+
+	return 0;
+}
+
+
+/*
+ * ring_free:
+ *   deallocate the slots of "ring". the elements are not touched.
+ */
+void ring_free (struct ring *ring)
+{
+	free(ring->slot);
+	ring->slot = NULL;
+	ring->mask = 0;
+}
+
+
+/*
+ * ring_push:
+ *   [producer] append "elem" to "ring".
+ *   returns -1 with errno set to EAGAIN if the ring is full.
+ */
+int ring_push (struct ring *ring, void *elem)
+{
+	size_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	if (head - tail > ring->mask)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+
+	ring->slot[head & ring->mask] = elem;
+
+	/* publish the slot before the new head */
+	__atomic_store_n(&ring->head, head + 1U, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+
+/*
+ * ring_pop:
+ *   [consumer] remove and return the oldest element of "ring",
+ *   or NULL if it is empty.
+ */
+void *ring_pop (struct ring *ring)
+{
+	void *elem;
+
+	size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	if (tail == head)
+		return NULL;
+
+	elem = ring->slot[tail & ring->mask];
+
+	/* the slot may be reused by the producer once tail has moved */
+	__atomic_store_n(&ring->tail, tail + 1U, __ATOMIC_RELEASE);
+
+	return elem;
+}
+
+
+/*
+ * ring_count:
+ *   number of elements in "ring". exact when called by either the
+ *   producer or the consumer, a snapshot otherwise.
+ */
+size_t ring_count (const struct ring *ring)
+{
+	size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	return head - tail;
+}
@@ -0,0 +1,124 @@
+
+/*
+ * rtt.c
+ * lucas@pamorana.net (2024)
+ *
+ * Response time estimation and back-off for modbus slaves.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*---------------------------------------------------------------------------*\
+|*                                  HEADERS                                  *|
+\*---------------------------------------------------------------------------*/
+
+#include <stdint.h>
+
+#include "rtt.h"
+
+/*---------------------------------------------------------------------------*\
+|*                                 INTERFACE                                 *|
+\*---------------------------------------------------------------------------*/
+
+/*
+ * rtt_init:
+ *   start out from the turnaround "guess_us", i.e. that of the bus config.
+ */
+void rtt_init (struct rtt *r, uint32_t guess_us)
+{
+	if (guess_us < RTT_MIN_US)
+		guess_us = RTT_MIN_US;
+
+	/* as unsure as RFC 6298 is of its first sample */
+	*r = (struct rtt) { .srtt = guess_us, .rttvar = guess_us / 2U };
+}
+
+
+/*
+ * rtt_timeout:
+ *   the response timeout in microseconds of a transaction that spends
+ *   "wire_us" on the wire.
+ */
+uint32_t rtt_timeout (const struct rtt *r, uint32_t wire_us)
+{
+	uint64_t spread     = 4U * (uint64_t) r->rttvar;
+	uint64_t turnaround;
+
+	/* the "max(G, 4 * rttvar)" of RFC 6298, so a steady slave has some slack */
+	turnaround = r->srtt + ((spread > RTT_MIN_US) ? spread : RTT_MIN_US);
+
+	if (turnaround > RTT_MAX_US)
+		turnaround = RTT_MAX_US;
+
+	return (uint32_t) (wire_us + turnaround);
+}
+
+
+/*
+ * rtt_sample:
+ *   account for a successful transaction of "us" microseconds in all,
+ *   "wire_us" of which were spent on the wire. returns 1 if the slave
+ *   was gone until now, 0 otherwise.
+ */
+int rtt_sample (struct rtt *r, uint32_t us, uint32_t wire_us)
+{
+	int64_t m    = (us > wire_us + RTT_MIN_US) ? (int64_t) (us - wire_us) : RTT_MIN_US;
+	int64_t err  = m - (int64_t) r->srtt;
+	int     back = (r->fails >= RTT_DEAD);
+
+	/* rttvar += (|err| - rttvar) / 4, srtt += err / 8 */
+	r->rttvar = (uint32_t) ((int64_t) r->rttvar + (((err < 0) ? -err : err) - (int64_t) r->rttvar) / 4);
+	r->srtt   = (uint32_t) ((int64_t) r->srtt + err / 8);
+
+	r->fails = 0;
+	r->retry = 0;
+
+	return back;
+}
+
+
+/*
+ * rtt_fail:
+ *   account for a failed transaction at "now" [ns]. once the slave is
+ *   gone, it is not asked again for "base" [ns], doubled on every retry
+ *   that fails too. returns 1 if the slave is gone, 0 otherwise.
+ */
+int rtt_fail (struct rtt *r, uint64_t now, uint64_t base)
+{
+	uint32_t shift;
+
+	r->fails += 1U;
+
+	if (r->fails < RTT_DEAD)
+	{
+		/* maybe it is only slower than it used to be */
+		r->rttvar = (r->rttvar < RTT_MAX_US / 2U) ? 2U * r->rttvar : RTT_MAX_US;
+		return 0;
+	}
+
+	shift    = (r->fails - RTT_DEAD < RTT_BACKOFF) ? r->fails - RTT_DEAD : RTT_BACKOFF;
+	r->retry = now + (base << shift);
+
+	return 1;
+}
+
+
+/*
+ * rtt_skip:
+ *   whether the slave is gone, and not to be asked again yet at "now" [ns].
+ */
+int rtt_skip (const struct rtt *r, uint64_t now)
+{
+	return (r->fails >= RTT_DEAD && now < r->retry);
+}
@@ -0,0 +1,153 @@
+
+/*
+ * sched.c
+ * lucas@pamorana.net (2024)
+ *
+ * Earliest-deadline-first scheduling of periodic bus jobs.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*---------------------------------------------------------------------------*\
+|*                                  HEADERS                                  *|
+\*---------------------------------------------------------------------------*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "sched.h"
+
+/*---------------------------------------------------------------------------*\
+|*                                 SCHEDULE                                  *|
+\*---------------------------------------------------------------------------*/
+
+static uint64_t gcd (uint64_t a, uint64_t b)
+{
+	while (b)
+	{
+		uint64_t t = a % b;
+
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+
+/*
+ * sched_add:
+ *   add a job running every "period_ns" nanoseconds, estimated to take
+ *   "cost_us" microseconds of bus time. "s" must be zeroed before the
+ *   first call. returns -1 and sets errno on errors.
+ */
+int sched_add (struct sched *s, uint16_t meter, uint8_t group, uint64_t period_ns, uint32_t cost_us)
+{
+	if (!s || !period_ns)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (s->njobs == s->capjobs)
+	{
+		size_t            cap  = s->capjobs ? 2 * s->capjobs : 16;
+		struct sched_job *jobs = realloc(s->jobs, cap * sizeof(struct sched_job));
+
+		if (jobs == NULL)
+		{
+			errno = ENOMEM;
+			return -1;
+		}
+
+		s->jobs    = jobs;
+		s->capjobs = cap;
+	}
+
+	s->jobs[s->njobs++] = (struct sched_job) \
+	{
+		.period  = period_ns,
+		.cost_us = cost_us,
+		.meter   = meter,
+		.group   = group
+	};
+
+	s->tick = gcd(s->tick, period_ns);
+
+	return 0;
+}
+
+
+/*
+ * sched_next:
+ *   the job released at "now" [ns] with the earliest deadline, that fits
+ *   in "budget_us" microseconds. returns NULL if there is none.
+ *
+ *   a bus carries a few dozen jobs at most, so a linear scan beats
+ *   keeping a heap in order.
+ */
+struct sched_job *sched_next (struct sched *s, uint64_t now, uint64_t budget_us)
+{
+	struct sched_job *best = NULL;
+
+	for (size_t i=0; i < s->njobs; i++)
+	{
+		struct sched_job *job = &s->jobs[i];
+
+		if (job->release > now || job->cost_us > budget_us)
+			continue;
+
+		/* on a tie, the job added first goes first */
+		if (!best || job->release + job->period < best->release + best->period)
+			best = job;
+	}
+
+	return best;
+}
+
+
+/*
+ * sched_done:
+ *   mark "job" as run at "now" [ns], and release it again at the start of
+ *   its next period. returns the number of periods it missed.
+ */
+uint64_t sched_done (struct sched_job *job, uint64_t now)
+{
+	uint64_t next   = (now / job->period + 1U) * job->period;
+	uint64_t missed = 0;
+
+	/* a late job is not run again to catch up; its lost periods are counted */
+	if (job->release)
+		missed = (next - job->release) / job->period - 1U;
+
+	job->release  = next;
+	job->runs    += 1U;
+	job->missed  += missed;
+
+	return missed;
+}
+
+
+/*
+ * sched_free:
+ *   deallocate the jobs of "s".
+ */
+void sched_free (struct sched *s)
+{
+	free(s->jobs);
+
+	*s = (struct sched) { 0 };
+}
@@ -0,0 +1,688 @@
+
+/*
+ * spool.c
+ * lucas@pamorana.net (2024)
+ *
+ * Segmented on-disk spool of undelivered line protocol batches.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*---------------------------------------------------------------------------*\
+|*                                  HEADERS                                  *|
+\*---------------------------------------------------------------------------*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* for the record checksums */
+#include <zlib.h>
+
+#include "influx.h"
+#include "spool.h"
+
+/*---------------------------------------------------------------------------*\
+|*                                  RECORDS                                  *|
+\*---------------------------------------------------------------------------*/
+
+#define SPOOL_SUFFIX ".seg"
+
+/* 16 hex digits, the suffix and a null-byte */
+#define SPOOL_NAMELEN (16 + sizeof(SPOOL_SUFFIX))
+
+/*
+ * record_size:
+ *   bytes taken up by a record with "len" bytes of payload.
+ */
+static size_t record_size (size_t len)
+{
+	return (sizeof(struct spool_record) + len + SPOOL_ALIGN - 1U) & ~(size_t) (SPOOL_ALIGN - 1U);
+}
+
+
+/*
+ * record_crc:
+ *   checksum of a record header (all but "magic" and "crc") and "payload".
+ */
+static uint32_t record_crc (const struct spool_record *rec, const char *payload)
+{
+	uLong crc = crc32(0L, Z_NULL, 0);
+
+	crc = crc32(crc, (const Bytef *) &rec->len,   sizeof(rec->len));
+	crc = crc32(crc, (const Bytef *) &rec->lines, sizeof(rec->lines));
+	crc = crc32(crc, (const Bytef *) payload,     rec->len);
+
+	return (uint32_t) crc;
+}
+
+
+/*
+ * record_at:
+ *   the record at offset "off" of "seg", or NULL if there is no valid
+ *   record there (the end of the segment, or a torn write).
+ */
+static struct spool_record *record_at (const struct spool_segment *seg, size_t off)
+{
+	struct spool_record *rec;
+
+	if (seg->size - off < sizeof(struct spool_record))
+		return NULL;
+
+	rec = (struct spool_record *) &seg->map[off];
+
+	if (rec->magic != SPOOL_LIVE && rec->magic != SPOOL_DONE)
+		return NULL;
+
+	if (rec->len > seg->size - off - sizeof(struct spool_record))
+		return NULL;
+
+	if (rec->crc != record_crc(rec, (const char *) &rec[1]))
+		return NULL;
+
+	return rec;
+}
+
+/*---------------------------------------------------------------------------*\
+|*                                 SEGMENTS                                  *|
+\*---------------------------------------------------------------------------*/
+
+/*
+ * segment_path:
+ *   write the file name of segment "seq" to "name".
+ */
+static void segment_path (char name[static SPOOL_NAMELEN], uint64_t seq)
+{
+	snprintf(name, SPOOL_NAMELEN, "%016" PRIx64 SPOOL_SUFFIX, seq);
+}
+
+
+/*
+ * segment_touch:
+ *   note that [lo, hi) of "seg" has been modified.
+ */
+static void segment_touch (struct spool *sp, struct spool_segment *seg, size_t lo, size_t hi)
+{
+	if (seg->dirty_hi == 0)
+	{
+		seg->dirty_lo = lo;
+		seg->dirty_hi = hi;
+	}
+	else
+	{
+		if (lo < seg->dirty_lo) seg->dirty_lo = lo;
+		if (hi > seg->dirty_hi) seg->dirty_hi = hi;
+	}
+
+	sp->dirty += hi - lo;
+}
+
+
+/*
+ * segment_flush:
+ *   write the modified pages of "seg" to disk.
+ */
+static int segment_flush (struct spool_segment *seg)
+{
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	size_t lo;
+
+	if (seg->dirty_hi == 0)
+		return 0;
+
+	lo = seg->dirty_lo & ~(page - 1U);
+
+	if (msync(&seg->map[lo], seg->dirty_hi - lo, MS_SYNC) == -1)
+		return -1;
+
+	seg->dirty_lo = 0;
+	seg->dirty_hi = 0;
+
+	return 0;
+}
+
+
+/*
+ * segment_seal:
+ *   stop appending to "seg", and give back the preallocated space.
+ */
+static void segment_seal (struct spool_segment *seg)
+{
+	if (seg->sealed)
+		return;
+
+	if (segment_flush(seg) == -1)
+		perror("spool: msync");
+
+	/* the map stays as it is, nothing past "used" is touched again */
+	if (ftruncate(seg->fd, (off_t) seg->used) == -1)
+		perror("spool: ftruncate");
+
+	seg->sealed = 1;
+}
+
+
+/*
+ * segment_remove:
+ *   unmap and delete the segment at index "i", with everything in it.
+ */
+static void segment_remove (struct spool *sp, size_t i)
+{
+	struct spool_segment *seg = &sp->segs[i];
+
+	char name[SPOOL_NAMELEN];
+
+	segment_path(name, seg->seq);
+
+	sp->bytes   -= seg->used;
+	sp->records -= seg->live;
+
+	munmap(seg->map, seg->size);
+	close(seg->fd);
+
+	if (unlinkat(sp->dirfd, name, 0) == -1)
+		perror("spool: unlink");
+
+	memmove(&sp->segs[i], &sp->segs[i + 1], (sp->nsegs - i - 1U) * sizeof(struct spool_segment));
+	sp->nsegs--;
+}
+
+
+/*
+ * segment_slot:
+ *   make room for one more segment at the end of sp->segs.
+ */
+static struct spool_segment *segment_slot (struct spool *sp)
+{
+	if (sp->nsegs == sp->capsegs)
+	{
+		size_t cap = sp->capsegs ? 2U * sp->capsegs : 8U;
+		void  *tmp = realloc(sp->segs, cap * sizeof(struct spool_segment));
+
+		if (tmp == NULL)
+		{
+			errno = ENOMEM;
+			return NULL;
+		}
+
+		sp->segs    = tmp;
+		sp->capsegs = cap;
+	}
+
+	return memset(&sp->segs[sp->nsegs], 0, sizeof(struct spool_segment));
+}
+
+
+/*
+ * segment_create:
+ *   start a new segment of "size" bytes, with disk space allocated up front,
+ *   so a full disk is noticed here, and not as a fault writing to the map.
+ */
+static struct spool_segment *segment_create (struct spool *sp, size_t size)
+{
+	struct spool_segment *seg;
+
+	char name[SPOOL_NAMELEN];
+
+	int rc;
+
+	if ((seg = segment_slot(sp)) == NULL)
+		return NULL;
+
+	seg->seq = sp->next_seq;
+
+	segment_path(name, seg->seq);
+
+	if ((seg->fd = openat(sp->dirfd, name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0640)) == -1)
+		return NULL;
+
+	if ((rc = posix_fallocate(seg->fd, 0, (off_t) size)) != 0)
+	{
+		close(seg->fd);
+		unlinkat(sp->dirfd, name, 0);
+		errno = rc;
+		return NULL;
+	}
+
+	seg->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+
+	if (seg->map == MAP_FAILED)
+	{
+		close(seg->fd);
+		unlinkat(sp->dirfd, name, 0);
+		return NULL;
+	}
+
+	/* make the new name durable */
+	fsync(sp->dirfd);
+
+	seg->size = size;
+
+	sp->next_seq++;
+	sp->nsegs++;
+
+	return seg;
+}
+
+
+/*
+ * segment_load:
+ *   map an existing segment and find the records that are still live.
+ *   returns 0 without adding it if the segment has nothing left in it.
+ */
+static int segment_load (struct spool *sp, uint64_t seq)
+{
+	struct spool_segment *seg;
+	struct spool_record  *rec;
+	struct stat           st;
+
+	char name[SPOOL_NAMELEN];
+
+	if ((seg = segment_slot(sp)) == NULL)
+		return -1;
+
+	seg->seq    = seq;
+	seg->sealed = 1;
+
+	segment_path(name, seq);
+
+	if ((seg->fd = openat(sp->dirfd, name, O_RDWR | O_CLOEXEC)) == -1)
+		return -1;
+
+	if (fstat(seg->fd, &st) == -1)
+	{
+		close(seg->fd);
+		return -1;
+	}
+
+	if (st.st_size > 0)
+	{
+		seg->size = (size_t) st.st_size;
+		seg->map  = mmap(NULL, seg->size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+
+		if (seg->map == MAP_FAILED)
+		{
+			close(seg->fd);
+			return -1;
+		}
+
+		/* done records all come before the live ones */
+		for (seg->used = 0; (rec = record_at(seg, seg->used)); seg->used += record_size(rec->len))
+		{
+			if (rec->magic == SPOOL_LIVE)
+				seg->live++;
+			else
+				seg->head = seg->used + record_size(rec->len);
+		}
+	}
+
+	sp->nsegs++;
+	sp->bytes   += seg->used;
+	sp->records += seg->live;
+
+	if (seg->live == 0)
+		segment_remove(sp, sp->nsegs - 1U);
+
+	return 0;
+}
+
+
+/*
+ * compare_seq:
+ *   qsort comparator for segment sequence numbers.
+ */
+static int compare_seq (const void *a, const void *b)
+{
+	const uint64_t x = *(const uint64_t *) a;
+	const uint64_t y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/*---------------------------------------------------------------------------*\
+|*                                 INTERFACE                                 *|
+\*---------------------------------------------------------------------------*/
+
+/*
+ * spool_open:
+ *   open (and create, if needed) the spool in directory "dir", and recover
+ *   the records left in it. returns NULL and sets errno on errors.
+ */
+struct spool *spool_open (const char *dir, const struct spool_config *config)
+{
+	struct spool  *sp;
+	struct dirent *ent;
+	DIR           *dp;
+
+	uint64_t *seqs = NULL;
+	size_t    nseq = 0;
+	size_t    cap  = 0;
+
+	if (!dir || !config || !config->segment_bytes || config->segment_bytes > config->max_bytes)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (mkdir(dir, 0750) == -1 && errno != EEXIST)
+		return NULL;
+
+	if ((sp = calloc(1, sizeof(struct spool))) == NULL)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	sp->config = *config;
+
+	if ((sp->dir = strdup(dir)) == NULL)
+	{
+		free(sp);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if ((sp->dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1
+	||  (dp = opendir(dir)) == NULL
+	){
+		int olderrno = errno;
+
+		if (sp->dirfd != -1)
+			close(sp->dirfd);
+
+		free(sp->dir);
+		free(sp);
+		errno = olderrno;
+		return NULL;
+	}
+
+	/* collect the sequence numbers of the segments left behind */
+	while ((ent = readdir(dp)))
+	{
+		char     *end;
+		uint64_t  seq;
+
+		if (strlen(ent->d_name) != SPOOL_NAMELEN - 1U)
+			continue;
+
+		seq = strtoull(ent->d_name, &end, 16);
+
+		if (end != &ent->d_name[16] || strcmp(end, SPOOL_SUFFIX) != 0)
+			continue;
+
+		if (nseq == cap)
+		{
+			void *tmp = realloc(seqs, (cap = cap ? 2U * cap : 16U) * sizeof(uint64_t));
+
+			if (tmp == NULL)
+			{
+				closedir(dp);
+				free(seqs);
+				spool_close(sp);
+				errno = ENOMEM;
+				return NULL;
+			}
+
+			seqs = tmp;
+		}
+
+		seqs[nseq++] = seq;
+	}
+
+	closedir(dp);
+
+	if (nseq)
+		qsort(seqs, nseq, sizeof(uint64_t), compare_seq);
+
+	for (size_t i=0; i < nseq; i++)
+	{
+		if (segment_load(sp, seqs[i]) == -1)
+		{
+			int olderrno = errno;
+			free(seqs);
+			spool_close(sp);
+			errno = olderrno;
+			return NULL;
+		}
+
+		sp->next_seq = seqs[i] + 1U;
+	}
+
+	free(seqs);
+
+	return sp;
+}
+
+
+/*
+ * spool_close:
+ *   flush and close the spool. does nothing if sp is NULL.
+ */
+void spool_close (struct spool *sp)
+{
+	if (sp)
+	{
+		while (sp->nsegs)
+		{
+			struct spool_segment *seg = &sp->segs[sp->nsegs - 1U];
+
+			/* a segment with nothing left in it has no reason to stay */
+			if (seg->live == 0)
+			{
+				segment_remove(sp, sp->nsegs - 1U);
+				continue;
+			}
+
+			segment_seal(seg);
+			munmap(seg->map, seg->size);
+			close(seg->fd);
+
+			sp->nsegs--;
+		}
+
+		if (sp->dirfd != -1)
+			close(sp->dirfd);
+
+		free(sp->segs);
+		free(sp->dir);
+		free(sp);
+	}
+}
+
+
+/*
+ * spool_append:
+ *   store "len" bytes of line protocol ("lines" lines), evicting the oldest
+ *   segments if the spool is full. returns -1 and sets errno on errors,
+ *   EFBIG if the record alone is larger than "max_bytes".
+ */
+int spool_append (struct spool *sp, const char *data, size_t len, size_t lines)
+{
+	struct spool_segment *seg = NULL;
+	struct spool_record   rec;
+
+	size_t size = record_size(len);
+
+	if (size > sp->config.max_bytes || len > UINT32_MAX || lines > UINT32_MAX)
+	{
+		errno = EFBIG;
+		return -1;
+	}
+
+	if (sp->nsegs)
+		seg = &sp->segs[sp->nsegs - 1U];
+
+	if (!seg || seg->sealed || seg->size - seg->used < size)
+	{
+		if (seg)
+			segment_seal(seg);
+
+		seg = segment_create(sp, (size > sp->config.segment_bytes) ? size : sp->config.segment_bytes);
+
+		if (seg == NULL)
+			return -1;
+	}
+
+	/* the newest segment always fits within "max_bytes" on its own */
+	while (sp->bytes + size > sp->config.max_bytes && sp->nsegs > 1U)
+	{
+		sp->evicted += sp->segs[0].live;
+		segment_remove(sp, 0);
+	}
+
+	/* "seg" may have moved */
+	seg = &sp->segs[sp->nsegs - 1U];
+
+	rec.magic = SPOOL_LIVE;
+	rec.len   = (uint32_t) len;
+	rec.lines = (uint32_t) lines;
+	rec.crc   = record_crc(&rec, data);
+
+	/*
+	 * payload first, header last: a record that is torn
+	 * by a crash has no valid magic, and ends the segment.
+	 */
+	memcpy(&seg->map[seg->used + sizeof(rec)], data, len);
+	memcpy(&seg->map[seg->used], &rec, sizeof(rec));
+
+	segment_touch(sp, seg, seg->used, seg->used + size);
+
+	seg->used   += size;
+	seg->live   += 1U;
+	sp->bytes   += size;
+	sp->records += 1U;
+
+	/* the record is in the page cache either way; a failed sync is not fatal */
+	if (sp->dirty >= sp->config.sync_bytes && spool_sync(sp) == -1)
+		perror("spool: msync");
+
+	return 0;
+}
+
+
+/*
+ * spool_peek:
+ *   copy the oldest records into "out" (which is reset first), as long as
+ *   they fit in "max" bytes, but at least one. returns the number of records
+ *   copied, 0 if the spool is empty, or -1 on errors. the records stay in
+ *   the spool until spool_consume is called.
+ */
+int spool_peek (struct spool *sp, struct influx_buffer *out, size_t max)
+{
+	int num = 0;
+
+	influx_buffer_reset(out);
+
+	sp->peek_num = 0;
+
+	for (size_t i=0; i < sp->nsegs; i++)
+	{
+		struct spool_segment *seg = &sp->segs[i];
+		size_t                off = seg->head;
+
+		while (off < seg->used)
+		{
+			const struct spool_record *rec = (const struct spool_record *) &seg->map[off];
+
+			if (num > 0 && out->len + rec->len > max)
+				return num;
+
+			if (influx_buffer_reserve(out, rec->len))
+				return -1;
+
+			memcpy(&out->mem[out->len], &rec[1], rec->len);
+
+			out->len   += rec->len;
+			out->lines += rec->lines;
+			off        += record_size(rec->len);
+
+			sp->peek_seq = seg->seq;
+			sp->peek_off = off;
+			sp->peek_num = (size_t) ++num;
+		}
+	}
+
+	return num;
+}
+
+
+/*
+ * spool_consume:
+ *   mark the records returned by the last spool_peek as done, and delete
+ *   segments that have nothing left in them.
+ */
+void spool_consume (struct spool *sp)
+{
+	size_t i = 0;
+
+	if (sp->peek_num == 0)
+		return;
+
+	while (i < sp->nsegs && sp->segs[i].seq <= sp->peek_seq)
+	{
+		struct spool_segment *seg = &sp->segs[i];
+
+		size_t end = (seg->seq == sp->peek_seq) ? sp->peek_off : seg->used;
+		size_t off = seg->head;
+
+		for (; off < end; off += record_size(((struct spool_record *) &seg->map[off])->len))
+		{
+			((struct spool_record *) &seg->map[off])->magic = SPOOL_DONE;
+
+			seg->live--;
+			sp->records--;
+		}
+
+		if (end > seg->head)
+			segment_touch(sp, seg, seg->head, end);
+
+		seg->head = end;
+
+		if (seg->live == 0 && seg->sealed)
+			segment_remove(sp, i);
+		else
+			i++;
+	}
+
+	sp->peek_num = 0;
+}
+
+
+/*
+ * spool_sync:
+ *   flush everything written since the last sync to disk.
+ *   returns -1 and sets errno on errors.
+ */
+int spool_sync (struct spool *sp)
+{
+	int rc = 0;
+
+	for (size_t i=0; i < sp->nsegs; i++)
+		if (segment_flush(&sp->segs[i]) == -1)
+			rc = -1;
+
+	if (rc == 0)
+		sp->dirty = 0;
+
+	return rc;
+}
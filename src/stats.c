@@ -0,0 +1,179 @@
+
+/*
+ * stats.c
+ * lucas@pamorana.net (2024)
+ *
+ * Latency histograms for reporting on the daemon itself.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*---------------------------------------------------------------------------*\
+|*                                  HEADERS                                  *|
+\*---------------------------------------------------------------------------*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "influx.h"
+#include "stats.h"
+
+/*---------------------------------------------------------------------------*\
+|*                                 HISTOGRAM                                 *|
+\*---------------------------------------------------------------------------*/
+
+#define HALF (1U << (HIST_SUB - 1U))
+
+/*
+ * bucket:
+ *   the bucket of "v": the exponent of its top bit, and the HIST_SUB - 1
+ *   bits below it.
+ */
+static size_t bucket (uint32_t v)
+{
+	unsigned top;
+
+	if (v < (1U << HIST_SUB))
+		return v;
+
+	top = 31U - (unsigned) __builtin_clz(v);
+
+	return (1U << HIST_SUB) + (top - HIST_SUB) * HALF + ((v >> (top - HIST_SUB + 1U)) - HALF);
+}
+
+
+/*
+ * highest:
+ *   the highest value that ends up in bucket "b".
+ */
+static uint32_t highest (size_t b)
+{
+	unsigned top;
+	unsigned shift;
+	uint64_t sub;
+
+	if (b < (1U << HIST_SUB))
+		return (uint32_t) b;
+
+	b    -= 1U << HIST_SUB;
+	top   = HIST_SUB + (unsigned) (b / HALF);
+	sub   = HALF + b % HALF;
+	shift = top - HIST_SUB + 1U;
+
+	return (uint32_t) (((sub + 1U) << shift) - 1U);
+}
+
+/*---------------------------------------------------------------------------*\
+|*                                 INTERFACE                                 *|
+\*---------------------------------------------------------------------------*/
+
+/*
+ * hist_record:
+ *   count the value "v" in "h".
+ */
+void hist_record (struct hist *h, uint32_t v)
+{
+	h->buckets[bucket(v)]++;
+
+	h->count += 1U;
+	h->sum   += v;
+
+	if (v > h->max)
+		h->max = v;
+}
+
+
+/*
+ * hist_quantile:
+ *   the value that a fraction "q" (0 to 1) of the values in "h" is at most
+ *   equal to, give or take the width of its bucket. 0 if "h" is empty.
+ */
+uint32_t hist_quantile (const struct hist *h, double q)
+{
+	uint64_t rank;
+	uint64_t seen = 0;
+
+	if (h->count == 0)
+		return 0;
+
+	/* the rank of the value wanted, counting from 1 */
+	rank = (uint64_t) (q * (double) h->count + 0.5);
+
+	if (rank < 1U)
+		rank = 1U;
+
+	for (size_t b=0; b < HIST_BUCKETS; b++)
+		if ((seen += h->buckets[b]) >= rank)
+			return (highest(b) < h->max) ? highest(b) : h->max;
+
+	return h->max;
+}
+
+
+/*
+ * hist_reset:
+ *   forget every value in "h".
+ */
+void hist_reset (struct hist *h)
+{
+	memset(h, 0, sizeof(struct hist));
+}
+
+
+/*
+ * hist_fields:
+ *   add the count, mean, median, 90th, 99th and 99.9th percentile and the
+ *   maximum of "h" to the line being encoded in "buf", as unsigned fields
+ *   whose names end in "_<unit>", i.e. "p99_us" for a "unit" of "us".
+ */
+int hist_fields (struct influx_buffer *buf, const struct hist *h, const char *unit)
+{
+	static const struct
+	{
+		const char *name;
+		double      q;
+	}
+	quantiles[] = \
+	{
+		{ "p50",  0.5   },
+		{ "p90",  0.9   },
+		{ "p99",  0.99  },
+		{ "p999", 0.999 },
+	};
+
+	char name[32];
+	int  rc = 0;
+
+	rc |= influx_line_field_uint(buf, "count", h->count);
+
+	if (h->count == 0)
+		return rc;
+
+	snprintf(name, sizeof(name), "mean_%s", unit);
+	rc |= influx_line_field_uint(buf, name, h->sum / h->count);
+
+	for (size_t i=0; i < sizeof(quantiles) / sizeof(*quantiles); i++)
+	{
+		snprintf(name, sizeof(name), "%s_%s", quantiles[i].name, unit);
+		rc |= influx_line_field_uint(buf, name, hist_quantile(h, quantiles[i].q));
+	}
+
+	snprintf(name, sizeof(name), "max_%s", unit);
+	rc |= influx_line_field_uint(buf, name, h->max);
+
+	return rc;
+}
@@ -0,0 +1,213 @@
+
+/*
+ * ticker.c
+ * lucas@pamorana.net (2024)
+ *
+ * Periodic wake-ups on absolute wall-clock deadlines.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*---------------------------------------------------------------------------*\
+|*                                  HEADERS                                  *|
+\*---------------------------------------------------------------------------*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/timerfd.h>
+
+#include "ticker.h"
+
+/*---------------------------------------------------------------------------*\
+|*                                  TICKER                                   *|
+\*---------------------------------------------------------------------------*/
+
+#define NSEC 1000000000ULL
+
+/* nanoseconds <=> timespec */
+static uint64_t ts_to_ns (const struct timespec *ts)
+{
+	return (uint64_t) ts->tv_sec * NSEC + (uint64_t) ts->tv_nsec;
+}
+
+static struct timespec ns_to_ts (uint64_t ns)
+{
+	struct timespec ts = \
+	{
+		.tv_sec  = (time_t) (ns / NSEC),
+		.tv_nsec = (long)   (ns % NSEC)
+	};
+
+	return ts;
+}
+
+
+/*
+ * arm:
+ *   schedule the first tick on the next whole multiple of the period.
+ *   the timer is cancelled if the wall clock is set, so a clock step
+ *   is noticed in ticker_read and the schedule realigned.
+ */
+static int arm (struct ticker *t)
+{
+	struct timespec   now;
+	struct itimerspec its;
+
+	if (clock_gettime(CLOCK_REALTIME, &now) == -1)
+		return -1;
+
+	t->next = ns_to_ts((ts_to_ns(&now) / t->period + 1U) * t->period);
+
+	its.it_value    = t->next;
+	its.it_interval = ns_to_ts(t->period);
+
+	return timerfd_settime(t->fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL);
+}
+
+
+/*
+ * ticker_start:
+ *   start ticking every "period_ns" nanoseconds, aligned to the wall
+ *   clock. returns -1 and sets errno on errors.
+ */
+int ticker_start (struct ticker *t, uint64_t period_ns)
+{
+	if (!t || !period_ns)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	*t = (struct ticker) { .period = period_ns };
+
+	if ((t->fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+		return -1;
+
+	/*
+	 * the default timer slack of 50 us lets the kernel defer wake-ups
+	 * to batch them with others; sampling wants them on time instead.
+	 */
+	prctl(PR_SET_TIMERSLACK, 1UL, 0UL, 0UL, 0UL);
+
+	if (arm(t) == -1)
+	{
+		close(t->fd);
+		t->fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * ticker_set:
+ *   tick every "period_ns" nanoseconds from now on, starting on the next
+ *   whole multiple of it. returns -1 and sets errno on errors.
+ */
+int ticker_set (struct ticker *t, uint64_t period_ns)
+{
+	uint64_t period = t->period;
+
+	if (!period_ns)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	t->period = period_ns;
+
+	if (arm(t) == -1)
+	{
+		int err = errno;
+
+		t->period = period;
+
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * ticker_read:
+ *   take the tick that is due, once "fd" is readable. if "deadline" is not
+ *   NULL, it is set to the time the tick was due. returns the number of
+ *   ticks missed since the last read, or -1 with errno set (EAGAIN if no
+ *   tick is due, i.e. the wall clock was set and the schedule realigned).
+ */
+int64_t ticker_read (struct ticker *t, struct timespec *deadline)
+{
+	uint64_t expirations;
+	uint64_t due;
+
+	if (read(t->fd, &expirations, sizeof(expirations)) != (ssize_t) sizeof(expirations))
+	{
+		if (errno != ECANCELED)
+			return -1;
+
+		/* the wall clock was set; start over from the new time */
+		if (arm(t) == -1)
+			return -1;
+
+		errno = EAGAIN;
+		return -1;
+	}
+
+	/* the last of the expirations is the tick being served */
+	due     = ts_to_ns(&t->next) + (expirations - 1U) * t->period;
+	t->next = ns_to_ts(due + t->period);
+
+	t->ticks  += 1U;
+	t->missed += expirations - 1U;
+
+	if (deadline)
+		*deadline = ns_to_ts(due);
+
+	return (int64_t) (expirations - 1U);
+}
+
+
+/*
+ * ticker_left:
+ *   nanoseconds until the next tick, 0 if it is already due.
+ */
+uint64_t ticker_left (const struct ticker *t)
+{
+	struct timespec now;
+	uint64_t        next = ts_to_ns(&t->next);
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	return (ts_to_ns(&now) < next) ? next - ts_to_ns(&now) : 0;
+}
+
+
+/*
+ * ticker_stop:
+ *   stop the ticker and close its timerfd.
+ */
+void ticker_stop (struct ticker *t)
+{
+	if (t->fd != -1)
+		close(t->fd);
+
+	t->fd = -1;
+}
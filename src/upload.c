@@ -0,0 +1,723 @@
+
+/*
+ * upload.c
+ * lucas@pamorana.net (2024)
+ *
+ * Upload thread between the poll loop and InfluxDB.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*---------------------------------------------------------------------------*\
+|*                                  HEADERS                                  *|
+\*---------------------------------------------------------------------------*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "influx.h"
+#include "ring.h"
+#include "spool.h"
+#include "stats.h"
+#include "upload.h"
+
+/* bytes of spooled line protocol sent per request when catching up */
+#define UPLOAD_DRAIN_MAX (1U << 20)
+
+/* [ms] writes in flight get to finish when stopping, before being spooled */
+#define UPLOAD_STOP_GRACE 3000
+
+/*---------------------------------------------------------------------------*\
+|*                               UPLOAD THREAD                               *|
+\*---------------------------------------------------------------------------*/
+
+/*
+ * owner:
+ *   the source "buf" belongs to.
+ */
+static struct upload_source *owner (struct uploader *up, const struct influx_buffer *buf)
+{
+	size_t k = 0;
+
+	while (buf <  up->sources[k].batches
+	||     buf >= up->sources[k].batches + up->sources[k].nbatches
+	)
+		k++;
+
+	return &up->sources[k];
+}
+
+
+/*
+ * next:
+ *   take the next batch to post, from the sources in turn, so a busy bus
+ *   can not starve the others. returns NULL if there is none.
+ */
+static struct influx_buffer *next (struct uploader *up)
+{
+	for (size_t k=0; k < up->nsources; k++)
+	{
+		size_t                i   = (up->turn + k) % up->nsources;
+		struct influx_buffer *buf = ring_pop(&up->sources[i].full);
+
+		if (buf)
+		{
+			up->turn = (i + 1) % up->nsources;
+			return buf;
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * verdict:
+ *   what to make of the outcome "rc" of posting "batch". returns 0 if it
+ *   was delivered, 1 if it is worth trying again later (network errors,
+ *   HTTP 429 and 5xx), and -1 if the server turned it down for good.
+ */
+static int verdict (int rc, const struct influx_buffer *batch)
+{
+	if (rc == 0)
+		return 0;
+
+	if (rc < 0)
+	{
+		perror("influx_writer_write_buffer");
+		return 1;
+	}
+
+	if (rc == 429 || rc >= 500)
+	{
+		fprintf(stderr, "influx_writer_write_buffer: HTTP %d\n", rc);
+		return 1;
+	}
+
+	fprintf(stderr, "influx_writer_write_buffer: HTTP %d, %zu lines rejected\n", rc, batch->lines);
+	return -1;
+}
+
+
+/*
+ * tally:
+ *   count the post of "buf" that just ended in "rc" (see verdict), as
+ *   measured by the writer, towards the next report.
+ */
+static void tally (struct uploader *up, const struct influx_buffer *buf, int rc)
+{
+	const struct influx_writer *w = up->writer;
+
+	hist_record(&up->posts, (w->last_us < UINT32_MAX) ? (uint32_t) w->last_us : UINT32_MAX);
+
+	up->bytes   += w->last_bytes;
+	up->retries += (buf == &up->drain);
+
+	if (rc == 0)
+		up->lines += buf->lines;
+
+	else if (rc == 1)
+		up->failed++;
+
+	else
+		up->rejected++;
+}
+
+
+/*
+ * finished:
+ *   called when a post of "buf" is over, with the result "status" of
+ *   influx_writer_write_buffer. new batches are spooled if the server
+ *   could not be reached, and go back to the acquisition thread.
+ */
+static void finished (void *arg, const struct influx_buffer *buf, int status)
+{
+	struct uploader *up = arg;
+
+	int rc = verdict(status, buf);
+
+	tally(up, buf, rc);
+
+	if (buf == &up->report)
+	{
+		up->reporting = 0;
+
+		if (rc == 1 && up->spool && spool_append(up->spool, buf->mem, buf->len, buf->lines) == -1)
+			perror("spool_append");
+
+		return;
+	}
+
+	if (buf == &up->drain)
+	{
+		up->draining = 0;
+
+		/* wait for a new batch to get through before trying again */
+		if (rc == 1)
+			up->online = 0;
+
+		/* rejected records are dropped too, or they would block the spool forever */
+		else
+			spool_consume(up->spool);
+
+		return;
+	}
+
+	/* a rejected batch still means the server is up */
+	up->online = (rc != 1);
+
+	if (rc == 1)
+	{
+		if (up->spool == NULL)
+			fprintf(stderr, "upload: no spool, %zu lines dropped\n", buf->lines);
+
+		else if (spool_append(up->spool, buf->mem, buf->len, buf->lines) == -1)
+			perror("spool_append");
+	}
+
+	/* can not fail, the ring has room for every batch */
+	ring_push(&owner(up, buf)->idle, (struct influx_buffer *) buf);
+}
+
+
+/*
+ * start:
+ *   post "buf", either right away, or asynchronously if the writer is set
+ *   up for it. returns -1 if the maximum number of writes are in flight.
+ */
+static int start (struct uploader *up, const struct influx_buffer *buf)
+{
+	if (influx_writer_fd(up->writer) == -1)
+	{
+		finished(up, buf, influx_writer_write_buffer(up->writer, buf, NULL));
+		return 0;
+	}
+
+	if (influx_writer_post(up->writer, buf, finished, up) == 0)
+		return 0;
+
+	if (errno == EAGAIN)
+		return -1;
+
+	/* nothing went out */
+	up->writer->last_us    = 0;
+	up->writer->last_bytes = 0;
+
+	finished(up, buf, -1);
+	return 0;
+}
+
+
+/*
+ * shelve:
+ *   spool every batch that has not been posted yet, instead of posting it.
+ */
+static void shelve (struct uploader *up)
+{
+	while (up->pending || (up->pending = next(up)))
+	{
+		struct influx_buffer *buf = up->pending;
+
+		if (spool_append(up->spool, buf->mem, buf->len, buf->lines) == -1)
+			perror("spool_append");
+
+		up->pending = NULL;
+
+		/* can not fail, the ring has room for every batch */
+		ring_push(&owner(up, buf)->idle, buf);
+	}
+}
+
+
+/*
+ * grace:
+ *   milliseconds left for the writes in flight when stopping, starting the
+ *   clock on the first call.
+ */
+static int grace (struct uploader *up)
+{
+	struct timespec now;
+
+	int64_t ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (!up->stopped.tv_sec && !up->stopped.tv_nsec)
+		up->stopped = now;
+
+	ms = (int64_t) (now.tv_sec  - up->stopped.tv_sec) * 1000
+	   + (int64_t) (now.tv_nsec - up->stopped.tv_nsec) / 1000000;
+
+	return (ms < UPLOAD_STOP_GRACE) ? (int) (UPLOAD_STOP_GRACE - ms) : 0;
+}
+
+
+/*
+ * drain:
+ *   start posting the oldest spooled records, at most UPLOAD_DRAIN_MAX
+ *   bytes, if the server is up. only one chunk is in flight at a time.
+ *   returns 0 if something was started.
+ */
+static int drain (struct uploader *up)
+{
+	int n;
+
+	if (!up->spool || !up->online || up->draining)
+		return -1;
+
+	if ((n = spool_peek(up->spool, &up->drain, UPLOAD_DRAIN_MAX)) <= 0)
+	{
+		if (n < 0)
+			perror("spool_peek");
+
+		return -1;
+	}
+
+	up->draining = 1;
+
+	if (start(up, &up->drain) == -1)
+	{
+		up->draining = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * report:
+ *   post the statistics since the last report, if they are due, or if
+ *   they found every write in flight before. only one report is out at
+ *   a time. returns the milliseconds until the next one is due, or -1
+ *   if there is nothing to wait for.
+ */
+static int report (struct uploader *up)
+{
+	struct timespec now;
+
+	uint64_t ns;
+
+	if (up->period == 0)
+		return -1;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	ns = (uint64_t) now.tv_sec * UINT64_C(1000000000) + (uint64_t) now.tv_nsec;
+
+	if (ns >= up->due && !up->reporting)
+	{
+		struct influx_buffer *buf = &up->report;
+
+		influx_buffer_reset    (buf);
+		influx_line_begin      (buf, STATS_MEASUREMENT);
+		influx_line_tag        (buf, "stage", "upload");
+		influx_line_field_uint (buf, "failed",   up->failed);
+		influx_line_field_uint (buf, "rejected", up->rejected);
+		influx_line_field_uint (buf, "retries",  up->retries);
+		influx_line_field_uint (buf, "lines",    up->lines);
+		influx_line_field_uint (buf, "bytes",    up->bytes);
+		hist_fields            (buf, &up->posts, "us");
+
+		if (influx_line_end(buf, &now, up->writer->precision))
+			perror("influx_line_end");
+
+		hist_reset(&up->posts);
+
+		up->failed    = 0;
+		up->rejected  = 0;
+		up->retries   = 0;
+		up->lines     = 0;
+		up->bytes     = 0;
+		up->due       = (ns / up->period + 1U) * up->period;
+		up->reporting = 1;
+	}
+
+	/* "finished" clears it, possibly before "start" returns */
+	if (up->reporting == 1)
+	{
+		up->reporting = 2;
+
+		if (start(up, &up->report) == -1)
+			up->reporting = 1;
+	}
+
+	/* a blocking post may have taken a while */
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	ns = (uint64_t) now.tv_sec * UINT64_C(1000000000) + (uint64_t) now.tv_nsec;
+
+	/* a report still out is waited for on the writer's sockets */
+	if (ns >= up->due)
+		return (up->reporting) ? -1 : 0;
+
+	return (int) ((up->due - ns + 999999U) / 1000000U);
+}
+
+
+/*
+ * uploader_main:
+ *   the upload thread. posts batches in the order they were submitted,
+ *   works through the spool in between, and sleeps in epoll_wait until
+ *   there is a new batch or a write in flight can make progress.
+ *
+ *   when stopping, nothing new is posted if there is a spool: queued
+ *   batches go straight to disk, and writes in flight get a moment to
+ *   finish before they are aborted and spooled too.
+ */
+static void *uploader_main (void *arg)
+{
+	struct uploader    *up = arg;
+	struct epoll_event  events[2];
+
+	int async = (influx_writer_fd(up->writer) != -1);
+	int stopping;
+	int timeout;
+	int n;
+
+	for (;;)
+	{
+		/* every batch pushed before "stop" was set is in a "full" ring by now */
+		stopping = __atomic_load_n(&up->stop, __ATOMIC_ACQUIRE);
+
+		if (stopping && up->spool)
+			shelve(up);
+
+		/* a batch that found every write in flight is first in line */
+		while (up->pending || (up->pending = next(up)))
+		{
+			if (start(up, up->pending) == -1)
+				break;
+
+			up->pending = NULL;
+		}
+
+		if (stopping && !up->pending && !up->writer->inflight)
+			break;
+
+		/*
+		 * one chunk at a time, so new batches never wait for the whole
+		 * backlog. a blocking post is over already; look for more work.
+		 */
+		if (!stopping && !up->pending && drain(up) == 0 && !async)
+			continue;
+
+		/* the statistics queue behind the batches, but not the spool */
+		timeout = (stopping) ? -1 : report(up);
+
+		if (timeout == 0)
+			continue;
+
+		/* one flush for everything spooled since the last time we slept */
+		if (up->spool && spool_sync(up->spool) == -1)
+			perror("spool_sync");
+
+		if (stopping && up->spool && up->writer->inflight && (timeout = grace(up)) == 0)
+		{
+			fprintf(stderr, "upload: %zu writes aborted on shutdown\n", up->writer->inflight);
+			influx_writer_cancel(up->writer);
+			continue;
+		}
+
+		if ((n = epoll_wait(up->epfd, events, 2, timeout)) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+
+			perror("epoll_wait");
+			break;
+		}
+
+		for (int i=0; i < n; i++)
+		{
+			uint64_t count;
+
+			if (events[i].data.fd == up->wake)
+			{
+				if (read(up->wake, &count, sizeof(count)) == -1 && errno != EAGAIN)
+					perror("read(eventfd)");
+			}
+			else
+				influx_writer_perform(up->writer);
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * wake:
+ *   wake the upload thread, if sleeping.
+ */
+static void wake (struct uploader *up)
+{
+	const uint64_t one = 1;
+
+	/* can only fail if the counter would overflow, and then it's awake anyway */
+	if (write(up->wake, &one, sizeof(one)) == -1 && errno != EAGAIN)
+		perror("write(eventfd)");
+}
+
+/*
+ * watch:
+ *   add "fd" to the epoll set "epfd", for reading.
+ */
+static int watch (int epfd, int fd)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+
+/*
+ * release:
+ *   deallocate everything but the thread.
+ */
+static void release (struct uploader *up)
+{
+	if (up->wake != -1)
+		close(up->wake);
+
+	if (up->epfd != -1)
+		close(up->epfd);
+
+	for (size_t k=0; up->sources && k < up->nsources; k++)
+	{
+		struct upload_source *src = &up->sources[k];
+
+		if (src->batches)
+			for (size_t i=0; i < src->nbatches; i++)
+				influx_buffer_free(&src->batches[i]);
+
+		ring_free(&src->full);
+		ring_free(&src->idle);
+		free(src->batches);
+	}
+
+	influx_buffer_free(&up->drain);
+	influx_buffer_free(&up->report);
+
+	free(up->sources);
+
+	up->wake    = -1;
+	up->epfd    = -1;
+	up->sources = NULL;
+}
+
+/*---------------------------------------------------------------------------*\
+|*                                 INTERFACE                                 *|
+\*---------------------------------------------------------------------------*/
+
+/*
+ * uploader_start:
+ *   start an upload thread posting through "writer", for "nsources"
+ *   acquisition threads with "depth" batches in circulation each. batches
+ *   that can not be delivered are stored in "spool" (if not NULL), and sent
+ *   again once the server is back. the writer and the spool belong to the
+ *   upload thread until "uploader_stop" returns. intervals are collected
+ *   into one batch within "limits", if not NULL. the posts are reported
+ *   every "stats_ms" milliseconds, never if 0.
+ *   returns -1 and sets errno on errors.
+ */
+int uploader_start (struct uploader *up, struct influx_writer *writer, struct spool *spool, size_t nsources, size_t depth, const struct upload_limits *limits, uint32_t stats_ms)
+{
+	sigset_t old_sigset;
+	sigset_t all_sigset;
+
+	struct timespec now;
+
+	int rc;
+
+	if (!up || !writer || !nsources || !depth)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	*up = (struct uploader) { .writer = writer, .spool = spool, .nsources = nsources, .wake = -1, .epfd = -1, .online = 1 };
+
+	/* without limits, every interval is posted on its own */
+	if (limits)
+		up->limits = *limits;
+
+	/* reports line up with the clock, like those of the buses */
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	up->period = stats_ms * UINT64_C(1000000);
+	up->due    = (up->period == 0) ? 0U
+	           : ((uint64_t) now.tv_sec * UINT64_C(1000000000) + (uint64_t) now.tv_nsec) / up->period * up->period + up->period;
+
+	if ((up->sources = calloc(nsources, sizeof(struct upload_source))) == NULL)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (size_t k=0; k < nsources; k++)
+	{
+		struct upload_source *src = &up->sources[k];
+
+		src->nbatches = depth;
+
+		if ((src->batches = calloc(depth, sizeof(struct influx_buffer))) == NULL
+		||  ring_init(&src->full, depth)
+		||  ring_init(&src->idle, depth)
+		){
+			release(up);
+			errno = ENOMEM;
+			return -1;
+		}
+
+		for (size_t i=0; i < depth; i++)
+			ring_push(&src->idle, &src->batches[i]);
+	}
+
+	if ((up->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1
+	||  (up->epfd = epoll_create1(EPOLL_CLOEXEC))            == -1
+	||  watch(up->epfd, up->wake)                            == -1
+	||  (influx_writer_fd(writer) != -1 && watch(up->epfd, influx_writer_fd(writer)) == -1)
+	){
+		/* errno has been set */
+		release(up);
+		return -1;
+	}
+
+	/*
+	 * signals are handled by the main thread; the upload
+	 * thread is started with (and inherits) all of them blocked.
+	 */
+	sigfillset(&all_sigset);
+	pthread_sigmask(SIG_BLOCK, &all_sigset, &old_sigset);
+
+	rc = pthread_create(&up->thread, NULL, uploader_main, up);
+
+	pthread_sigmask(SIG_SETMASK, &old_sigset, NULL);
+
+	if (rc)
+	{
+		release(up);
+		errno = rc;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * uploader_batch:
+ *   [acquisition thread "source"] the batch to encode this interval's lines
+ *   into. lines accumulate in the same batch until "uploader_commit" hands
+ *   it over. returns NULL if every batch is still waiting to be posted.
+ */
+struct influx_buffer *uploader_batch (struct uploader *up, size_t source)
+{
+	struct upload_source *src = &up->sources[source];
+
+	if (src->current == NULL && (src->current = ring_pop(&src->idle)))
+		influx_buffer_reset(src->current);
+
+	return src->current;
+}
+
+
+/*
+ * submit:
+ *   queue the current batch of "src" for posting.
+ */
+static void submit (struct uploader *up, struct upload_source *src)
+{
+	/* can not fail, the ring has room for every batch */
+	ring_push(&src->full, src->current);
+	wake(up);
+
+	src->current = NULL;
+}
+
+
+/*
+ * uploader_commit:
+ *   [acquisition thread "source"] call when an interval has been encoded.
+ *   the batch is queued for posting once it has reached one of the limits.
+ */
+void uploader_commit (struct uploader *up, size_t source)
+{
+	struct upload_source *src = &up->sources[source];
+
+	const struct upload_limits *lim   = &up->limits;
+	const struct influx_buffer *batch = src->current;
+
+	struct timespec now;
+
+	int64_t age_ms;
+
+	if (batch == NULL || batch->lines == 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	/* the age counts from the first interval with lines in it */
+	if (!src->aging)
+	{
+		src->opened = now;
+		src->aging  = 1;
+	}
+
+	age_ms = (int64_t) (now.tv_sec  - src->opened.tv_sec) * 1000
+	       + (int64_t) (now.tv_nsec - src->opened.tv_nsec) / 1000000;
+
+	if (batch->len   >= lim->max_bytes
+	||  batch->lines >= lim->max_lines
+	||  age_ms       >= (int64_t) lim->max_age_ms
+	){
+		src->aging = 0;
+		submit(up, src);
+	}
+}
+
+
+/*
+ * uploader_stop:
+ *   call once the acquisition threads are done.
+ *   spool every batch still queued, and the ones being filled, stop the
+ *   upload thread and deallocate the batches. writes in flight are given
+ *   UPLOAD_STOP_GRACE milliseconds to finish, and spooled if they don't.
+ *   without a spool, everything is posted, and waited for, instead.
+ *   the writer and the spool are left to the caller.
+ */
+void uploader_stop (struct uploader *up)
+{
+	/* whatever has been encoded goes out, limits or not */
+	for (size_t k=0; k < up->nsources; k++)
+		if (up->sources[k].current && up->sources[k].current->lines)
+			submit(up, &up->sources[k]);
+
+	__atomic_store_n(&up->stop, 1, __ATOMIC_RELEASE);
+	wake(up);
+
+	pthread_join(up->thread, NULL);
+
+	release(up);
+}
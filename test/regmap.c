@@ -0,0 +1,255 @@
+
+/*
+ * test/regmap.c
+ * lucas@pamorana.net (2024)
+ *
+ * Checks of the read planner and the register decoder, run by "make check".
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*---------------------------------------------------------------------------*\
+|*                                  HEADERS                                  *|
+\*---------------------------------------------------------------------------*/
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "influx.h"
+#include "regmap.h"
+
+/*---------------------------------------------------------------------------*\
+|*                                   TESTS                                   *|
+\*---------------------------------------------------------------------------*/
+
+/*
+ * one 4-register counter of each signedness, with a resolution of 0,01.
+ */
+static const struct reg_def defs[] = \
+{
+	{ 0x5000, 4, 0,          0, 100, "import" },
+	{ 0x5004, 4, REG_SIGNED, 0, 100, "net"    },
+};
+
+static const struct reg_group groups[] = \
+{
+	{ "energy", 1000 },
+};
+
+static const struct reg_table table = \
+{
+	.defs    = defs,
+	.groups  = groups,
+	.ndefs   = sizeof(defs) / sizeof(*defs),
+	.ngroups = sizeof(groups) / sizeof(*groups),
+};
+
+static const struct reg_cost cost = \
+{
+	.baud          = 9600,
+	.char_bits     = 11,
+	.turnaround_us = 20000,
+	.max_read      = 125,
+};
+
+
+/*
+ * check:
+ *   decode "image" and compare the line it renders to "want".
+ *   returns 0 if they are the same.
+ */
+static int check (const struct reg_map *map, struct influx_fields *fields, const uint16_t *image, const char *want)
+{
+	const struct timespec ts = { .tv_sec = 1 };
+
+	struct influx_buffer buf = { 0 };
+
+	int rc;
+
+	regmap_decode(map, image, fields->v);
+
+	influx_line_begin  (&buf, "energy");
+	influx_line_fields (&buf, fields->v, fields->num);
+	influx_line_end    (&buf, &ts, INFLUX_PRECISION_S);
+
+	if ((rc = (buf.mem == NULL || strcmp(buf.mem, want) != 0)))
+		fprintf(stderr, "want: %s\ngot:  %s\n", want, buf.mem ? buf.mem : "(nothing)");
+
+	influx_buffer_free(&buf);
+
+	return rc;
+}
+
+
+/*
+ * plan:
+ *   compile the definitions "d" of a single group with the readable
+ *   ranges "s", and compare the planned reads to "want". if "nwant" is 0,
+ *   the table can't be covered and compiling it has to fail with ERANGE.
+ *   returns 0 if the plan is the expected one.
+ */
+static int plan
+(
+	const char             *what,
+	const struct reg_def   *d,
+	size_t                  nd,
+	const struct reg_span  *s,
+	size_t                  ns,
+	const struct reg_cost  *c,
+	const struct reg_span  *want,
+	size_t                  nwant
+)
+{
+	const struct reg_table t = \
+	{
+		.defs      = d,
+		.groups    = groups,
+		.readable  = s,
+		.ndefs     = nd,
+		.ngroups   = 1,
+		.nreadable = ns,
+	};
+
+	struct reg_map *map = regmap_compile(&t, c);
+
+	int rc = 0;
+
+	if (nwant == 0)
+		rc = (map != NULL || errno != ERANGE);
+	else if (map == NULL || map->nreads != nwant)
+		rc = 1;
+	else
+		for (size_t r=0; r < nwant; r++)
+			rc |= (map->reads[r].addr != want[r].addr || map->reads[r].count != want[r].count);
+
+	if (rc)
+	{
+		fprintf(stderr, "%s: want", what);
+
+		for (size_t r=0; r < nwant; r++)
+			fprintf(stderr, " [%u, +%u)", want[r].addr, want[r].count);
+
+		fprintf(stderr, "%s\ngot: ", nwant ? "" : " ERANGE");
+
+		for (size_t r=0; map && r < map->nreads; r++)
+			fprintf(stderr, " [%u, +%u)", map->reads[r].addr, map->reads[r].count);
+
+		fprintf(stderr, "%s\n", map ? "" : " nothing");
+	}
+
+	regmap_free(map);
+
+	return rc;
+}
+
+
+/*
+ * at 9600 baud, a read costs about 43 ms of frames and gaps, while every
+ * register it carries costs about 2,3 ms: holes of up to ~18 registers
+ * are cheaper to read through than to split around.
+ */
+static int planner (void)
+{
+	static const struct reg_def narrow[] = \
+	{
+		{ 0x0000, 2, 0, 0, 1, "a" },
+		{ 0x0006, 2, 0, 0, 1, "b" },
+	};
+
+	static const struct reg_def wide[] = \
+	{
+		{ 0x0000, 2, 0, 0, 1, "a" },
+		{ 0x0040, 2, 0, 0, 1, "b" },
+	};
+
+	static const struct reg_def runs[] = \
+	{
+		{ 0x0000, 4, 0, 0, 1, "a" },
+		{ 0x0004, 4, 0, 0, 1, "b" },
+		{ 0x0008, 4, 0, 0, 1, "c" },
+		{ 0x000C, 4, 0, 0, 1, "d" },
+	};
+
+	/* the meter refuses reads across 0x0002..0x0005 */
+	static const struct reg_span apart[] = \
+	{
+		{ 0x0000, 2 },
+		{ 0x0006, 2 },
+	};
+
+	static const struct reg_span split[] = \
+	{
+		{ 0x0000, 2 },
+		{ 0x0002, 2 },
+	};
+
+	static const struct reg_span bridged[] = { { 0x0000, 8 } };
+	static const struct reg_span both[]    = { { 0x0000, 2 }, { 0x0006, 2 } };
+	static const struct reg_span far[]     = { { 0x0000, 2 }, { 0x0040, 2 } };
+	static const struct reg_span halves[]  = { { 0x0000, 8 }, { 0x0008, 8 } };
+
+	struct reg_cost small = cost;
+
+	int rc = 0;
+
+	rc |= plan("bridge", narrow, 2, NULL,  0, &cost, bridged, 1);
+	rc |= plan("split",  wide,   2, NULL,  0, &cost, far,     2);
+	rc |= plan("apart",  narrow, 2, apart, 2, &cost, both,    2);
+
+	/* a single definition that no readable range holds */
+	rc |= plan("across", runs,   1, split, 2, &cost, NULL,    0);
+
+	/* adjacent runs no longer fit in one read */
+	small.max_read = 8;
+	rc |= plan("long",   runs,   4, NULL,  0, &small, halves, 2);
+
+	/* nor does a single definition */
+	small.max_read = 2;
+	rc |= plan("wide",   runs,   1, NULL,  0, &small, NULL,   0);
+
+	return rc;
+}
+
+
+int main (void)
+{
+	/* unsigned counters with the top bit set, i.e. the all-ones "not available" */
+	static const uint16_t ones[] = { 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF };
+	static const uint16_t high[] = { 0x8000, 0x0000, 0x0000, 0x0000, 0x8000, 0x0000, 0x0000, 0x0000 };
+	static const uint16_t low[]  = { 0x0000, 0x0000, 0x0000, 0x3039, 0x0000, 0x0000, 0x0000, 0x0001 };
+
+	struct influx_fields fields = { 0 };
+	struct reg_map      *map;
+
+	int rc = planner();
+
+	if ((map = regmap_compile(&table, &cost)) == NULL || regmap_fields(map, NULL, &fields))
+	{
+		perror("regmap");
+		return 1;
+	}
+
+	rc |= check(map, &fields, ones, "energy import=184467440737095516.15,net=-0.01 1\n");
+	rc |= check(map, &fields, high, "energy import=92233720368547758.08,net=-92233720368547758.08 1\n");
+	rc |= check(map, &fields, low,  "energy import=123.45,net=0.01 1\n");
+
+	influx_fields_free(&fields);
+	regmap_free(map);
+
+	return rc;
+}
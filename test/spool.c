@@ -0,0 +1,402 @@
+
+/*
+ * test/spool.c
+ * lucas@pamorana.net (2024)
+ *
+ * Checks of spool recovery and eviction, run by "make check".
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*---------------------------------------------------------------------------*\
+|*                                  HEADERS                                  *|
+\*---------------------------------------------------------------------------*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <zlib.h>
+
+#include "influx.h"
+#include "spool.h"
+
+/*---------------------------------------------------------------------------*\
+|*                                  HELPERS                                  *|
+\*---------------------------------------------------------------------------*/
+
+/* every record is 48 bytes of payload, 64 bytes on disk */
+#define LINE_BYTES  48U
+#define REC_BYTES   64U
+
+/* four records to a segment, and two segments to the spool */
+static const struct spool_config config = \
+{
+	.segment_bytes = 4U * REC_BYTES,
+	.max_bytes     = 8U * REC_BYTES,
+	.sync_bytes    = 1U << 20,
+};
+
+static char base[] = "/tmp/spool.XXXXXX";
+
+
+/*
+ * line:
+ *   the payload of record number "n".
+ */
+static void line (char out[static LINE_BYTES + 1U], unsigned n)
+{
+	snprintf(out, LINE_BYTES + 1U, "spool n=%03ui %034u\n", n, n);
+}
+
+
+/*
+ * fill:
+ *   append records [from, to) to "sp". returns 0 on success.
+ */
+static int fill (struct spool *sp, unsigned from, unsigned to)
+{
+	char buf[LINE_BYTES + 1U];
+
+	for (unsigned n=from; n < to; n++)
+	{
+		line(buf, n);
+
+		if (spool_append(sp, buf, LINE_BYTES, 1) == -1)
+		{
+			perror("spool_append");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * expect:
+ *   peek at most "max" bytes from "sp", and compare them to records [from, to).
+ *   returns 0 if they are the same.
+ */
+static int expect (const char *what, struct spool *sp, size_t max, unsigned from, unsigned to)
+{
+	struct influx_buffer out  = { 0 };
+	struct influx_buffer want = { 0 };
+
+	char buf[LINE_BYTES + 1U];
+	int  num = spool_peek(sp, &out, max);
+	int  rc;
+
+	for (unsigned n=from; n < to; n++)
+	{
+		line(buf, n);
+
+		if (influx_buffer_reserve(&want, LINE_BYTES))
+			return -1;
+
+		memcpy(&want.mem[want.len], buf, LINE_BYTES);
+		want.len += LINE_BYTES;
+	}
+
+	rc = (num != (int) (to - from) || out.len != want.len || memcmp(out.mem, want.mem, want.len) != 0);
+
+	if (rc)
+		fprintf(stderr, "%s: want records [%u, %u), got %d record(s), %zu bytes\n", what, from, to, num, out.len);
+
+	influx_buffer_free(&out);
+	influx_buffer_free(&want);
+
+	return rc;
+}
+
+
+/*
+ * segment:
+ *   open segment "seq" in "dir". returns -1 on errors.
+ */
+static int segment (const char *dir, uint64_t seq)
+{
+	char path[256];
+
+	snprintf(path, sizeof(path), "%s/%016" PRIx64 ".seg", dir, seq);
+
+	return open(path, O_RDWR);
+}
+
+
+/*
+ * crash:
+ *   append records [0, n) to a new spool in "dir" from a child process,
+ *   which exits without closing it: the segment is left unsealed, with
+ *   its preallocated tail still zero. returns 0 on success.
+ */
+static int crash (const char *dir, unsigned n)
+{
+	pid_t pid;
+	int   status;
+
+	if ((pid = fork()) == 0)
+	{
+		struct spool *sp = spool_open(dir, &config);
+
+		_exit(sp == NULL || fill(sp, 0, n) != 0);
+	}
+
+	if (pid == -1 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status))
+	{
+		fprintf(stderr, "%s: the crashing child failed\n", dir);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * wipe:
+ *   delete "dir", and the segments in it.
+ */
+static void wipe (const char *dir)
+{
+	struct dirent *ent;
+	DIR           *dp;
+
+	if ((dp = opendir(dir)) == NULL)
+		return;
+
+	while ((ent = readdir(dp)))
+		if (ent->d_name[0] != '.')
+			unlinkat(dirfd(dp), ent->d_name, 0);
+
+	closedir(dp);
+	rmdir(dir);
+}
+
+/*---------------------------------------------------------------------------*\
+|*                                   TESTS                                   *|
+\*---------------------------------------------------------------------------*/
+
+/*
+ * reopen:
+ *   open the spool in "dir", and check that it holds records [from, to).
+ *   returns 0 if it does.
+ */
+static int reopen (const char *dir, unsigned from, unsigned to)
+{
+	struct spool *sp = spool_open(dir, &config);
+
+	int rc;
+
+	if (sp == NULL)
+	{
+		perror(dir);
+		return 1;
+	}
+
+	if ((rc = expect(dir, sp, SIZE_MAX, from, to)) == 0 && sp->records != to - from)
+	{
+		fprintf(stderr, "%s: %zu record(s) left, want %u\n", dir, sp->records, to - from);
+		rc = 1;
+	}
+
+	spool_close(sp);
+
+	return rc;
+}
+
+
+/* records that were delivered are skipped, the live one after them is not */
+static int done (void)
+{
+	struct spool *sp;
+
+	char dir[sizeof(base) + 8];
+
+	int rc;
+
+	snprintf(dir, sizeof(dir), "%s/done", base);
+
+	if ((sp = spool_open(dir, &config)) == NULL || fill(sp, 0, 3))
+		return 1;
+
+	rc = expect(dir, sp, 2U * LINE_BYTES, 0, 2);
+
+	spool_consume(sp);
+	spool_close(sp);
+
+	rc |= reopen(dir, 2, 3);
+
+	wipe(dir);
+
+	return rc;
+}
+
+
+/* a segment that was never sealed ends at its zero tail */
+static int zero (void)
+{
+	char dir[sizeof(base) + 8];
+
+	int rc;
+
+	snprintf(dir, sizeof(dir), "%s/zero", base);
+
+	rc = crash(dir, 2) || reopen(dir, 0, 2);
+
+	wipe(dir);
+
+	return rc;
+}
+
+
+/* a header written without all of its payload ends the segment */
+static int torn (void)
+{
+	struct spool_record rec = { .magic = SPOOL_LIVE, .len = LINE_BYTES, .lines = 1 };
+
+	char dir[sizeof(base) + 8];
+	char buf[LINE_BYTES + 1U];
+
+	uLong crc = crc32(0L, Z_NULL, 0);
+
+	int fd;
+	int rc;
+
+	snprintf(dir, sizeof(dir), "%s/torn", base);
+
+	line(buf, 2);
+
+	crc = crc32(crc, (const Bytef *) &rec.len,   sizeof(rec.len));
+	crc = crc32(crc, (const Bytef *) &rec.lines, sizeof(rec.lines));
+	crc = crc32(crc, (const Bytef *) buf,        LINE_BYTES);
+
+	rec.crc = (uint32_t) crc;
+
+	if (crash(dir, 2) || (fd = segment(dir, 0)) == -1)
+		return 1;
+
+	rc = pwrite(fd, &rec, sizeof(rec), 2 * REC_BYTES) != sizeof(rec)
+	  || pwrite(fd, buf, LINE_BYTES / 2U, 2 * REC_BYTES + sizeof(rec)) != LINE_BYTES / 2U;
+
+	close(fd);
+
+	rc = rc || reopen(dir, 0, 2);
+
+	wipe(dir);
+
+	return rc;
+}
+
+
+/* a record that doesn't match its checksum ends the segment */
+static int corrupt (void)
+{
+	struct spool *sp;
+
+	char dir[sizeof(base) + 8];
+	char c;
+
+	int fd;
+	int rc;
+
+	snprintf(dir, sizeof(dir), "%s/crc", base);
+
+	if ((sp = spool_open(dir, &config)) == NULL || fill(sp, 0, 3))
+		return 1;
+
+	spool_close(sp);
+
+	if ((fd = segment(dir, 0)) == -1)
+		return 1;
+
+	/* flip a bit in the payload of the second record */
+	rc = pread(fd, &c, 1, REC_BYTES + sizeof(struct spool_record) + 8U) != 1;
+	c ^= 1;
+	rc = rc || pwrite(fd, &c, 1, REC_BYTES + sizeof(struct spool_record) + 8U) != 1;
+
+	close(fd);
+
+	rc = rc || reopen(dir, 0, 1);
+
+	wipe(dir);
+
+	return rc;
+}
+
+
+/* evicting the segment a peek started in only marks what is left of the peek */
+static int evict (void)
+{
+	struct spool *sp;
+
+	char dir[sizeof(base) + 8];
+
+	int rc;
+
+	snprintf(dir, sizeof(dir), "%s/evict", base);
+
+	if ((sp = spool_open(dir, &config)) == NULL || fill(sp, 0, 6))
+		return 1;
+
+	/* [0, 4) in the oldest segment, and one from the next */
+	rc = expect(dir, sp, 5U * LINE_BYTES, 0, 5);
+
+	/* the ninth record needs a third segment, and evicts the first */
+	rc |= fill(sp, 6, 9);
+	rc |= (sp->nsegs != 2 || sp->evicted != 4);
+
+	spool_consume(sp);
+
+	rc |= (sp->records != 4);
+	rc |= expect(dir, sp, SIZE_MAX, 5, 9);
+
+	if (rc)
+		fprintf(stderr, "%s: %zu segment(s), %zu record(s), %zu evicted\n", dir, sp->nsegs, sp->records, sp->evicted);
+
+	spool_close(sp);
+
+	wipe(dir);
+
+	return rc;
+}
+
+
+int main (void)
+{
+	int rc = 0;
+
+	if (mkdtemp(base) == NULL)
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+
+	rc |= done();
+	rc |= zero();
+	rc |= torn();
+	rc |= corrupt();
+	rc |= evict();
+
+	rmdir(base);
+
+	return rc;
+}